@@ -36,6 +36,7 @@ public:
 	uint8_t *m_pCodeSignSegment;
 	uint8_t *m_pLinkEditSegment;
 	uint32_t m_uLoadCommandsFreeSpace;
+	uint64_t m_uExecSegLimit;
 	mach_header *m_pHeader;
 	uint32_t m_uHeaderSize;
 };
@@ -3,6 +3,7 @@
 #include "utils/json.h"
 #include "crypto/openssl.h"
 #include <vector>
+#include <mutex>
 
 // Global function for finding app folders
 bool FindAppFolder(const string &strFolder, string &strAppFolder);
@@ -22,8 +23,29 @@ public:
                   bool bWeakInject, bool bEnableCache,
                   bool dontGenerateEmbeddedMobileProvision);
 
+  // Digests computed while extracting into strFolder, keyed by path relative
+  // to it. CodeResources uses them instead of reading the files again, until
+  // signing rewrites a file.
+  void SetFileDigests(const string &strFolder,
+                      const map<string, ZFileDigest> &mapDigests);
+
+  // Files that sparse extraction left inside the input archive, relative to
+  // the same folder. They are listed as if they were on disk.
+  void SetArchiveFiles(const set<string> &setFiles);
+  const set<string> &GetArchiveFiles() const;
+
+  // Absolute paths of the files the last SignFolder() created or rewrote
+  const set<string> &GetModifiedFiles() const;
+
+  // Workers signing independent nested bundles and files at once (0 = auto)
+  void SetThreadCount(int nThreads);
+
 private:
   bool SignNode(JValue &jvNode);
+  bool SignNodeFile(const string &strFile);
+  string GetSignCacheKey(const string &strFile, const string &strContext);
+  bool SignNodeFolder(JValue &jvNode);
+  void AddModifiedFile(const string &strFile);
   void GetNodeChangedFiles(JValue &jvNode, bool dontGenerateEmbeddedMobileProvision);
   void GetChangedFiles(JValue &jvNode, vector<string> &arrChangedFiles);
   void GetPlugIns(const string &strFolder, vector<string> &arrPlugIns);
@@ -39,12 +61,20 @@ private:
   bool GenerateCodeResources(const string &strFolder, JValue &jvCodeRes);
   void GetFolderFiles(const string &strFolder, const string &strBaseFolder,
                       set<string> &setFiles);
+  void GetArchiveFolderFiles(const string &strFolder, set<string> &setFiles);
+  bool GetFileDigest(const string &strFile, ZFileDigest &digest);
 
 private:
   bool m_bForceSign;
   bool m_bWeakInject;
   vector<string> arrDyLibPaths;
   arksigningAsset *m_pSignAsset;
+  string m_strArchiveFolder;
+  map<string, ZFileDigest> m_mapFileDigests;
+  set<string> m_setArchiveFiles;
+  set<string> m_setModifiedFiles;
+  mutex m_mutexModified;
+  int m_nThreads;
 
 public:
   string m_strAppFolder;
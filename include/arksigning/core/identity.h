@@ -0,0 +1,73 @@
+#pragma once
+#include "utils/common.h"
+#include "utils/json.h"
+#include "crypto/openssl.h"
+#include <mutex>
+#include <memory>
+
+// Files a signing identity is loaded from
+struct ZSigningIdentity
+{
+    string strCertFile;
+    string strPKeyFile;
+    string strProvFile;
+    string strEntitlementsFile;
+    string strPassword;
+
+    string GetKey() const;
+    // Take "cert", "pkey", "prov", "entitlements" and "password" from a
+    // request or manifest line, returns false when it names none
+    bool Apply(const JValue &jvObject);
+};
+
+// The signing identities of one process. Each is parsed once; its key and
+// certificate are then shared read-only by every thread that signs with it.
+// Identities listed in an --identities file can also be picked by their
+// "name", their team id or the name of their provisioning profile.
+class ZIdentityRegistry
+{
+public:
+    ZIdentityRegistry();
+
+    ZIdentityRegistry(const ZIdentityRegistry &) = delete;
+    ZIdentityRegistry &operator=(const ZIdentityRegistry &) = delete;
+
+public:
+    // Pin the CMS signing time of identities loaded from now on, 0 takes
+    // each certificate's notBefore (--deterministic)
+    void SetDeterministic(time_t tEpoch);
+    // One JSON object per line. With bLazy an identity is parsed the first
+    // time a job asks for it instead of up front.
+    bool LoadFile(const string &strFile, bool bLazy);
+    size_t GetCount();
+
+    // NULL when the identity can't be loaded, which is remembered
+    arksigningAsset *Get(const ZSigningIdentity &identity);
+    // NULL when no listed identity or more than one matches
+    arksigningAsset *Find(const string &strName);
+
+private:
+    // Parsed under its own mtxLoad, so loading one identity doesn't hold up
+    // jobs that use another
+    struct Entry
+    {
+        ZSigningIdentity identity;
+        mutex mtxLoad;
+        unique_ptr<arksigningAsset> pAsset;
+        bool bLoaded;
+    };
+
+    // With m_mutex held
+    Entry *AddEntry(const ZSigningIdentity &identity);
+    // Without m_mutex held
+    arksigningAsset *LoadEntry(Entry *pEntry);
+
+private:
+    // Guards the maps and settings, never held while an identity is parsed
+    mutex m_mutex;
+    bool m_bDeterministic;
+    time_t m_tEpoch;
+    map<string, unique_ptr<Entry>> m_mapEntries;
+    map<string, Entry *> m_mapNames;
+    vector<Entry *> m_arrListed;
+};
@@ -0,0 +1,35 @@
+#pragma once
+#include "utils/common.h"
+#include "utils/json.h"
+#include <mutex>
+
+// Append-only record of the jobs a bulk run finished, kept in the output
+// folder so a rerun can skip what is already done. Each entry is one JSON
+// line written with a single O_APPEND write and synced before the job
+// counts as done, so a crash leaves at most a torn last line, which is
+// ignored when the journal is read back.
+class ZSignJournal
+{
+public:
+    ZSignJournal();
+    ~ZSignJournal();
+
+    ZSignJournal(const ZSignJournal &) = delete;
+    ZSignJournal &operator=(const ZSignJournal &) = delete;
+
+public:
+    bool Open(const string &strFile);
+    bool IsOpen() const;
+
+    // The last entry recorded for an output file
+    bool Find(const string &strOutput, JValue &jvEntry);
+    bool Append(const JValue &jvEntry);
+
+    // Hex SHA-256 of a file's content
+    static bool HashFile(const string &strFile, string &strHash);
+
+private:
+    int m_fd;
+    mutex m_mutex;
+    map<string, JValue> m_mapEntries;
+};
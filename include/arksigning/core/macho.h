@@ -15,6 +15,9 @@ public:
 	bool Sign(arksigningAsset *pSignAsset, bool bForce, string strBundleId, string strInfoPlistSHA1, string strInfoPlistSHA256, const string &strCodeResourcesData);
 	bool InjectDyLib(bool bWeakInject, const char *szDyLibPath, bool &bCreate);
 
+	// Check the leading magic of a thin or fat Mach-O image
+	static bool IsMachO(const uint8_t *pData, size_t sSize);
+
 private:
 	bool OpenFile(const char *szPath);
 	bool CloseFile();
@@ -0,0 +1,55 @@
+#pragma once
+#include "utils/common.h"
+#include <mutex>
+#include <condition_variable>
+
+// Finds the ipas and app folders under a bulk input folder. Each folder is a
+// work item for a pool of threads, so wide or deep trees are listed in
+// parallel, and every find is handed to the callback as soon as it is seen,
+// on whichever worker found it.
+class ZInputScanner
+{
+public:
+    // strInput is the ipa or .app to sign, strRelPath the ipa or the folder
+    // holding the app, relative to the scanned folder
+    typedef function<void(const string &strInput, const string &strRelPath, bool bZipFile)> FoundHandler;
+
+public:
+    ZInputScanner();
+
+    ZInputScanner(const ZInputScanner &) = delete;
+    ZInputScanner &operator=(const ZInputScanner &) = delete;
+
+public:
+    // Walk subfolders instead of taking each top-level folder as one app
+    void SetRecursive(bool bRecursive);
+    // fnmatch() patterns for paths relative to the scanned folder, where *
+    // also matches '/'. Excluded folders aren't walked; with includes, only
+    // matching inputs are reported.
+    void AddInclude(const string &strPattern);
+    void AddExclude(const string &strPattern);
+    // Never walk this folder, e.g. an output folder inside the input
+    void SkipFolder(const string &strFolder);
+
+    bool Scan(const string &strFolder, int nThreads, const FoundHandler &handler);
+
+private:
+    bool IsWanted(const string &strRelPath, bool bInput) const;
+    void ScanFolder(const string &strRelFolder);
+    void ProbeFolder(const string &strRelFolder);
+    void RunWorker();
+
+private:
+    bool m_bRecursive;
+    vector<string> m_arrIncludes;
+    vector<string> m_arrExcludes;
+    set<string> m_setSkipFolders;
+
+    string m_strRoot;
+    FoundHandler m_handler;
+    mutex m_mutex;
+    condition_variable m_cv;
+    vector<pair<string, bool>> m_arrPending; // folder, probe for an app instead of listing
+    int m_nBusy;
+    bool m_bRootFailed;
+};
@@ -0,0 +1,59 @@
+#pragma once
+#include "utils/common.h"
+#include "utils/json.h"
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <memory>
+#include <queue>
+
+// Long-running signing service on a Unix domain socket (--serve). Identities
+// are loaded once and requests from any number of clients share one pool of
+// workers. The wire format is one JSON object per line in both directions:
+// a client writes requests, the service answers each with event lines that
+// end with {"event": "done", "ok": ...}. Events carry the request's "id" when
+// it has one, so a client may keep several requests in flight.
+class ZSignServer
+{
+public:
+    typedef function<void(const JValue &jvEvent)> EventSink;
+    // Runs one request on a worker, reporting progress through sink
+    typedef function<bool(const JValue &jvRequest, const EventSink &sink, string &strError)> RequestHandler;
+
+public:
+    ZSignServer();
+    ~ZSignServer();
+
+    ZSignServer(const ZSignServer &) = delete;
+    ZSignServer &operator=(const ZSignServer &) = delete;
+
+public:
+    bool Listen(const string &strSocketPath);
+    // Serve until SIGINT or SIGTERM, running up to nWorkers requests at once
+    bool Run(const RequestHandler &handler, int nWorkers);
+
+    // Client side: send one request and pass its events to sink until done
+    static bool Submit(const string &strSocketPath, const JValue &jvRequest, const EventSink &sink);
+
+private:
+    struct Connection;
+    struct Request
+    {
+        shared_ptr<Connection> pConnection;
+        JValue jvRequest;
+    };
+
+    void ReadConnection(shared_ptr<Connection> pConnection);
+    void RunWorker(const RequestHandler &handler);
+
+private:
+    int m_fdListen;
+    string m_strSocketPath;
+
+    mutex m_mutex;
+    condition_variable m_cv;
+    queue<Request> m_queRequests;
+    bool m_bStopping;
+    int m_nReaders;
+    vector<shared_ptr<Connection>> m_arrConnections;
+};
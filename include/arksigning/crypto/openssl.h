@@ -21,8 +21,16 @@ public:
 	bool GenerateCMS(const string &strCDHashData, const string &strCDHashesPlist, const string &strCodeDirectorySlotSHA1, const string &strAltnateCodeDirectorySlot256, string &strCMSOutput);
 	bool Init(const string &strSignerCertFile, const string &strSignerPKeyFile, const string &strProvisionFile, const string &strEntitlementsFile, const string &strPassword);
 
+	// Fixed CMS signing time for reproducible signatures, 0 stamps the current time
+	void SetSigningTime(time_t tSigningTime);
+	time_t GetCertNotBefore() const;
+	// Hex digest of everything a signature made with this identity depends
+	// on: certificate, team, profile, entitlements and the pinned signing time
+	string GetFingerprint() const;
+
 public:
 	string m_strTeamId;
+	string m_strProfileName;
 	string m_strSubjectCN;
 	string m_strProvisionData;
 	string m_strEntitlementsData;
@@ -30,4 +38,5 @@ public:
 private:
 	void *m_evpPKey;
 	void *m_x509Cert;
+	time_t m_tSigningTime;
 };
\ No newline at end of file
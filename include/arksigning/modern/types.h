@@ -7,6 +7,7 @@
 #include <map>
 #include <set>
 #include <functional>
+#include <memory>
 
 namespace ArkSigning {
 namespace Types {
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "utils/common.h"
+
+// Reads many small files with a handful of system calls. On Linux the opens,
+// reads and closes of a batch are queued on an io_uring and submitted together;
+// elsewhere, or when the kernel refuses io_uring, every file goes through plain
+// open/read/close. Either way one buffer is reused for the whole batch instead
+// of mapping every file. An instance owns its ring, so give every worker thread
+// its own.
+class ZBatchIO
+{
+public:
+    ZBatchIO();
+    ~ZBatchIO();
+
+    ZBatchIO(const ZBatchIO &) = delete;
+    ZBatchIO &operator=(const ZBatchIO &) = delete;
+
+public:
+    // Called once per path, in order, with the whole file or with nError (an
+    // errno) when it couldn't be read. pData is only valid during the call.
+    typedef function<void(size_t uIndex, const uint8_t *pData, size_t sLength, int nError)> ReadSink;
+
+    void ReadFiles(const vector<string> &arrPaths, const ReadSink &sink);
+    bool IsUring() const;
+
+public:
+    // Files up to this size are read in one go, bigger ones are mapped
+    static size_t GetMaxFileSize();
+    static void SetUringEnabled(bool bEnable);
+
+private:
+    bool InitRing();
+    void FreeRing();
+    // Drops a ring that failed. Unless bDrained, the kernel may still write to
+    // m_arrBuffer, which is then left to it and replaced.
+    void AbandonRing(bool bDrained);
+    bool ReadBatch(const vector<string> &arrPaths, size_t uBegin, size_t uEnd, const ReadSink &sink);
+
+private:
+    void *m_pRing;
+    vector<uint8_t> m_arrBuffer;
+
+    static atomic<bool> s_bUringEnabled;
+};
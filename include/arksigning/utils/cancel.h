@@ -0,0 +1,64 @@
+#pragma once
+
+#include "utils/common.h"
+#include <mutex>
+
+// Stops a job that is taking too long. Code working for a job polls
+// IsCurrentCancelled() between units of work (pages, files, blocks) and gives
+// up with an error once it is set, so nothing is torn down from outside. A
+// token is cancelled explicitly or when the job runs past its wall-clock or
+// CPU limit. The CPU time of every thread that polls the token counts; the
+// wall clock only runs while the job isn't paused waiting for its turn.
+//
+// A thread works for the token of the innermost ZCancelScope it is in. Code
+// that starts threads for the job hands its token to them the same way.
+class ZCancelToken
+{
+public:
+    ZCancelToken();
+
+    ZCancelToken(const ZCancelToken &) = delete;
+    ZCancelToken &operator=(const ZCancelToken &) = delete;
+
+public:
+    // Limits in microseconds, 0 for none. The wall clock starts now.
+    void Start(uint64_t uWallLimit, uint64_t uCPULimit);
+    // Stop and restart the wall clock around time spent queued
+    void Pause();
+    void Resume();
+    void Cancel(const string &strReason);
+    bool IsCancelled();
+    string GetReason();
+
+    void AddCPUTime(uint64_t uCPUTime);
+    uint64_t GetCPUTime() const;
+
+public:
+    static ZCancelToken *GetCurrent();
+    static bool IsCurrentCancelled();
+
+private:
+    atomic<bool> m_bCancelled;
+    atomic<uint64_t> m_uCPUTime;
+    uint64_t m_uWallLimit;
+    atomic<uint64_t> m_uWallUsed;
+    atomic<uint64_t> m_uRunningSince;
+    uint64_t m_uCPULimit;
+    mutex m_mutex;
+    string m_strReason;
+};
+
+// Makes pToken the calling thread's token until the scope ends. NULL works
+// for no job, so nothing is ever cancelled.
+class ZCancelScope
+{
+public:
+    explicit ZCancelScope(ZCancelToken *pToken);
+    ~ZCancelScope();
+
+    ZCancelScope(const ZCancelScope &) = delete;
+    ZCancelScope &operator=(const ZCancelScope &) = delete;
+
+private:
+    ZCancelToken *m_pPrevious;
+};
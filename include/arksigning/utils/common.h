@@ -48,6 +48,7 @@ bool WriteFile(const char *szFile, const string &strData);
 bool WriteFile(const char *szFile, const char *szData, size_t sLen);
 bool WriteFile(string &strData, const char *szFormatPath, ...);
 bool WriteFile(const char *szData, size_t sLen, const char *szFormatPath, ...);
+bool CopyFileContent(const char *szSrcFile, const char *szDstFile);
 bool AppendFile(const char *szFile, const string &strData);
 bool AppendFile(const char *szFile, const char *szData, size_t sLen);
 bool AppendFile(const string &strData, const char *szFormatPath, ...);
@@ -56,6 +57,8 @@ bool IsFolder(const char *szFolder);
 bool IsFolderV(const char *szFormatPath, ...);
 bool CreateFolder(const char *szFolder);
 bool CreateFolderV(const char *szFormatPath, ...);
+// Create a folder and any missing parents
+void CreateFolderTree(const string &strFolder);
 bool RemoveFile(const char *szFile);
 bool RemoveFileV(const char *szFormatPath, ...);
 bool RemoveFolder(const char *szFolder);
@@ -65,6 +68,7 @@ bool IsFileExistsV(const char *szFormatPath, ...);
 int64_t GetFileSize(int fd);
 int64_t GetFileSize(const char *szFile);
 int64_t GetFileSizeV(const char *szFormatPath, ...);
+int64_t GetFolderSize(const char *szFolder); // regular files below it, symlinks not followed
 string GetFileSizeString(const char *szFile);
 
 // Modern optional-based versions for safer null handling
@@ -83,6 +87,7 @@ void ProcessFilesInParallel(const vector<string>& files,
 bool IsZipFile(const char *szFile);
 string GetCanonicalizePath(const char *szPath);
 void *MapFile(const char *path, size_t offset, size_t size, size_t *psize, bool ro);
+bool AdviseWillNeed(const char *szFile, uint64_t uLength); // start reading the first uLength bytes into the page cache
 bool IsPathSuffix(const string &strPath, const char *suffix);
 
 const char *StringFormat(string &strFormat, const char *szFormatArgs, ...);
@@ -90,6 +95,7 @@ string &StringReplace(string &context, const string &from, const string &to);
 void StringSplit(const string &src, const string &split, vector<string> &dest);
 
 string FormatSize(int64_t size, int64_t base = 1024);
+bool ParseSize(const char *szSize, uint64_t &uSize, uint64_t base = 1024); // "512M", "2G", plain bytes, false for anything else
 time_t GetUnixStamp();
 uint64_t GetMicroSecond();
 bool SystemExec(const char *szFormatCmd, ...);
@@ -113,6 +119,33 @@ void PrintSHASum(const char *prefix, const string &strSHASum, const char *suffix
 void PrintDataSHASum(const char *prefix, int nSumType, const string &strData, const char *suffix = "\n");
 void PrintDataSHASum(const char *prefix, int nSumType, uint8_t *data, size_t size, const char *suffix = "\n");
 
+// SHA-1 and SHA-256 of a file, base64 encoded as they appear in CodeResources
+struct ZFileDigest
+{
+    string strSHA1Base64;
+    string strSHA256Base64;
+};
+
+// Incremental SHA-1 + SHA-256 over data that arrives in pieces
+class ZSHASum
+{
+public:
+    ZSHASum();
+    ~ZSHASum();
+
+    ZSHASum(const ZSHASum &) = delete;
+    ZSHASum &operator=(const ZSHASum &) = delete;
+
+public:
+    void Update(const uint8_t *pData, size_t sLength);
+    void Final(string &strSHA1, string &strSHA256);
+    void FinalBase64(ZFileDigest &digest);
+
+private:
+    void *m_pSHA1Ctx;
+    void *m_pSHA256Ctx;
+};
+
 class ZBuffer
 {
 public:
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "utils/common.h"
+#include <mutex>
+
+// Folder of files kept across runs under a key, used for the signed
+// executables of frameworks and dylibs that many apps embed unchanged.
+// Entries are written under a temporary name and renamed into place, so
+// processes can share the folder. When the total size outgrows the budget,
+// the entries used longest ago are removed.
+class ZFileCache
+{
+public:
+    static bool SetFolder(const string &strFolder, uint64_t uBudget);
+    static bool IsEnabled();
+
+    // Replace strFile with the entry for strKey and the mode it was stored with
+    static bool Load(const string &strKey, const string &strFile);
+    static void Store(const string &strKey, const string &strFile);
+
+private:
+    static string GetEntryPath(const string &strKey);
+    static void Trim();
+
+private:
+    struct Entry
+    {
+        uint64_t uSize;
+        time_t tUsed;
+    };
+
+    static mutex s_mutex;
+    static string s_strFolder;
+    static uint64_t s_uBudget;
+    static uint64_t s_uUsed;
+    static map<string, Entry> s_mapEntries;
+};
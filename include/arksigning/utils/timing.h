@@ -0,0 +1,89 @@
+#pragma once
+
+#include "utils/common.h"
+#include "utils/json.h"
+
+// Where one job's time went, split by phase, plus a few work counters. Phase
+// times are summed over the threads a phase runs on, so for parallel phases
+// they can add up to more than the job's wall time.
+//
+// Like ZCancelToken, a job's timing is bound to the calling thread with a
+// ZTimingScope and handed to the threads the job starts the same way. A
+// ZPhaseTimer on a thread without one records nothing.
+class ZJobTiming
+{
+public:
+    enum ePhase
+    {
+        E_PHASE_EXTRACT,
+        E_PHASE_SCAN,
+        E_PHASE_CODE_RESOURCES,
+        E_PHASE_MACHO_HASH,
+        E_PHASE_CMS,
+        E_PHASE_ARCHIVE,
+        E_PHASE_COUNT
+    };
+
+    enum eCounter
+    {
+        E_COUNT_FILES_SEALED,
+        E_COUNT_FILES_HASHED,
+        E_COUNT_MACHO_BYTES_HASHED,
+        E_COUNT_COUNT
+    };
+
+public:
+    ZJobTiming();
+
+    ZJobTiming(const ZJobTiming &) = delete;
+    ZJobTiming &operator=(const ZJobTiming &) = delete;
+
+public:
+    void AddTime(ePhase ePhase, uint64_t uMicros);
+    void AddCount(eCounter eCounter, uint64_t uCount);
+    uint64_t GetTime(ePhase ePhase) const;
+    uint64_t GetCount(eCounter eCounter) const;
+
+    // {"phases_ms": {...}} with one key per phase, then one per counter
+    void Write(JValue &jvTiming) const;
+    // Sums jvTiming from Write() into jvTotals
+    static void AddTo(const JValue &jvTiming, JValue &jvTotals);
+
+public:
+    static ZJobTiming *GetCurrent();
+    static void AddCurrentCount(eCounter eCounter, uint64_t uCount);
+
+private:
+    atomic<uint64_t> m_arrTimes[E_PHASE_COUNT];
+    atomic<uint64_t> m_arrCounts[E_COUNT_COUNT];
+};
+
+// Makes pTiming the calling thread's timing until the scope ends
+class ZTimingScope
+{
+public:
+    explicit ZTimingScope(ZJobTiming *pTiming);
+    ~ZTimingScope();
+
+    ZTimingScope(const ZTimingScope &) = delete;
+    ZTimingScope &operator=(const ZTimingScope &) = delete;
+
+private:
+    ZJobTiming *m_pPrevious;
+};
+
+// Adds its own lifetime to a phase of the calling thread's timing
+class ZPhaseTimer
+{
+public:
+    explicit ZPhaseTimer(ZJobTiming::ePhase ePhase);
+    ~ZPhaseTimer();
+
+    ZPhaseTimer(const ZPhaseTimer &) = delete;
+    ZPhaseTimer &operator=(const ZPhaseTimer &) = delete;
+
+private:
+    ZJobTiming *m_pTiming;
+    ZJobTiming::ePhase m_ePhase;
+    uint64_t m_uBeginTime;
+};
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "utils/common.h"
+
+// NUMA nodes of the host and the CPUs the process may run on in each of them,
+// read from /sys/devices/system/node on Linux. Elsewhere, or when the kernel
+// has no NUMA support, everything is one node holding all CPUs.
+class ZCpuTopology
+{
+public:
+    bool Load();
+
+    size_t GetNodeCount() const;
+    int GetNodeId(size_t uNode) const;
+    const vector<int> &GetNodeCpus(size_t uNode) const;
+
+    // Run the calling thread on uNode's CPUs only and take new pages from its
+    // memory. Threads it starts afterwards inherit both.
+    bool BindThread(size_t uNode) const;
+
+private:
+    struct Node
+    {
+        int nId;
+        vector<int> arrCpus;
+    };
+
+    vector<Node> m_arrNodes;
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "utils/common.h"
+#include <mutex>
+
+// Scratch folder for unpacking one app. Names come from mkdtemp() so concurrent
+// jobs never collide. When a RAM-backed root (tmpfs) is configured, a job is placed
+// there as long as its expected size fits the shared budget and spills to the disk
+// root otherwise. The folder and its reservation are released on destruction.
+class ZWorkspace
+{
+public:
+    ZWorkspace();
+    ~ZWorkspace();
+
+    ZWorkspace(const ZWorkspace &) = delete;
+    ZWorkspace &operator=(const ZWorkspace &) = delete;
+
+public:
+    bool Create(const char *szPrefix, uint64_t uExpectedSize);
+    void Remove();
+
+    const string &GetFolder() const;
+    bool IsInMemory() const;
+
+public:
+    static bool SetRoot(const string &strFolder);
+    static bool SetMemoryRoot(const string &strFolder, uint64_t uBudget);
+    static const string &GetRoot();
+
+private:
+    static bool Reserve(uint64_t uSize);
+    static void Release(uint64_t uSize);
+
+private:
+    string m_strFolder;
+    uint64_t m_uReserved;
+    bool m_bInMemory;
+
+    static mutex s_mutex;
+    static string s_strRoot;
+    static string s_strMemoryRoot;
+    static uint64_t s_uMemoryBudget;
+    static uint64_t s_uMemoryUsed;
+};
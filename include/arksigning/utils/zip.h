@@ -0,0 +1,188 @@
+#pragma once
+
+#include "utils/common.h"
+#include "utils/batchio.h"
+#include <mutex>
+
+// A single central directory record of a ZIP (IPA) archive
+struct ZZipEntry
+{
+    string strName;
+    uint16_t uVersionMadeBy;
+    uint16_t uFlags;
+    uint16_t uMethod;
+    uint16_t uModTime;
+    uint16_t uModDate;
+    uint32_t uCRC32;
+    uint32_t uExternalAttr;
+    uint64_t uCompressedSize;
+    uint64_t uUncompressedSize;
+    uint64_t uLocalHeaderOffset;
+
+    bool IsFolder() const;
+    bool IsSymLink() const;
+    uint32_t GetMode() const;
+};
+
+// Decides whether an entry is written to disk, given the first inflated bytes of its data
+typedef function<bool(const ZZipEntry &entry, const uint8_t *pHead, size_t sHeadLength)> ZZipExtractFilter;
+
+// Read-only view of a ZIP archive backed by a mmap of the whole file.
+// The central directory is parsed once in Open(), entries are inflated
+// straight from the mapping so several threads can read at the same time.
+class ZZipReader
+{
+public:
+    ZZipReader();
+    ~ZZipReader();
+
+    ZZipReader(const ZZipReader &) = delete;
+    ZZipReader &operator=(const ZZipReader &) = delete;
+
+public:
+    bool Open(const char *szFile);
+    void Close();
+
+    const vector<ZZipEntry> &GetEntries() const;
+    const vector<string> &GetErrors() const;
+    uint64_t GetUncompressedSize() const;
+
+    // Stream the inflated data of an entry to sink, verifying its CRC-32
+    bool ReadEntry(const ZZipEntry &entry, const function<bool(const uint8_t *, size_t)> &sink, string &strError);
+    bool ReadEntry(const ZZipEntry &entry, string &strData);
+
+    // Inflate every entry into strFolder using nThreadCount workers (0 = auto).
+    // Failures are reported per entry through GetErrors(). With mapDigests the
+    // SHA-1/SHA-256 of every file is computed on the fly, keyed by entry name.
+    bool ExtractAll(const string &strFolder, int nThreadCount = 0);
+    bool ExtractAll(const string &strFolder, map<string, ZFileDigest> &mapDigests, int nThreadCount = 0);
+
+    // Like ExtractAll, but only folders, symlinks and files accepted by filter reach
+    // the disk. Every file is hashed, the names of the ones left out are returned
+    // in setSkipped.
+    bool ExtractSparse(const string &strFolder, const ZZipExtractFilter &filter, map<string, ZFileDigest> &mapDigests, set<string> &setSkipped, int nThreadCount = 0);
+
+    // Locate the raw (possibly compressed) bytes of an entry inside the mapping
+    bool GetEntryData(const ZZipEntry &entry, const uint8_t *&pData, string &strError);
+
+private:
+    bool ReadCentralDirectory();
+    bool Extract(const string &strFolder, const ZZipExtractFilter *pFilter, map<string, ZFileDigest> *pDigests, set<string> *pSkipped, int nThreadCount);
+    bool ExtractEntry(const string &strFolder, const ZZipEntry &entry, const ZZipExtractFilter *pFilter, ZFileDigest *pDigest, bool &bSkipped, string &strError);
+    void AddError(const string &strName, const string &strError);
+
+private:
+    string m_strFile;
+    uint8_t *m_pBase;
+    size_t m_sSize;
+    vector<ZZipEntry> m_arrEntries;
+    vector<string> m_arrErrors;
+    mutex m_mutexErrors;
+};
+
+// Pass to ZZipWriter::SetLevel() to pick the compression of every entry from
+// its file type and an entropy sample of its first block
+#define ZIP_LEVEL_AUTO 0xff
+
+// How an entry ended up in the archive
+enum eZipClass
+{
+    E_ZIP_COPY = 0, // compressed bytes copied from another archive
+    E_ZIP_STORE,
+    E_ZIP_FAST,
+    E_ZIP_BEST,
+    E_ZIP_CLASS_COUNT
+};
+
+// Per-class totals of one or more WriteTo() calls. CPU time is the thread time
+// spent reading, hashing and deflating the entries, in microseconds.
+struct ZZipStats
+{
+    uint64_t arrEntries[E_ZIP_CLASS_COUNT];
+    uint64_t arrInputBytes[E_ZIP_CLASS_COUNT];
+    uint64_t arrOutputBytes[E_ZIP_CLASS_COUNT];
+    uint64_t arrCPUTime[E_ZIP_CLASS_COUNT];
+
+    ZZipStats();
+    void Add(const ZZipStats &stats);
+    void Print() const;
+};
+
+// Builds a ZIP archive from files on disk. Entries are split into blocks that
+// are deflated concurrently (pigz-style, each block primed with the previous
+// 32 KiB as dictionary) and written out in order with a single central directory.
+class ZZipWriter
+{
+public:
+    ZZipWriter();
+
+public:
+    // Deflate level 0-9 for every entry, or ZIP_LEVEL_AUTO
+    void SetLevel(int nLevel);
+    void SetThreadCount(int nThreadCount);
+
+    // Reproducible output: entries sorted by name, every timestamp set to tModTime
+    // (taken as UTC) and no extra fields beyond what Zip64 needs
+    void SetDeterministic(time_t tModTime);
+
+    // Queue strBaseFolder/strName and everything below it, named relative to strBaseFolder.
+    // Files whose entry names are in setExcludes are left out.
+    bool AddFolder(const string &strBaseFolder, const string &strName);
+    bool AddFolder(const string &strBaseFolder, const string &strName, const set<string> &setExcludes);
+    bool AddFile(const string &strPath, const string &strName);
+
+    // Queue an entry whose compressed bytes and CRC are copied verbatim from
+    // another archive, stored as strName. The reader must stay open until
+    // WriteTo() returns.
+    bool AddEntry(ZZipReader *pReader, const ZZipEntry &entry, const string &strName);
+
+    bool WriteTo(const char *szFile);
+    const vector<string> &GetErrors() const;
+    const ZZipStats &GetStats() const;
+
+private:
+    struct Source
+    {
+        string strName;
+        string strPath;
+        string strLinkTarget;
+        uint32_t uMode;
+        time_t tModTime;
+        uint64_t uSize;
+        ZZipReader *pReader;
+        const ZZipEntry *pEntry;
+        int nClass;
+    };
+
+    struct Block
+    {
+        size_t uSource;
+        uint64_t uOffset;
+        uint64_t uLength;
+        bool bFirst;
+        bool bLast;
+        bool bDone;
+        bool bFailed;
+        const uint8_t *pRawData;
+        uint16_t uMethod;
+        uint32_t uCRC32;
+        int nClass;
+        uint64_t uCPUTime;
+        string strData;
+        string strError;
+    };
+
+    bool AddNode(const string &strPath, const string &strName, const set<string> *pExcludes);
+    int ChooseClass(const Source &source, const uint8_t *pHead, size_t sHeadLength) const;
+    bool CompressBlock(Block &block, const uint8_t *pData = NULL);
+    bool ReadSource(const Source &source, uint64_t uOffset, uint64_t uLength, string &strData, string &strError);
+
+private:
+    int m_nLevel;
+    int m_nThreadCount;
+    bool m_bDeterministic;
+    time_t m_tFixedTime;
+    vector<Source> m_arrSources;
+    vector<string> m_arrErrors;
+    ZZipStats m_stats;
+};
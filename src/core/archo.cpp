@@ -2,8 +2,8 @@
 #include "utils/json.h"
 #include "core/archo.h"
 #include "core/signing.h"
-
-static uint64_t execSegLimit = 0;
+#include "utils/cancel.h"
+#include "utils/timing.h"
 
 ZArchO::ZArchO()
 {
@@ -21,6 +21,7 @@ ZArchO::ZArchO()
 	m_pCodeSignSegment = NULL;
 	m_pLinkEditSegment = NULL;
 	m_uLoadCommandsFreeSpace = 0;
+	m_uExecSegLimit = 0;
 }
 
 bool ZArchO::Init(uint8_t *pBase, uint32_t uLength)
@@ -54,7 +55,7 @@ bool ZArchO::Init(uint8_t *pBase, uint32_t uLength)
 			segment_command *seglc = (segment_command *)pLoadCommand;
 			if (0 == strcmp("__TEXT", seglc->segname))
 			{
-				execSegLimit = seglc->vmsize;
+				m_uExecSegLimit = seglc->vmsize;
 				for (uint32_t j = 0; j < BO(seglc->nsects); j++)
 				{
 					section *sect = (section *)((pLoadCommand + sizeof(segment_command)) + sizeof(section) * j);
@@ -82,7 +83,7 @@ bool ZArchO::Init(uint8_t *pBase, uint32_t uLength)
 			segment_command_64 *seglc = (segment_command_64 *)pLoadCommand;
 			if (0 == strcmp("__TEXT", seglc->segname))
 			{
-				execSegLimit = seglc->vmsize;
+				m_uExecSegLimit = seglc->vmsize;
 				for (uint32_t j = 0; j < BO(seglc->nsects); j++)
 				{
 					section_64 *sect = (section_64 *)((pLoadCommand + sizeof(segment_command_64)) + sizeof(section_64) * j);
@@ -430,42 +431,52 @@ bool ZArchO::BuildCodeSignature(arksigningAsset *pSignAsset, bool bForce, const
 	string strCMSSignatureSlot;
 	string strCodeDirectorySlot;
 	string strAltnateCodeDirectorySlot;
-	SlotBuildCodeDirectory(false,
-						   m_pBase,
-						   m_uCodeLength,
-						   pCodeSlots1Data,
-						   uCodeSlots1DataLength,
-						   execSegLimit,
-						   execSegFlags,
-						   strBundleId,
-						   pSignAsset->m_strTeamId,
-						   strInfoPlistSHA1,
-						   strRequirementsSlotSHA1,
-						   strCodeResourcesSHA1,
-						   strEntitlementsSlotSHA1,
-						   strDerEntitlementsSlotSHA1,
-						   IsExecute(),
-						   strCodeDirectorySlot);
-	SlotBuildCodeDirectory(true,
-						   m_pBase,
-						   m_uCodeLength,
-						   pCodeSlots256Data,
-						   uCodeSlots256DataLength,
-						   execSegLimit,
-						   execSegFlags,
-						   strBundleId,
-						   pSignAsset->m_strTeamId,
-						   strInfoPlistSHA256,
-						   strRequirementsSlotSHA256,
-						   strCodeResourcesSHA256,
-						   strEntitlementsSlotSHA256,
-						   strDerEntitlementsSlotSHA256,
-						   IsExecute(),
-						   strAltnateCodeDirectorySlot);
-	SlotBuildCMSSignature(pSignAsset,
-						  strCodeDirectorySlot,
-						  strAltnateCodeDirectorySlot,
-						  strCMSSignatureSlot);
+	{
+		ZPhaseTimer timer(ZJobTiming::E_PHASE_MACHO_HASH);
+		SlotBuildCodeDirectory(false,
+							   m_pBase,
+							   m_uCodeLength,
+							   pCodeSlots1Data,
+							   uCodeSlots1DataLength,
+							   m_uExecSegLimit,
+							   execSegFlags,
+							   strBundleId,
+							   pSignAsset->m_strTeamId,
+							   strInfoPlistSHA1,
+							   strRequirementsSlotSHA1,
+							   strCodeResourcesSHA1,
+							   strEntitlementsSlotSHA1,
+							   strDerEntitlementsSlotSHA1,
+							   IsExecute(),
+							   strCodeDirectorySlot);
+		SlotBuildCodeDirectory(true,
+							   m_pBase,
+							   m_uCodeLength,
+							   pCodeSlots256Data,
+							   uCodeSlots256DataLength,
+							   m_uExecSegLimit,
+							   execSegFlags,
+							   strBundleId,
+							   pSignAsset->m_strTeamId,
+							   strInfoPlistSHA256,
+							   strRequirementsSlotSHA256,
+							   strCodeResourcesSHA256,
+							   strEntitlementsSlotSHA256,
+							   strDerEntitlementsSlotSHA256,
+							   IsExecute(),
+							   strAltnateCodeDirectorySlot);
+	}
+	if (ZCancelToken::IsCurrentCancelled())
+	{
+		return false;
+	}
+	{
+		ZPhaseTimer timer(ZJobTiming::E_PHASE_CMS);
+		SlotBuildCMSSignature(pSignAsset,
+							  strCodeDirectorySlot,
+							  strAltnateCodeDirectorySlot,
+							  strCMSSignatureSlot);
+	}
 
 	uint32_t uCodeDirectorySlotLength = (uint32_t)strCodeDirectorySlot.size();
 	uint32_t uRequirementsSlotLength = (uint32_t)strRequirementsSlot.size();
@@ -596,7 +607,10 @@ bool ZArchO::Sign(arksigningAsset *pSignAsset, bool bForce, const string &strBun
 	BuildCodeSignature(pSignAsset, bForce, strBundleId, strInfoPlistSHA1, strInfoPlistSHA256, strCodeResourcesSHA1, strCodeResourcesSHA256, strCodeSignBlob);
 	if (strCodeSignBlob.empty())
 	{
-		ZLog::Error(">>> Build CodeSignature Failed!\n");
+		if (!ZCancelToken::IsCurrentCancelled())
+		{
+			ZLog::Error(">>> Build CodeSignature Failed!\n");
+		}
 		return false;
 	}
 
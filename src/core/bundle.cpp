@@ -3,13 +3,21 @@
 #include "sys/stat.h"
 #include "sys/types.h"
 #include "utils/base64.h"
+#include "utils/batchio.h"
 #include "utils/common.h"
+#include "utils/filecache.h"
+#include "utils/cancel.h"
+#include "utils/timing.h"
+#include <condition_variable>
+#include <deque>
+#include <thread>
 
 ZAppBundle::ZAppBundle()
 {
     m_pSignAsset = NULL;
     m_bForceSign = false;
     m_bWeakInject = false;
+    m_nThreads = 0;
 }
 
 
@@ -332,12 +340,80 @@ void ZAppBundle::GetFolderFiles(const string &strFolder,
   }
 }
 
+void ZAppBundle::SetFileDigests(const string &strFolder,
+                                const map<string, ZFileDigest> &mapDigests) {
+  m_strArchiveFolder = strFolder;
+  m_mapFileDigests = mapDigests;
+}
+
+void ZAppBundle::SetArchiveFiles(const set<string> &setFiles) {
+  m_setArchiveFiles = setFiles;
+}
+
+const set<string> &ZAppBundle::GetArchiveFiles() const {
+  return m_setArchiveFiles;
+}
+
+const set<string> &ZAppBundle::GetModifiedFiles() const {
+  return m_setModifiedFiles;
+}
+
+void ZAppBundle::SetThreadCount(int nThreads) { m_nThreads = nThreads; }
+
+void ZAppBundle::AddModifiedFile(const string &strFile) {
+  lock_guard<mutex> lock(m_mutexModified);
+  m_setModifiedFiles.insert(strFile);
+}
+
+void ZAppBundle::GetArchiveFolderFiles(const string &strFolder,
+                                       set<string> &setFiles) {
+  if (m_setArchiveFiles.empty() ||
+      0 != strFolder.compare(0, m_strArchiveFolder.size() + 1,
+                             m_strArchiveFolder + "/")) {
+    return;
+  }
+
+  // Names are sorted, so everything below strFolder is one contiguous range
+  string strPrefix = strFolder.substr(m_strArchiveFolder.size() + 1) + "/";
+  set<string>::const_iterator it = m_setArchiveFiles.lower_bound(strPrefix);
+  for (; it != m_setArchiveFiles.end() &&
+         0 == it->compare(0, strPrefix.size(), strPrefix);
+       it++) {
+    setFiles.insert(it->substr(strPrefix.size()));
+  }
+}
+
+bool ZAppBundle::GetFileDigest(const string &strFile, ZFileDigest &digest) {
+  if (m_mapFileDigests.empty() ||
+      0 != strFile.compare(0, m_strArchiveFolder.size() + 1,
+                           m_strArchiveFolder + "/")) {
+    return false;
+  }
+
+  {
+    lock_guard<mutex> lock(m_mutexModified);
+    if (m_setModifiedFiles.count(strFile) > 0) {
+      return false;
+    }
+  }
+
+  map<string, ZFileDigest>::const_iterator it =
+      m_mapFileDigests.find(strFile.substr(m_strArchiveFolder.size() + 1));
+  if (it == m_mapFileDigests.end()) {
+    return false;
+  }
+  digest = it->second;
+  return true;
+}
+
 bool ZAppBundle::GenerateCodeResources(const string &strFolder,
                                        JValue &jvCodeRes) {
+  ZPhaseTimer timer(ZJobTiming::E_PHASE_CODE_RESOURCES);
   jvCodeRes.clear();
 
   set<string> setFiles;
   GetFolderFiles(strFolder, strFolder, setFiles);
+  GetArchiveFolderFiles(strFolder, setFiles);
 
   JValue jvInfo;
   string strInfoPlistPath = strFolder + "/Info.plist";
@@ -349,13 +425,44 @@ bool ZAppBundle::GenerateCodeResources(const string &strFolder,
   jvCodeRes["files"] = JValue(JValue::E_OBJECT);
   jvCodeRes["files2"] = JValue(JValue::E_OBJECT);
 
+  // Files without a digest from extraction are read in batches and hashed
+  map<string, ZFileDigest> mapDigests;
+  vector<string> arrHashKeys;
+  vector<string> arrHashFiles;
+  for (const string &strKey : setFiles) {
+    string strFile = strFolder + "/" + strKey;
+    if (!GetFileDigest(strFile, mapDigests[strKey])) {
+      arrHashKeys.push_back(strKey);
+      arrHashFiles.push_back(strFile);
+    }
+  }
+
+  ZJobTiming::AddCurrentCount(ZJobTiming::E_COUNT_FILES_SEALED, setFiles.size());
+  ZJobTiming::AddCurrentCount(ZJobTiming::E_COUNT_FILES_HASHED, arrHashFiles.size());
+
+  ZBatchIO batchIO;
+  batchIO.ReadFiles(arrHashFiles, [&](size_t uIndex, const uint8_t *pData,
+                                      size_t sLength, int nError) {
+    ZFileDigest &digest = mapDigests[arrHashKeys[uIndex]];
+    if (0 == nError) {
+      ZSHASum sha;
+      sha.Update(pData, sLength);
+      sha.FinalBase64(digest);
+    } else {
+      SHASumBase64File(arrHashFiles[uIndex].c_str(), digest.strSHA1Base64,
+                       digest.strSHA256Base64);
+    }
+  });
+  if (ZCancelToken::IsCurrentCancelled()) {
+    return false;
+  }
+
   for (set<string>::iterator it = setFiles.begin(); it != setFiles.end();
        it++) {
     string strKey = *it;
-    string strFile = strFolder + "/" + strKey;
-    string strFileSHA1Base64;
-    string strFileSHA256Base64;
-    SHASumBase64File(strFile.c_str(), strFileSHA1Base64, strFileSHA256Base64);
+    const ZFileDigest &digest = mapDigests[strKey];
+    const string &strFileSHA1Base64 = digest.strSHA1Base64;
+    const string &strFileSHA256Base64 = digest.strSHA256Base64;
 
     bool bomit1 = false;
     bool bomit2 = false;
@@ -463,29 +570,153 @@ void ZAppBundle::GetNodeChangedFiles(JValue &jvNode, bool dontGenerateEmbeddedMo
 }
 
 
-bool ZAppBundle::SignNode(JValue &jvNode) {
+// A loose Mach-O file or a bundle of the signing tree. A bundle is sealed
+// only after every file and bundle below it has been signed, its CodeResources
+// hashes their final contents.
+struct ZSignNodeTask {
+  JValue *pNode;
+  string strFile;
+  ZSignNodeTask *pParent;
+  int nPending;
+};
+
+static void _AddSignNodeTasks(JValue &jvNode, ZSignNodeTask *pParent,
+                              deque<ZSignNodeTask> &arrTasks) {
+  arrTasks.push_back(ZSignNodeTask());
+  ZSignNodeTask *pTask = &arrTasks.back();
+  pTask->pNode = &jvNode;
+  pTask->pParent = pParent;
+  pTask->nPending = 0;
+
   if (jvNode.has("folders")) {
     for (size_t i = 0; i < jvNode["folders"].size(); i++) {
-      if (!SignNode(jvNode["folders"][i])) {
-        return false;
-      }
+      pTask->nPending++;
+      _AddSignNodeTasks(jvNode["folders"][i], pTask, arrTasks);
     }
   }
 
   if (jvNode.has("files")) {
     for (size_t i = 0; i < jvNode["files"].size(); i++) {
-      const char *szFile = jvNode["files"][i].asCString();
-      ZLog::PrintV(">>> SignFile: \t%s\n", szFile);
-      ZMachO macho;
-      if (!macho.InitV("%s/%s", m_strAppFolder.c_str(), szFile)) {
-        return false;
+      pTask->nPending++;
+      arrTasks.push_back(ZSignNodeTask());
+      ZSignNodeTask &fileTask = arrTasks.back();
+      fileTask.pNode = &jvNode;
+      fileTask.strFile = jvNode["files"][i].asString();
+      fileTask.pParent = pTask;
+      fileTask.nPending = 0;
+    }
+  }
+}
+
+// Sign the tree below jvNode as a dependency graph: every task whose children
+// are done is ready, so sibling frameworks, extensions and dylibs are signed
+// side by side while each bundle still waits for its contents.
+bool ZAppBundle::SignNode(JValue &jvNode) {
+  deque<ZSignNodeTask> arrTasks;
+  _AddSignNodeTasks(jvNode, NULL, arrTasks);
+
+  deque<ZSignNodeTask *> arrReady;
+  for (ZSignNodeTask &task : arrTasks) {
+    if (0 == task.nPending) {
+      arrReady.push_back(&task);
+    }
+  }
+
+  mutex mtx;
+  condition_variable cv;
+  size_t uRemaining = arrTasks.size();
+  bool bFailed = false;
+
+  // The helper threads work for the same job as the caller
+  ZCancelToken *pCancelToken = ZCancelToken::GetCurrent();
+  ZJobTiming *pTiming = ZJobTiming::GetCurrent();
+  auto worker = [&]() {
+    ZCancelScope scope(pCancelToken);
+    ZTimingScope timingScope(pTiming);
+    unique_lock<mutex> lock(mtx);
+    while (true) {
+      cv.wait(lock, [&]() {
+        return bFailed || 0 == uRemaining || !arrReady.empty();
+      });
+      if (bFailed || 0 == uRemaining) {
+        break;
       }
-      if (!macho.Sign(m_pSignAsset, m_bForceSign, "", "", "", "")) {
-        return false;
+
+      ZSignNodeTask *pTask = arrReady.front();
+      arrReady.pop_front();
+      lock.unlock();
+      bool bRet = pTask->strFile.empty() ? SignNodeFolder(*pTask->pNode)
+                                         : SignNodeFile(pTask->strFile);
+      lock.lock();
+
+      uRemaining--;
+      if (!bRet || ZCancelToken::IsCurrentCancelled()) {
+        bFailed = true;
+      } else if (NULL != pTask->pParent && 0 == --pTask->pParent->nPending) {
+        arrReady.push_back(pTask->pParent);
       }
+      cv.notify_all();
+    }
+  };
+
+  int nThreads = (m_nThreads > 0) ? m_nThreads : (int)thread::hardware_concurrency();
+  nThreads = max(1, min(nThreads, (int)arrTasks.size()));
+
+  vector<thread> arrWorkers;
+  for (int i = 1; i < nThreads; i++) {
+    arrWorkers.emplace_back(worker);
+  }
+  worker();
+  for (thread &t : arrWorkers) {
+    t.join();
+  }
+  return !bFailed;
+}
+
+// Key of a signed Mach-O in the file cache: its unsigned content, the
+// identity and whatever else goes into its signature (strContext)
+string ZAppBundle::GetSignCacheKey(const string &strFile, const string &strContext) {
+  ZFileDigest digest;
+  if (!GetFileDigest(strFile, digest) &&
+      !SHASumBase64File(strFile.c_str(), digest.strSHA1Base64, digest.strSHA256Base64)) {
+    return string();
+  }
+
+  string strKey;
+  SHA1Text(m_pSignAsset->GetFingerprint() + (m_bForceSign ? "\nforce\n" : "\n") +
+           digest.strSHA256Base64 + "\n" + strContext, strKey);
+  return strKey;
+}
+
+bool ZAppBundle::SignNodeFile(const string &strFile) {
+  ZLog::PrintV(">>> SignFile: \t%s\n", strFile.c_str());
+  string strPath = m_strAppFolder + "/" + strFile;
+  string strCacheKey;
+  if (ZFileCache::IsEnabled()) {
+    // Without an embedded Info.plist a dylib is identified by its file name
+    strCacheKey = GetSignCacheKey(strPath, "dylib\n" + strFile.substr(strFile.rfind('/') + 1));
+    if (!strCacheKey.empty() && ZFileCache::Load(strCacheKey, strPath)) {
+      ZLog::PrintV(">>> Cached: \t%s\n", strFile.c_str());
+      AddModifiedFile(strPath);
+      return true;
     }
   }
 
+  ZMachO macho;
+  if (!macho.InitV("%s/%s", m_strAppFolder.c_str(), strFile.c_str())) {
+    return false;
+  }
+  if (!macho.Sign(m_pSignAsset, m_bForceSign, "", "", "", "")) {
+    return false;
+  }
+  AddModifiedFile(strPath);
+  if (!strCacheKey.empty()) {
+    ZFileCache::Store(strCacheKey, strPath);
+  }
+  return true;
+}
+
+bool ZAppBundle::SignNodeFolder(JValue &jvNode) {
     ZBase64 b64;
   string strInfoPlistSHA1;
   string strInfoPlistSHA256;
@@ -569,6 +800,19 @@ bool ZAppBundle::SignNode(JValue &jvNode) {
                  strCodeResFile.c_str());
     return false;
   }
+  AddModifiedFile(strCodeResFile);
+
+  // A framework is sealed by its CodeResources, so the same resources, bundle
+  // id and executable signed by the same identity give the same signature
+  string strCacheKey;
+  if ("/" != strFolder && IsPathSuffix(strFolder, ".framework") && ZFileCache::IsEnabled()) {
+    strCacheKey = GetSignCacheKey(strExePath, strBundleId + "\n" + strCodeResData);
+    if (!strCacheKey.empty() && ZFileCache::Load(strCacheKey, strExePath)) {
+      ZLog::PrintV(">>> Cached: \t%s\n", strFolder.c_str());
+      AddModifiedFile(strExePath);
+      return true;
+    }
+  }
 
   bool bForceSign = m_bForceSign;
   if ("/" == strFolder && !arrDyLibPaths.empty()) { // inject dylib
@@ -581,6 +825,10 @@ bool ZAppBundle::SignNode(JValue &jvNode) {
                   strInfoPlistSHA256, strCodeResData)) {
     return false;
   }
+  AddModifiedFile(strExePath);
+  if (!strCacheKey.empty()) {
+    ZFileCache::Store(strCacheKey, strExePath);
+  }
 
   return true;
 }
@@ -628,6 +876,7 @@ bool ZAppBundle::SignFolder(arksigningAsset *pSignAsset,
     m_bForceSign = bForce;
     m_pSignAsset = pSignAsset;
     m_bWeakInject = bWeakInject;
+    m_setModifiedFiles.clear();
     if (NULL == m_pSignAsset)
     {
         return false;
@@ -650,6 +899,7 @@ bool ZAppBundle::SignFolder(arksigningAsset *pSignAsset,
             ZLog::ErrorV(">>> Can't Write embedded.mobileprovision!\n");
             return false;
         }
+        m_setModifiedFiles.insert(m_strAppFolder + "/embedded.mobileprovision");
     }
 
       arrDyLibPaths.clear();
@@ -662,6 +912,14 @@ bool ZAppBundle::SignFolder(arksigningAsset *pSignAsset,
             string strFileName = basename((char *)strDyLibFile.c_str());
             if (WriteFile(strDyLibData, "%s/%s", m_strAppFolder.c_str(), strFileName.c_str()))
             {
+                // The copy on disk replaces an archived file of the same name
+                string strDyLibFile = m_strAppFolder + "/" + strFileName;
+                m_setModifiedFiles.insert(strDyLibFile);
+                if (0 == strDyLibFile.compare(0, m_strArchiveFolder.size() + 1, m_strArchiveFolder + "/"))
+                {
+                    m_setArchiveFiles.erase(strDyLibFile.substr(m_strArchiveFolder.size() + 1));
+                }
+
                 string dyLibPath;
                 StringFormat(dyLibPath, "@executable_path/%s", strFileName.c_str());
                 arrDyLibPaths.push_back(dyLibPath);
@@ -679,6 +937,7 @@ bool ZAppBundle::SignFolder(arksigningAsset *pSignAsset,
     JValue jvRoot;
     if (m_bForceSign)
     {
+        ZPhaseTimer timer(ZJobTiming::E_PHASE_SCAN);
         jvRoot["path"] = "/";
         jvRoot["root"] = m_strAppFolder;
         if (!GetSignFolderInfo(m_strAppFolder, jvRoot, true))
@@ -716,6 +975,7 @@ bool ZAppBundle::SignFolder(arksigningAsset *pSignAsset,
 
     if (SignNode(jvRoot))
     {
+
         if (bEnableCache)
         {
             CreateFolder("./.arksigning_cache");
@@ -0,0 +1,233 @@
+#include "utils/common.h"
+#include "utils/json.h"
+#include "core/identity.h"
+
+string ZSigningIdentity::GetKey() const
+{
+	return strCertFile + "\n" + strPKeyFile + "\n" + strProvFile + "\n" + strEntitlementsFile + "\n" + strPassword;
+}
+
+bool ZSigningIdentity::Apply(const JValue &jvObject)
+{
+	bool bChanged = false;
+	const char *arrKeys[] = {"cert", "pkey", "prov", "entitlements", "password"};
+	string *arrFields[] = {&strCertFile, &strPKeyFile, &strProvFile, &strEntitlementsFile, &strPassword};
+	for (size_t i = 0; i < sizeof(arrKeys) / sizeof(arrKeys[0]); i++)
+	{
+		if (jvObject.has(arrKeys[i]))
+		{
+			*arrFields[i] = jvObject[arrKeys[i]].asString();
+			bChanged = true;
+		}
+	}
+	return bChanged;
+}
+
+ZIdentityRegistry::ZIdentityRegistry()
+{
+	m_bDeterministic = false;
+	m_tEpoch = 0;
+}
+
+void ZIdentityRegistry::SetDeterministic(time_t tEpoch)
+{
+	lock_guard<mutex> lock(m_mutex);
+	m_bDeterministic = true;
+	m_tEpoch = tEpoch;
+}
+
+size_t ZIdentityRegistry::GetCount()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_mapEntries.size();
+}
+
+ZIdentityRegistry::Entry *ZIdentityRegistry::AddEntry(const ZSigningIdentity &identity)
+{
+	unique_ptr<Entry> &pEntry = m_mapEntries[identity.GetKey()];
+	if (!pEntry)
+	{
+		pEntry.reset(new Entry());
+		pEntry->identity = identity;
+		pEntry->bLoaded = false;
+	}
+	return pEntry.get();
+}
+
+arksigningAsset *ZIdentityRegistry::LoadEntry(Entry *pEntry)
+{
+	bool bDeterministic = false;
+	time_t tEpoch = 0;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		bDeterministic = m_bDeterministic;
+		tEpoch = m_tEpoch;
+	}
+
+	lock_guard<mutex> lock(pEntry->mtxLoad);
+	if (pEntry->bLoaded)
+	{
+		return pEntry->pAsset.get();
+	}
+
+	const ZSigningIdentity &identity = pEntry->identity;
+	pEntry->bLoaded = true;
+	pEntry->pAsset.reset(new arksigningAsset());
+	if (!pEntry->pAsset->Init(identity.strCertFile, identity.strPKeyFile, identity.strProvFile, identity.strEntitlementsFile, identity.strPassword))
+	{
+		ZLog::ErrorV(">>> Can't Load Identity! %s, %s\n", identity.strPKeyFile.c_str(), identity.strProvFile.c_str());
+		pEntry->pAsset.reset();
+		return NULL;
+	}
+
+	if (bDeterministic)
+	{
+		pEntry->pAsset->SetSigningTime((tEpoch > 0) ? tEpoch : pEntry->pAsset->GetCertNotBefore());
+	}
+	ZLog::DebugV(">>> Identity:\t%s, %s (%s)\n", pEntry->pAsset->m_strTeamId.c_str(), pEntry->pAsset->m_strProfileName.c_str(), pEntry->pAsset->m_strSubjectCN.c_str());
+	return pEntry->pAsset.get();
+}
+
+bool ZIdentityRegistry::LoadFile(const string &strFile, bool bLazy)
+{
+	string strData;
+	if (!ReadFile(strFile.c_str(), strData))
+	{
+		ZLog::ErrorV(">>> Can't Read Identities File! %s\n", strFile.c_str());
+		return false;
+	}
+
+	// Relative paths are taken from the file's folder
+	string strBaseFolder = strFile.substr(0, strFile.rfind('/'));
+	auto resolvePath = [&](const string &strPath) {
+		return (strPath.empty() || '/' == strPath[0]) ? strPath : strBaseFolder + "/" + strPath;
+	};
+
+	unique_lock<mutex> lock(m_mutex);
+	vector<Entry *> arrEntries;
+	size_t uLine = 0;
+	size_t sBegin = 0;
+	while (sBegin < strData.size())
+	{
+		size_t sEnd = strData.find('\n', sBegin);
+		if (string::npos == sEnd)
+		{
+			sEnd = strData.size();
+		}
+		string strLine = strData.substr(sBegin, sEnd - sBegin);
+		sBegin = sEnd + 1;
+		uLine++;
+
+		size_t pos = strLine.find_first_not_of(" \t\r");
+		if (string::npos == pos || '#' == strLine[pos])
+		{
+			continue;
+		}
+
+		JValue jvIdentity;
+		string strError;
+		if (!jvIdentity.read(strLine, &strError) || !jvIdentity.isObject())
+		{
+			ZLog::ErrorV(">>> Invalid identities line %zu: %s", uLine, strError.c_str());
+			return false;
+		}
+
+		ZSigningIdentity identity;
+		if (!identity.Apply(jvIdentity) || identity.strPKeyFile.empty() || identity.strProvFile.empty())
+		{
+			ZLog::ErrorV(">>> Identities line %zu: \"pkey\" and \"prov\" are required\n", uLine);
+			return false;
+		}
+		identity.strCertFile = resolvePath(identity.strCertFile);
+		identity.strPKeyFile = resolvePath(identity.strPKeyFile);
+		identity.strProvFile = resolvePath(identity.strProvFile);
+		identity.strEntitlementsFile = resolvePath(identity.strEntitlementsFile);
+
+		Entry *pEntry = AddEntry(identity);
+		string strName = jvIdentity["name"].asString();
+		if (!strName.empty())
+		{
+			Entry *&pNamed = m_mapNames[strName];
+			if (NULL != pNamed && pNamed != pEntry)
+			{
+				ZLog::ErrorV(">>> Identities line %zu: duplicate name \"%s\"\n", uLine, strName.c_str());
+				return false;
+			}
+			pNamed = pEntry;
+		}
+		if (find(m_arrListed.begin(), m_arrListed.end(), pEntry) == m_arrListed.end())
+		{
+			m_arrListed.push_back(pEntry);
+			arrEntries.push_back(pEntry);
+		}
+	}
+
+	lock.unlock();
+
+	if (!bLazy)
+	{
+		for (Entry *pEntry : arrEntries)
+		{
+			if (NULL == LoadEntry(pEntry))
+			{
+				return false;
+			}
+		}
+	}
+	ZLog::PrintV(">>> Identities:\t%zu from %s%s\n", arrEntries.size(), strFile.c_str(), bLazy ? " (lazy)" : "");
+	return true;
+}
+
+arksigningAsset *ZIdentityRegistry::Get(const ZSigningIdentity &identity)
+{
+	Entry *pEntry = NULL;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		pEntry = AddEntry(identity);
+	}
+	return LoadEntry(pEntry);
+}
+
+// A "name" from the file wins. Team ids and profile names are only known once
+// an identity is parsed, so looking one up loads every lazy identity left,
+// outside the registry lock.
+arksigningAsset *ZIdentityRegistry::Find(const string &strName)
+{
+	Entry *pNamed = NULL;
+	vector<Entry *> arrListed;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		auto it = m_mapNames.find(strName);
+		if (it != m_mapNames.end())
+		{
+			pNamed = it->second;
+		}
+		arrListed = m_arrListed;
+	}
+	if (NULL != pNamed)
+	{
+		return LoadEntry(pNamed);
+	}
+
+	vector<arksigningAsset *> arrMatches;
+	for (Entry *pEntry : arrListed)
+	{
+		arksigningAsset *pAsset = LoadEntry(pEntry);
+		if (NULL != pAsset && (strName == pAsset->m_strTeamId || strName == pAsset->m_strProfileName))
+		{
+			arrMatches.push_back(pAsset);
+		}
+	}
+
+	if (arrMatches.empty())
+	{
+		ZLog::ErrorV(">>> Unknown Identity! %s\n", strName.c_str());
+		return NULL;
+	}
+	if (arrMatches.size() > 1)
+	{
+		ZLog::ErrorV(">>> Ambiguous Identity! %s matches %zu identities, pick one by name\n", strName.c_str(), arrMatches.size());
+		return NULL;
+	}
+	return arrMatches[0];
+}
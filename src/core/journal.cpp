@@ -0,0 +1,147 @@
+#include "utils/common.h"
+#include "utils/json.h"
+#include "core/journal.h"
+
+static string _HexString(const string &strData)
+{
+	static const char *szDigits = "0123456789abcdef";
+	string strHex;
+	strHex.reserve(strData.size() * 2);
+	for (unsigned char c : strData)
+	{
+		strHex += szDigits[c >> 4];
+		strHex += szDigits[c & 0x0f];
+	}
+	return strHex;
+}
+
+ZSignJournal::ZSignJournal()
+{
+	m_fd = -1;
+}
+
+ZSignJournal::~ZSignJournal()
+{
+	if (m_fd >= 0)
+	{
+		close(m_fd);
+	}
+}
+
+bool ZSignJournal::Open(const string &strFile)
+{
+	string strData;
+	if (IsFileExists(strFile.c_str()) && !ReadFile(strFile.c_str(), strData))
+	{
+		ZLog::ErrorV(">>> Can't Read Journal! %s\n", strFile.c_str());
+		return false;
+	}
+
+	// Later entries for the same output replace earlier ones
+	size_t uEntries = 0;
+	size_t sBegin = 0;
+	while (sBegin < strData.size())
+	{
+		size_t sEnd = strData.find('\n', sBegin);
+		if (string::npos == sEnd)
+		{
+			break;
+		}
+		JValue jvEntry;
+		if (jvEntry.read(strData.substr(sBegin, sEnd - sBegin)) && jvEntry.isObject() && jvEntry.has("output"))
+		{
+			m_mapEntries[jvEntry["output"].asString()] = jvEntry;
+			uEntries++;
+		}
+		sBegin = sEnd + 1;
+	}
+
+	m_fd = open(strFile.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (m_fd < 0)
+	{
+		ZLog::ErrorV(">>> Can't Open Journal! %s, %s\n", strFile.c_str(), strerror(errno));
+		return false;
+	}
+
+	// Start after a torn last line instead of appending to it
+	if (!strData.empty() && '\n' != strData[strData.size() - 1])
+	{
+		if (1 != write(m_fd, "\n", 1))
+		{
+			ZLog::ErrorV(">>> Can't Write Journal! %s, %s\n", strFile.c_str(), strerror(errno));
+			return false;
+		}
+	}
+	ZLog::PrintV(">>> Journal:\t%s (%zu entries)\n", strFile.c_str(), uEntries);
+	return true;
+}
+
+bool ZSignJournal::IsOpen() const
+{
+	return m_fd >= 0;
+}
+
+bool ZSignJournal::Find(const string &strOutput, JValue &jvEntry)
+{
+	lock_guard<mutex> lock(m_mutex);
+	auto it = m_mapEntries.find(strOutput);
+	if (it == m_mapEntries.end())
+	{
+		return false;
+	}
+	jvEntry = it->second;
+	return true;
+}
+
+bool ZSignJournal::Append(const JValue &jvEntry)
+{
+	string strLine;
+	jvEntry.write(strLine);
+	strLine += "\n";
+
+	lock_guard<mutex> lock(m_mutex);
+	if (m_fd < 0)
+	{
+		return false;
+	}
+	ssize_t nWritten = 0;
+	do
+	{
+		nWritten = write(m_fd, strLine.data(), strLine.size());
+	} while (nWritten < 0 && EINTR == errno);
+	if (nWritten != (ssize_t)strLine.size() || 0 != fsync(m_fd))
+	{
+		ZLog::ErrorV(">>> Can't Write Journal! %s\n", strerror(errno));
+		return false;
+	}
+	m_mapEntries[jvEntry["output"].asString()] = jvEntry;
+	return true;
+}
+
+bool ZSignJournal::HashFile(const string &strFile, string &strHash)
+{
+	struct stat st;
+	if (0 != stat(strFile.c_str(), &st) || !S_ISREG(st.st_mode))
+	{
+		return false;
+	}
+
+	string strSHA256;
+	if (0 == st.st_size)
+	{
+		SHASum(E_SHASUM_TYPE_256, string(), strSHA256);
+	}
+	else
+	{
+		size_t sSize = 0;
+		uint8_t *pBase = (uint8_t *)MapFile(strFile.c_str(), 0, 0, &sSize, true);
+		if (NULL == pBase)
+		{
+			return false;
+		}
+		SHASum(E_SHASUM_TYPE_256, pBase, sSize, strSHA256);
+		munmap(pBase, sSize);
+	}
+	strHash = _HexString(strSHA256);
+	return !strHash.empty();
+}
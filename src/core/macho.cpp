@@ -107,6 +107,18 @@ bool ZMachO::OpenFile(const char *szPath)
 	return (!m_arrArchOes.empty());
 }
 
+bool ZMachO::IsMachO(const uint8_t *pData, size_t sSize)
+{
+	if (NULL == pData || sSize < sizeof(uint32_t))
+	{
+		return false;
+	}
+
+	uint32_t magic = 0;
+	memcpy(&magic, pData, sizeof(magic));
+	return (FAT_CIGAM == magic || FAT_MAGIC == magic || MH_MAGIC == magic || MH_CIGAM == magic || MH_MAGIC_64 == magic || MH_CIGAM_64 == magic);
+}
+
 bool ZMachO::CloseFile()
 {
 	if (nullptr == m_pBase || m_sSize <= 0)
@@ -0,0 +1,224 @@
+#include "utils/common.h"
+#include "core/scanner.h"
+#include <dirent.h>
+#include <fnmatch.h>
+#include <thread>
+
+bool FindAppFolder(const string &strFolder, string &strAppFolder);
+
+ZInputScanner::ZInputScanner()
+{
+	m_bRecursive = false;
+	m_nBusy = 0;
+	m_bRootFailed = false;
+}
+
+void ZInputScanner::SetRecursive(bool bRecursive)
+{
+	m_bRecursive = bRecursive;
+}
+
+void ZInputScanner::AddInclude(const string &strPattern)
+{
+	m_arrIncludes.push_back(strPattern);
+}
+
+void ZInputScanner::AddExclude(const string &strPattern)
+{
+	m_arrExcludes.push_back(strPattern);
+}
+
+void ZInputScanner::SkipFolder(const string &strFolder)
+{
+	m_setSkipFolders.insert(strFolder);
+}
+
+bool ZInputScanner::IsWanted(const string &strRelPath, bool bInput) const
+{
+	for (const string &strPattern : m_arrExcludes)
+	{
+		if (0 == fnmatch(strPattern.c_str(), strRelPath.c_str(), 0))
+		{
+			return false;
+		}
+	}
+	if (!bInput || m_arrIncludes.empty())
+	{
+		return true;
+	}
+	for (const string &strPattern : m_arrIncludes)
+	{
+		if (0 == fnmatch(strPattern.c_str(), strRelPath.c_str(), 0))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ZInputScanner::Scan(const string &strFolder, int nThreads, const FoundHandler &handler)
+{
+	m_strRoot = strFolder;
+	m_handler = handler;
+	m_arrPending.assign(1, make_pair(string(), false));
+	m_nBusy = 0;
+	m_bRootFailed = false;
+
+	// Listing is mostly waiting on the file system, more walkers than cores
+	// keep more requests in flight
+	if (nThreads <= 0)
+	{
+		nThreads = max(4, 2 * (int)thread::hardware_concurrency());
+	}
+
+	ZLog::PrintV(">>> Scanning folder: %s%s\n", strFolder.c_str(), m_bRecursive ? " (recursive)" : "");
+	vector<thread> arrWorkers;
+	for (int i = 0; i < nThreads; i++)
+	{
+		arrWorkers.emplace_back(&ZInputScanner::RunWorker, this);
+	}
+	for (thread &t : arrWorkers)
+	{
+		t.join();
+	}
+
+	if (m_bRootFailed)
+	{
+		ZLog::ErrorV(">>> Cannot open input folder: %s\n", strFolder.c_str());
+		return false;
+	}
+	return true;
+}
+
+void ZInputScanner::RunWorker()
+{
+	while (true)
+	{
+		pair<string, bool> folder;
+		{
+			unique_lock<mutex> lock(m_mutex);
+			m_cv.wait(lock, [this]() { return !m_arrPending.empty() || 0 == m_nBusy; });
+			if (m_arrPending.empty())
+			{
+				return;
+			}
+			// Depth first keeps the list of pending folders short
+			folder = m_arrPending.back();
+			m_arrPending.pop_back();
+			m_nBusy++;
+		}
+
+		if (folder.second)
+		{
+			ProbeFolder(folder.first);
+		}
+		else
+		{
+			ScanFolder(folder.first);
+		}
+
+		lock_guard<mutex> lock(m_mutex);
+		m_nBusy--;
+		m_cv.notify_all();
+	}
+}
+
+// A top-level folder without --recursive holds one app somewhere inside
+void ZInputScanner::ProbeFolder(const string &strRelFolder)
+{
+	string strAppFolder;
+	if (FindAppFolder(m_strRoot + "/" + strRelFolder, strAppFolder))
+	{
+		m_handler(strAppFolder, strRelFolder, false);
+	}
+}
+
+void ZInputScanner::ScanFolder(const string &strRelFolder)
+{
+	string strFolder = strRelFolder.empty() ? m_strRoot : m_strRoot + "/" + strRelFolder;
+	DIR *dir = opendir(strFolder.c_str());
+	if (NULL == dir)
+	{
+		if (strRelFolder.empty())
+		{
+			m_bRootFailed = true;
+		}
+		else
+		{
+			ZLog::WarnV(">>> Cannot open folder: %s\n", strFolder.c_str());
+		}
+		return;
+	}
+
+	vector<pair<string, bool>> arrFolders;
+	dirent *ptr = NULL;
+	while (NULL != (ptr = readdir(dir)))
+	{
+		if (0 == strcmp(ptr->d_name, ".") || 0 == strcmp(ptr->d_name, "..") || 0 == strcmp(ptr->d_name, "__MACOSX"))
+		{
+			continue;
+		}
+
+		string strPath = strFolder + "/" + ptr->d_name;
+		string strRelPath = strRelFolder.empty() ? string(ptr->d_name) : strRelFolder + "/" + ptr->d_name;
+		unsigned char uType = ptr->d_type;
+		if (DT_UNKNOWN == uType)
+		{
+			struct stat st;
+			if (0 != lstat(strPath.c_str(), &st))
+			{
+				continue;
+			}
+			uType = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN);
+		}
+
+		if (DT_REG == uType)
+		{
+			if (IsWanted(strRelPath, true) && IsZipFile(strPath.c_str()))
+			{
+				m_handler(strPath, strRelPath, true);
+			}
+			continue;
+		}
+		if (DT_DIR != uType || !IsWanted(strRelPath, false) || m_setSkipFolders.count(strPath) > 0)
+		{
+			continue;
+		}
+
+		string strAppFolder;
+		if (!m_bRecursive)
+		{
+			if (IsWanted(strRelPath, true))
+			{
+				arrFolders.push_back(make_pair(strRelPath, true));
+			}
+		}
+		else if (IsPathSuffix(strPath, ".app"))
+		{
+			if (IsWanted(strRelPath, true))
+			{
+				m_handler(strPath, strRelPath, false);
+			}
+		}
+		else if (IsFolderV("%s/Payload", strPath.c_str()) && FindAppFolder(strPath + "/Payload", strAppFolder))
+		{
+			// An unpacked ipa, named after the folder holding Payload
+			if (IsWanted(strRelPath, true))
+			{
+				m_handler(strAppFolder, strRelPath, false);
+			}
+		}
+		else
+		{
+			arrFolders.push_back(make_pair(strRelPath, false));
+		}
+	}
+	closedir(dir);
+
+	if (!arrFolders.empty())
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_arrPending.insert(m_arrPending.end(), arrFolders.begin(), arrFolders.end());
+		m_cv.notify_all();
+	}
+}
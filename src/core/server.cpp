@@ -0,0 +1,432 @@
+#include "utils/common.h"
+#include "utils/json.h"
+#include "core/server.h"
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SERVER_MAX_LINE (1024 * 1024)
+// A client that doesn't read its events for this many seconds is dropped
+#define SERVER_SEND_TIMEOUT 30
+// Requests one connection may have queued or running, later ones are refused
+#define SERVER_MAX_PENDING 64
+
+static volatile sig_atomic_t s_bSignaled = 0;
+
+static void _OnStopSignal(int nSignal)
+{
+	(void)nSignal;
+	s_bSignaled = 1;
+}
+
+static bool _FillSocketAddress(const string &strSocketPath, sockaddr_un &addr)
+{
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strSocketPath.empty() || strSocketPath.size() >= sizeof(addr.sun_path))
+	{
+		ZLog::ErrorV(">>> Invalid Socket Path! %s\n", strSocketPath.c_str());
+		return false;
+	}
+	memcpy(addr.sun_path, strSocketPath.c_str(), strSocketPath.size());
+	return true;
+}
+
+static bool _WriteAll(int fd, const string &strData)
+{
+	size_t sOffset = 0;
+	while (sOffset < strData.size())
+	{
+		ssize_t nWritten = write(fd, strData.data() + sOffset, strData.size() - sOffset);
+		if (nWritten < 0 && EINTR == errno)
+		{
+			continue;
+		}
+		if (nWritten <= 0)
+		{
+			return false;
+		}
+		sOffset += (size_t)nWritten;
+	}
+	return true;
+}
+
+// Split what arrived on fd into lines, strPending keeps a partial last line.
+// Returns false at end of stream or when a line outgrows SERVER_MAX_LINE.
+static bool _ReadLines(int fd, string &strPending, vector<string> &arrLines)
+{
+	char buf[64 * 1024];
+	ssize_t nRead = 0;
+	do
+	{
+		nRead = read(fd, buf, sizeof(buf));
+	} while (nRead < 0 && EINTR == errno);
+	if (nRead <= 0)
+	{
+		return false;
+	}
+
+	strPending.append(buf, (size_t)nRead);
+	size_t sBegin = 0;
+	size_t pos = strPending.find('\n');
+	while (string::npos != pos)
+	{
+		if (pos > sBegin)
+		{
+			arrLines.push_back(strPending.substr(sBegin, pos - sBegin));
+		}
+		sBegin = pos + 1;
+		pos = strPending.find('\n', sBegin);
+	}
+	strPending.erase(0, sBegin);
+	return strPending.size() <= SERVER_MAX_LINE;
+}
+
+static bool _SendEvent(int fd, const JValue &jvEvent)
+{
+	string strLine;
+	jvEvent.write(strLine);
+	strLine += "\n";
+	return _WriteAll(fd, strLine);
+}
+
+struct ZSignServer::Connection
+{
+	int fd;
+	mutex mtxWrite;
+	bool bBroken;
+	atomic<int> nPending;
+
+	explicit Connection(int fdConnection) : fd(fdConnection), bBroken(false), nPending(0) {}
+	~Connection() { close(fd); }
+
+	void Send(const JValue &jvEvent)
+	{
+		lock_guard<mutex> lock(mtxWrite);
+		SendLocked(jvEvent);
+	}
+
+	// With mtxWrite held. A client that went away or stopped reading is shut
+	// down and gets no more events, so no worker waits on it again.
+	void SendLocked(const JValue &jvEvent)
+	{
+		if (!bBroken && !_SendEvent(fd, jvEvent))
+		{
+			bBroken = true;
+			shutdown(fd, SHUT_RDWR);
+		}
+	}
+};
+
+ZSignServer::ZSignServer()
+{
+	m_fdListen = -1;
+	m_bStopping = false;
+	m_nReaders = 0;
+}
+
+ZSignServer::~ZSignServer()
+{
+	if (m_fdListen >= 0)
+	{
+		close(m_fdListen);
+		unlink(m_strSocketPath.c_str());
+	}
+}
+
+bool ZSignServer::Listen(const string &strSocketPath)
+{
+	sockaddr_un addr;
+	if (!_FillSocketAddress(strSocketPath, addr))
+	{
+		return false;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+	{
+		ZLog::ErrorV(">>> Create Socket Failed! %s\n", strerror(errno));
+		return false;
+	}
+
+	// A socket file nobody answers on is left over from a server that died.
+	// Anything else at the path is not ours to remove.
+	struct stat st;
+	if (0 == lstat(strSocketPath.c_str(), &st))
+	{
+		if (!S_ISSOCK(st.st_mode))
+		{
+			ZLog::ErrorV(">>> Not A Socket! %s\n", strSocketPath.c_str());
+			close(fd);
+			return false;
+		}
+		if (0 == connect(fd, (sockaddr *)&addr, sizeof(addr)))
+		{
+			ZLog::ErrorV(">>> Another Server Is Listening! %s\n", strSocketPath.c_str());
+			close(fd);
+			return false;
+		}
+		unlink(strSocketPath.c_str());
+	}
+	close(fd);
+
+	// The socket hands out the identities, so it is created for the owner only
+	// rather than narrowed after other users could already connect
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	mode_t uMask = umask(0177);
+	bool bBound = (fd >= 0 && 0 == bind(fd, (sockaddr *)&addr, sizeof(addr)));
+	umask(uMask);
+	if (!bBound || 0 != listen(fd, 128))
+	{
+		ZLog::ErrorV(">>> Listen Failed! %s, %s\n", strSocketPath.c_str(), strerror(errno));
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		return false;
+	}
+
+	m_fdListen = fd;
+	m_strSocketPath = strSocketPath;
+	return true;
+}
+
+bool ZSignServer::Run(const RequestHandler &handler, int nWorkers)
+{
+	if (m_fdListen < 0)
+	{
+		return false;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, _OnStopSignal);
+	signal(SIGTERM, _OnStopSignal);
+
+	if (nWorkers <= 0)
+	{
+		nWorkers = max(1, (int)thread::hardware_concurrency());
+	}
+	ZLog::PrintV(">>> Serving on %s with %d workers\n", m_strSocketPath.c_str(), nWorkers);
+
+	vector<thread> arrWorkers;
+	for (int i = 0; i < nWorkers; i++)
+	{
+		arrWorkers.emplace_back(&ZSignServer::RunWorker, this, cref(handler));
+	}
+
+	while (!s_bSignaled)
+	{
+		pollfd pfd;
+		pfd.fd = m_fdListen;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 200) <= 0)
+		{
+			continue;
+		}
+
+		int fd = accept(m_fdListen, NULL, NULL);
+		if (fd < 0)
+		{
+			continue;
+		}
+
+		timeval tvTimeout = {SERVER_SEND_TIMEOUT, 0};
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tvTimeout, sizeof(tvTimeout));
+		shared_ptr<Connection> pConnection(new Connection(fd));
+		{
+			lock_guard<mutex> lock(m_mutex);
+			m_arrConnections.push_back(pConnection);
+			m_nReaders++;
+		}
+		thread(&ZSignServer::ReadConnection, this, pConnection).detach();
+	}
+
+	// Stop taking requests, let the queued ones finish
+	ZLog::PrintV(">>> Stopping server ...\n");
+	{
+		unique_lock<mutex> lock(m_mutex);
+		for (const auto &pConnection : m_arrConnections)
+		{
+			shutdown(pConnection->fd, SHUT_RD);
+		}
+		m_cv.wait(lock, [this]() { return 0 == m_nReaders; });
+		m_bStopping = true;
+		m_cv.notify_all();
+	}
+	for (thread &t : arrWorkers)
+	{
+		t.join();
+	}
+
+	close(m_fdListen);
+	unlink(m_strSocketPath.c_str());
+	m_fdListen = -1;
+	return true;
+}
+
+void ZSignServer::ReadConnection(shared_ptr<Connection> pConnection)
+{
+	string strPending;
+	vector<string> arrLines;
+	while (_ReadLines(pConnection->fd, strPending, arrLines))
+	{
+		for (const string &strLine : arrLines)
+		{
+			Request request;
+			request.pConnection = pConnection;
+			string strError;
+			if (!request.jvRequest.read(strLine, &strError) || !request.jvRequest.isObject())
+			{
+				JValue jvEvent;
+				jvEvent["event"] = "done";
+				jvEvent["ok"] = false;
+				jvEvent["error"] = "Invalid request: " + strError.substr(0, strError.find_last_not_of("\n") + 1);
+				pConnection->Send(jvEvent);
+				continue;
+			}
+
+			JValue jvEvent;
+			if (request.jvRequest.has("id"))
+			{
+				jvEvent["id"] = request.jvRequest["id"];
+			}
+			if (pConnection->nPending >= SERVER_MAX_PENDING)
+			{
+				jvEvent["event"] = "done";
+				jvEvent["ok"] = false;
+				jvEvent["error"] = "Too many pending requests on this connection";
+				pConnection->Send(jvEvent);
+				continue;
+			}
+			pConnection->nPending++;
+			jvEvent["event"] = "queued";
+
+			// Holding the connection's write lock keeps the request's own events
+			// behind "queued", the server lock is only held to queue it
+			lock_guard<mutex> lockWrite(pConnection->mtxWrite);
+			{
+				lock_guard<mutex> lock(m_mutex);
+				jvEvent["position"] = (int)m_queRequests.size();
+				m_queRequests.push(request);
+				m_cv.notify_one();
+			}
+			pConnection->SendLocked(jvEvent);
+		}
+		arrLines.clear();
+	}
+
+	// Requests still queued or running keep the connection open for their events
+	lock_guard<mutex> lock(m_mutex);
+	for (size_t i = 0; i < m_arrConnections.size(); i++)
+	{
+		if (m_arrConnections[i] == pConnection)
+		{
+			m_arrConnections.erase(m_arrConnections.begin() + i);
+			break;
+		}
+	}
+	m_nReaders--;
+	m_cv.notify_all();
+}
+
+void ZSignServer::RunWorker(const RequestHandler &handler)
+{
+	while (true)
+	{
+		Request request;
+		{
+			unique_lock<mutex> lock(m_mutex);
+			m_cv.wait(lock, [this]() { return m_bStopping || !m_queRequests.empty(); });
+			if (m_queRequests.empty())
+			{
+				return;
+			}
+			request = m_queRequests.front();
+			m_queRequests.pop();
+		}
+
+		const JValue &jvRequest = request.jvRequest;
+		shared_ptr<Connection> pConnection = request.pConnection;
+		auto sink = [&](const JValue &jvEvent) {
+			if (!jvRequest.has("id"))
+			{
+				pConnection->Send(jvEvent);
+				return;
+			}
+			JValue jvTagged = jvEvent;
+			jvTagged["id"] = jvRequest["id"];
+			pConnection->Send(jvTagged);
+		};
+
+		uint64_t uBeginTime = GetMicroSecond();
+		string strError;
+		bool bRet = handler(jvRequest, sink, strError);
+
+		JValue jvDone;
+		jvDone["event"] = "done";
+		jvDone["ok"] = bRet;
+		if (!bRet)
+		{
+			jvDone["error"] = strError.empty() ? string("Signing failed") : strError;
+		}
+		jvDone["elapsed_ms"] = (int64_t)((GetMicroSecond() - uBeginTime) / 1000);
+		// Counted out first, a client may send its next request as soon as it sees done
+		pConnection->nPending--;
+		sink(jvDone);
+	}
+}
+
+bool ZSignServer::Submit(const string &strSocketPath, const JValue &jvRequest, const EventSink &sink)
+{
+	sockaddr_un addr;
+	if (!_FillSocketAddress(strSocketPath, addr))
+	{
+		return false;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || 0 != connect(fd, (sockaddr *)&addr, sizeof(addr)))
+	{
+		ZLog::ErrorV(">>> Connect Failed! %s, %s\n", strSocketPath.c_str(), strerror(errno));
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		return false;
+	}
+
+	if (!_SendEvent(fd, jvRequest))
+	{
+		ZLog::ErrorV(">>> Send Request Failed! %s\n", strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	string strPending;
+	vector<string> arrLines;
+	while (_ReadLines(fd, strPending, arrLines))
+	{
+		for (const string &strLine : arrLines)
+		{
+			JValue jvEvent;
+			if (!jvEvent.read(strLine))
+			{
+				continue;
+			}
+			sink(jvEvent);
+			if ("done" == jvEvent["event"].asString())
+			{
+				close(fd);
+				return jvEvent["ok"].asBool();
+			}
+		}
+		arrLines.clear();
+	}
+
+	ZLog::Error(">>> Server Closed The Connection!\n");
+	close(fd);
+	return false;
+}
@@ -3,6 +3,8 @@
 #include "utils/json.h"
 #include "utils/mach-o.h"
 #include "crypto/openssl.h"
+#include "utils/cancel.h"
+#include "utils/timing.h"
 
 static void _DERLength(string &strBlob, uint64_t uLength)
 {
@@ -628,8 +630,14 @@ bool SlotBuildCodeDirectory(bool bAlternate,
 	}
 	else
 	{
+		ZJobTiming::AddCurrentCount(ZJobTiming::E_COUNT_MACHO_BYTES_HASHED, uCodeLength);
 		for (uint32_t i = 0; i < uPages; i++)
 		{
+			if (ZCancelToken::IsCurrentCancelled())
+			{
+				strOutput.clear();
+				return false;
+			}
 			string strSHASum;
 			SHASum(cdHeader.hashType, pCodeBase + uPageSize * i, uPageSize, strSHASum);
 			strOutput.append(strSHASum.data(), strSHASum.size());
@@ -1,5 +1,16 @@
 #include "core/bundle.h"
 #include "utils/common.h"
+#include "utils/zip.h"
+#include "utils/batchio.h"
+#include "utils/workspace.h"
+#include "utils/filecache.h"
+#include "utils/topology.h"
+#include "utils/cancel.h"
+#include "utils/timing.h"
+#include "core/server.h"
+#include "core/identity.h"
+#include "core/journal.h"
+#include "core/scanner.h"
 #include "modern/callbacks.h"
 #include "core/macho.h"
 #include "crypto/openssl.h"
@@ -11,6 +22,8 @@
 #include <thread>
 #include <mutex>
 #include <queue>
+#include <deque>
+#include <memory>
 #include <atomic>
 #include <condition_variable>
 #include <algorithm>
@@ -44,6 +57,34 @@ const struct option options[] = {
     {"inputfolder", required_argument, NULL, 1000},
     {"outputfolder", required_argument, NULL, 1001},
     {"parallel", optional_argument, NULL, 1002},
+    {"sparse", no_argument, NULL, 1003},
+    {"workdir", required_argument, NULL, 1004},
+    {"ramdir", required_argument, NULL, 1005},
+    {"ram-budget", required_argument, NULL, 1006},
+    {"no-io-uring", no_argument, NULL, 1007},
+    {"deterministic", no_argument, NULL, 1008},
+    {"stage-threads", required_argument, NULL, 1009},
+    {"order", required_argument, NULL, 1010},
+    {"max-inflight-bytes", required_argument, NULL, 1011},
+    {"serve", required_argument, NULL, 1012},
+    {"client", required_argument, NULL, 1013},
+    {"manifest", required_argument, NULL, 1014},
+    {"identities", required_argument, NULL, 1015},
+    {"identity", required_argument, NULL, 1016},
+    {"lazy-identities", no_argument, NULL, 1017},
+    {"no-journal", no_argument, NULL, 1018},
+    {"recursive", no_argument, NULL, 1019},
+    {"include", required_argument, NULL, 1020},
+    {"exclude", required_argument, NULL, 1021},
+    {"dedup", required_argument, NULL, 1022},
+    {"sign-cache", required_argument, NULL, 1023},
+    {"sign-cache-size", required_argument, NULL, 1024},
+    {"numa", no_argument, NULL, 1025},
+    {"job-timeout", required_argument, NULL, 1026},
+    {"job-cpu-timeout", required_argument, NULL, 1027},
+    {"report", required_argument, NULL, 1028},
+    {"prefetch", required_argument, NULL, 1029},
+    {"prefetch-budget", required_argument, NULL, 1030},
     {}};
 
 int usage() {
@@ -64,8 +105,12 @@ int usage() {
   ZLog::Print("-I, --info\t\tOutput app information in JSON format, including app icon in base64.\n");
   ZLog::Print("-r, --bundle_version\tNew bundle version to change.\n");
   ZLog::Print("-e, --entitlements\tNew entitlements to change.\n");
+  ZLog::Print("--identities\t\tNDJSON file of identities (name, cert, pkey, prov, entitlements, password).\n");
+  ZLog::Print("--identity\t\tSign with the listed identity of this name, team id or profile name.\n");
+  ZLog::Print("--lazy-identities\tLoad each listed identity when a job first uses it.\n");
   ZLog::Print(
       "-z, --zip_level\t\tCompressed level when output the ipa file. (0-9)\n");
+  ZLog::Print("\t\t\tUse -z auto to pick store, fast or best per file.\n");
   ZLog::Print("-l, --dylib\t\tPath to inject dylib file.\n");
   ZLog::Print(
       "\t\t\tUse -l multiple time to inject multiple dylib files at once.\n");
@@ -74,6 +119,14 @@ int usage() {
               "command for test.\n");
   ZLog::Print("-q, --quiet\t\tQuiet operation.\n");
   ZLog::Print("-E, --no-embed-profile\tDon't generate embedded mobile provision.\n");
+  ZLog::Print("--sparse\t\tOnly extract the files signing touches, copy the rest from the input ipa.\n");
+  ZLog::Print("--workdir\t\tFolder for temporary workspaces. (default: /tmp)\n");
+  ZLog::Print("--ramdir\t\tRAM-backed (tmpfs) folder to unpack into while the RAM budget allows.\n");
+  ZLog::Print("--ram-budget\t\tBytes of --ramdir all jobs may use, e.g. 4G. (default: 1/4 of RAM)\n");
+  ZLog::Print("--sign-cache\t\tFolder keeping signed frameworks and dylibs across runs, reused for identical ones.\n");
+  ZLog::Print("--sign-cache-size\tBytes --sign-cache may use, e.g. 2G. (default: 1G)\n");
+  ZLog::Print("--deterministic\t\tByte-identical output for identical input and identity. (honors SOURCE_DATE_EPOCH)\n");
+  ZLog::Print("--no-io-uring		Use plain file I/O instead of batching small files through io_uring.\n");
   ZLog::Print("-v, --version\t\tShows version.\n");
   ZLog::Print("-h, --help\t\tShows help (this message).\n");
   ZLog::Print("\nBulk signing options:\n");
@@ -81,6 +134,25 @@ int usage() {
   ZLog::Print("--inputfolder\t\tFolder containing unsigned apps to process.\n");
   ZLog::Print("--outputfolder\t\tDestination folder for signed apps.\n");
   ZLog::Print("--parallel\t\tEnable parallel processing with optional thread count.\n");
+  ZLog::Print("--recursive\t\tFind apps in all subfolders of --inputfolder, outputs keep the folder layout.\n");
+  ZLog::Print("--include\t\tOnly sign inputs whose path below --inputfolder matches this glob, repeatable.\n");
+  ZLog::Print("--exclude\t\tSkip files and folders whose path below --inputfolder matches this glob, repeatable.\n");
+  ZLog::Print("--manifest\t\tNDJSON file of jobs with their own input, output, identity and options.\n");
+  ZLog::Print("--order\t\t\tOrder to sign apps in: lpt (largest first, default), fifo or name.\n");
+  ZLog::Print("--max-inflight-bytes\tUnpacked bytes of all apps in progress, e.g. 8G. (default: unlimited)\n");
+  ZLog::Print("--dedup\t\t\tIdentical inputs are signed once and the output linked (default), copied or, with off, signed again.\n");
+  ZLog::Print("--no-journal\t\tSign every app again instead of skipping the ones the output folder's journal lists.\n");
+  ZLog::Print("--stage-threads\t\tWorkers per pipeline stage as extract:sign:archive, 0 keeps the default.\n");
+  ZLog::Print("--numa\t\t\tSpread apps over the NUMA nodes and run each on its node's cores (Linux).\n");
+  ZLog::Print("--job-timeout\t\tAbort an app that takes longer than this many seconds, the batch goes on.\n");
+  ZLog::Print("--job-cpu-timeout\tAbort an app that uses more than this many seconds of CPU over all its threads.\n");
+  ZLog::Print("--report\t\tWrite per-app and total timings, bytes and queue waits as JSON to this file.\n");
+  ZLog::Print("--prefetch\t\tRead this many of the next queued ipas into the page cache ahead of unzipping. (default: 0, off)\n");
+  ZLog::Print("--prefetch-budget\tBytes of queued ipas --prefetch may read ahead at once, e.g. 2G. (default: 1G)\n");
+  ZLog::Print("\nServer options:\n");
+  ZLog::Print("--serve\t\t\tKeep the identity loaded and sign requests from a Unix socket.\n");
+  ZLog::Print("\t\t\tUse --parallel to set how many requests run at once.\n");
+  ZLog::Print("--client\t\tSend the signing job to a --serve socket instead of signing here.\n");
 
   return -1;
 }
@@ -89,25 +161,47 @@ struct SigningTask {
     string inputPath;
     string outputPath;
     bool isZipFile;
+    uint64_t estimatedCost;
+    JValue overrides; // per-job options of a --manifest line
 };
 
+// Order in which bulk mode starts the apps
+enum eBulkOrder {
+    E_ORDER_LPT,  // largest estimated cost first
+    E_ORDER_FIFO, // as the input folder lists them
+    E_ORDER_NAME, // by file name
+};
+
+// What bulk mode does with an input identical to one already in the batch
+enum eDedupMode {
+    E_DEDUP_LINK, // hard link the first copy's output, or copy it across file systems
+    E_DEDUP_COPY, // copy the first copy's output
+    E_DEDUP_OFF,  // sign every copy
+};
+
+// Blocking FIFO shared by worker threads. With a capacity, push() waits while
+// the queue is full, which is how a slow stage holds back the one feeding it.
+template <typename T>
 class ThreadSafeQueue {
 private:
-    queue<SigningTask> taskQueue;
+    queue<T> taskQueue;
     mutex queueMutex;
     condition_variable cv;
+    condition_variable cvNotFull;
+    size_t capacity;
     bool done;
     
 public:
-    ThreadSafeQueue() : done(false) {}
+    explicit ThreadSafeQueue(size_t maxSize = 0) : capacity(maxSize), done(false) {}
     
-    void push(const SigningTask& task) {
-        lock_guard<mutex> lock(queueMutex);
-        taskQueue.push(task);
+    void push(T task) {
+        unique_lock<mutex> lock(queueMutex);
+        cvNotFull.wait(lock, [this]{ return 0 == capacity || taskQueue.size() < capacity; });
+        taskQueue.push(move(task));
         cv.notify_one();
     }
     
-    bool pop(SigningTask& task) {
+    bool pop(T& task) {
         unique_lock<mutex> lock(queueMutex);
         cv.wait(lock, [this]{ return !taskQueue.empty() || done; });
         
@@ -115,8 +209,9 @@ public:
             return false;
         }
         
-        task = taskQueue.front();
+        task = move(taskQueue.front());
         taskQueue.pop();
+        cvNotFull.notify_one();
         return true;
     }
     
@@ -135,156 +230,1028 @@ public:
         lock_guard<mutex> lock(queueMutex);
         return taskQueue.empty();
     }
-};
+};
+
+// Files sparse extraction writes to disk: everything signing reads or rewrites
+bool IsSparseSignEntry(const ZZipEntry &entry, const uint8_t *pHead, size_t sHeadLength) {
+    size_t pos = entry.strName.rfind('/');
+    string strFileName = (string::npos == pos) ? entry.strName : entry.strName.substr(pos + 1);
+    if ("Info.plist" == strFileName || "embedded.mobileprovision" == strFileName ||
+        IsPathSuffix(entry.strName, "_CodeSignature/CodeResources") ||
+        IsPathSuffix(entry.strName, ".dylib")) {
+        return true;
+    }
+    return ZMachO::IsMachO(pHead, sHeadLength);
+}
+
+// Unpack an opened ipa for signing. Every file is hashed while inflating so the
+// bundle can seal it without reading it again; in sparse mode the files that
+// signing doesn't need stay in the archive.
+bool UnzipIpa(ZZipReader &zipReader, ZAppBundle &bundle, const string &strFolder,
+              bool bSparse, int nThreads) {
+    map<string, ZFileDigest> mapDigests;
+    if (bSparse) {
+        set<string> setArchiveFiles;
+        if (!zipReader.ExtractSparse(strFolder, IsSparseSignEntry, mapDigests, setArchiveFiles, nThreads)) {
+            return false;
+        }
+        bundle.SetArchiveFiles(setArchiveFiles);
+    } else if (!zipReader.ExtractAll(strFolder, mapDigests, nThreads)) {
+        return false;
+    }
+    bundle.SetFileDigests(strFolder, mapDigests);
+    return true;
+}
+
+// SOURCE_DATE_EPOCH (reproducible-builds.org) pins the timestamps of
+// --deterministic output, 0 when it isn't set
+time_t GetSourceDateEpoch() {
+    const char *szEpoch = getenv("SOURCE_DATE_EPOCH");
+    if (NULL == szEpoch || '\0' == szEpoch[0]) {
+        return 0;
+    }
+    return (time_t)strtoll(szEpoch, NULL, 10);
+}
+
+// Archive the signed Payload folder. Input entries that signing didn't touch
+// are copied verbatim from the input ipa, compressed bytes and CRC included,
+// so only the rewritten files go through deflate.
+bool ZipIpa(ZAppBundle &bundle, ZZipReader &zipReader, const string &strFolder,
+            const string &strBaseFolder, const string &strOutputFile,
+            uint32_t uZipLevel, int nThreads, bool bDeterministic, ZZipStats &zipStats) {
+    const set<string> &setArchiveFiles = bundle.GetArchiveFiles();
+    const set<string> &setModifiedFiles = bundle.GetModifiedFiles();
+    string strPrefix = (strBaseFolder.size() > strFolder.size()) ? strBaseFolder.substr(strFolder.size() + 1) + "/" : "";
+
+    set<string> setPassthrough;
+    vector<const ZZipEntry *> arrPassthrough;
+    for (const auto &entry : zipReader.GetEntries()) {
+        if (entry.IsFolder() || 0 != entry.strName.compare(0, strPrefix.size() + 8, strPrefix + "Payload/")) {
+            continue;
+        }
+
+        string strPath = strFolder + "/" + entry.strName;
+        if (setModifiedFiles.count(strPath) > 0) {
+            continue;
+        }
+
+        // Files that only live in the archive are unchanged by definition, the
+        // extracted ones must still exist (signing may have removed them)
+        struct stat st;
+        if (0 == setArchiveFiles.count(entry.strName) && 0 != lstat(strPath.c_str(), &st)) {
+            continue;
+        }
+
+        if (setPassthrough.insert(entry.strName.substr(strPrefix.size())).second) {
+            arrPassthrough.push_back(&entry);
+        }
+    }
+
+    ZZipWriter zipWriter;
+    zipWriter.SetLevel(uZipLevel);
+    zipWriter.SetThreadCount(nThreads);
+    if (bDeterministic) {
+        zipWriter.SetDeterministic(GetSourceDateEpoch());
+    }
+    if (!zipWriter.AddFolder(strBaseFolder, "Payload", setPassthrough)) {
+        return false;
+    }
+
+    for (const ZZipEntry *pEntry : arrPassthrough) {
+        if (!zipWriter.AddEntry(&zipReader, *pEntry, pEntry->strName.substr(strPrefix.size()))) {
+            return false;
+        }
+    }
+    if (!zipWriter.WriteTo(strOutputFile.c_str())) {
+        return false;
+    }
+    zipStats.Add(zipWriter.GetStats());
+    return true;
+}
+
+// Bytes of unpacked apps bulk mode lets into the pipeline at once. A job
+// waits until its size fits next to the ones in flight; a job bigger than the
+// whole budget is let in as soon as nothing else is running. 0 is unlimited.
+// The wait doesn't count towards the job's wall-clock limit, and a job
+// cancelled while waiting gives up without taking any of the budget.
+class InflightBudget {
+private:
+    mutex budgetMutex;
+    condition_variable cv;
+    uint64_t budget;
+    uint64_t used;
+
+public:
+    explicit InflightBudget(uint64_t maxBytes) : budget(maxBytes), used(0) {}
+
+    bool acquire(uint64_t bytes) {
+        if (0 == budget) {
+            return true;
+        }
+        ZCancelToken *pToken = ZCancelToken::GetCurrent();
+        if (NULL != pToken) {
+            pToken->Pause();
+        }
+        unique_lock<mutex> lock(budgetMutex);
+        bool admitted = false;
+        while (!ZCancelToken::IsCurrentCancelled()) {
+            if (cv.wait_for(lock, chrono::milliseconds(200), [&]{ return 0 == used || used + bytes <= budget; })) {
+                used += bytes;
+                admitted = true;
+                break;
+            }
+        }
+        lock.unlock();
+        if (NULL != pToken) {
+            pToken->Resume();
+        }
+        return admitted;
+    }
+
+    void release(uint64_t bytes) {
+        if (0 == budget || 0 == bytes) {
+            return;
+        }
+        lock_guard<mutex> lock(budgetMutex);
+        used -= bytes;
+        cv.notify_all();
+    }
+};
+
+// With --numa every job gets a node, round robin, and whichever worker runs
+// one of its stages moves onto that node's cores first. The pages a job
+// unpacks and maps are then touched from the node that hashes and archives
+// them. Busy time and finished apps are counted per node.
+class NodePlacement {
+private:
+    struct NodeStats {
+        int apps;
+        int failed;
+        uint64_t bytes;
+        uint64_t busyMicros;
+    };
+    ZCpuTopology topology;
+    bool enabled;
+    atomic<size_t> nextNode;
+    mutex statsMutex;
+    vector<NodeStats> stats;
+
+public:
+    explicit NodePlacement(bool bEnabled) : enabled(bEnabled), nextNode(0) {
+        if (enabled) {
+            topology.Load();
+            stats.resize(topology.GetNodeCount(), NodeStats{0, 0, 0, 0});
+            for (size_t i = 0; i < topology.GetNodeCount(); i++) {
+                ZLog::PrintV(">>> NUMA Node %d: %zu cores\n", topology.GetNodeId(i), topology.GetNodeCpus(i).size());
+            }
+        }
+    }
+
+    int assign() {
+        return enabled ? (int)(nextNode++ % topology.GetNodeCount()) : -1;
+    }
+
+    // nBound is the node the calling worker sits on, -1 while it floats
+    void bind(int nNode, int &nBound) {
+        if (nNode < 0 || nNode == nBound) {
+            return;
+        }
+        if (!topology.BindThread((size_t)nNode)) {
+            ZLog::WarnV(">>> Can't Bind Worker To NUMA Node %d!\n", topology.GetNodeId(nNode));
+        }
+        nBound = nNode;
+    }
+
+    void addBusy(int nNode, uint64_t uMicros) {
+        if (nNode < 0) {
+            return;
+        }
+        lock_guard<mutex> lock(statsMutex);
+        stats[nNode].busyMicros += uMicros;
+    }
+
+    void addFinished(int nNode, uint64_t uBytes, bool success) {
+        if (nNode < 0) {
+            return;
+        }
+        lock_guard<mutex> lock(statsMutex);
+        stats[nNode].apps++;
+        stats[nNode].failed += success ? 0 : 1;
+        stats[nNode].bytes += uBytes;
+    }
+
+    void print(double elapsedTime) {
+        if (!enabled || elapsedTime <= 0) {
+            return;
+        }
+        lock_guard<mutex> lock(statsMutex);
+        for (size_t i = 0; i < stats.size(); i++) {
+            const NodeStats &node = stats[i];
+            ZLog::PrintV(">>> NUMA Node %d: %d apps (%d failed), %s unpacked, %.1fs busy, %.2f apps/s, %s/s\n",
+                         topology.GetNodeId(i), node.apps, node.failed, FormatSize(node.bytes).c_str(),
+                         node.busyMicros / 1000000.0, node.apps / elapsedTime,
+                         FormatSize((int64_t)(node.bytes / elapsedTime)).c_str());
+        }
+    }
+};
+
+// Settings shared by every app of a bulk run
+struct SigningOptions {
+    arksigningAsset *pSignAsset;
+    bool bForce;
+    bool bWeakInject;
+    bool bDontEmbedProfile;
+    vector<string> arrDyLibFiles;
+    string strBundleId;
+    string strDisplayName;
+    string strBundleVersion;
+    uint32_t uZipLevel;
+    int nIOThreads;
+    int nNodeThreads;
+    bool bSparse;
+    bool bDeterministic;
+    uint64_t uJobTimeout;
+    uint64_t uJobCPUTimeout;
+};
+
+// ZAppBundle::SignFolder doesn't rewrite Info.plist yet, so a job asking for
+// a new bundle id, name or version is refused rather than signed unchanged.
+// Returns the first such key, NULL when there is none.
+const char *GetUnsupportedOverride(const JValue &jvOverrides) {
+    const char *arrKeys[] = {"bundle_id", "bundle_name", "bundle_version"};
+    for (const char *szKey : arrKeys) {
+        if (jvOverrides.has(szKey)) {
+            return szKey;
+        }
+    }
+    return NULL;
+}
+
+// Per-app options of a --serve request or a --manifest line, on top of the
+// ones given on the command line
+void ApplySigningOverrides(const JValue &jvOverrides, SigningOptions &options) {
+    if (jvOverrides.has("dylibs")) {
+        options.arrDyLibFiles.clear();
+        for (size_t i = 0; i < jvOverrides["dylibs"].size(); i++) {
+            options.arrDyLibFiles.push_back(jvOverrides["dylibs"][i].asString());
+        }
+    }
+    if (jvOverrides.has("zip_level")) {
+        const JValue &jvLevel = jvOverrides["zip_level"];
+        options.uZipLevel = ("auto" == jvLevel.asString()) ? ZIP_LEVEL_AUTO : (uint32_t)jvLevel.asInt();
+    }
+    if (jvOverrides.has("force")) {
+        options.bForce = jvOverrides["force"].asBool();
+    }
+    if (jvOverrides.has("weak")) {
+        options.bWeakInject = jvOverrides["weak"].asBool();
+    }
+    if (jvOverrides.has("no_embed_profile")) {
+        options.bDontEmbedProfile = jvOverrides["no_embed_profile"].asBool();
+    }
+    if (jvOverrides.has("sparse")) {
+        options.bSparse = jvOverrides["sparse"].asBool();
+    }
+    if (jvOverrides.has("timeout")) {
+        options.uJobTimeout = (uint64_t)max(0.0, jvOverrides["timeout"].asFloat() * 1000000);
+    }
+    if (jvOverrides.has("cpu_timeout")) {
+        options.uJobCPUTimeout = (uint64_t)max(0.0, jvOverrides["cpu_timeout"].asFloat() * 1000000);
+    }
+}
+
+// The identity a job signs with: a registered one picked by "identity", one
+// loaded from the job's own identity files, or else the command line's
+arksigningAsset *ResolveSigningAsset(const JValue &jvOverrides, const ZSigningIdentity &defaultIdentity,
+                                     arksigningAsset *pDefaultAsset, ZIdentityRegistry &registry) {
+    if (jvOverrides.has("identity")) {
+        return registry.Find(jvOverrides["identity"].asString());
+    }
+    ZSigningIdentity identity = defaultIdentity;
+    if (identity.Apply(jvOverrides)) {
+        return registry.Get(identity);
+    }
+    return pDefaultAsset;
+}
+
+// One app on its way through the bulk pipeline. The open input archive, the
+// unpacked workspace and the bundle are handed from stage to stage with it;
+// the workspace goes away with the job.
+struct SigningJob {
+    SigningTask task;
+    ZZipReader zipReader;
+    ZWorkspace workspace;
+    ZAppBundle bundle;
+    SigningOptions options;
+    string strFolder;
+    uint64_t uInflightBytes;
+    string strInputHash;
+    string strDedupKey;
+    bool bSkipped;
+    bool bDeduped;
+    bool bDeferred;
+    int nNode;
+    ZCancelToken cancel;
+    ZJobTiming timing;
+    uint64_t uStartTime;
+    uint64_t uQueuedTime;
+    uint64_t uQueueWait;
+
+    SigningJob() : uInflightBytes(0), bSkipped(false), bDeduped(false), bDeferred(false), nNode(-1),
+                   uStartTime(0), uQueuedTime(0), uQueueWait(0) {}
+};
+
+typedef ThreadSafeQueue<unique_ptr<SigningJob>> SigningJobQueue;
+
+// --report: a JSON file with where every job's time went and the sums over
+// the run. Phase times add up the threads a phase ran on; queue waits cover
+// the stage queues and the in-flight budget.
+class RunReport {
+private:
+    string file;
+    mutex reportMutex;
+    JValue jobs;
+    JValue totals;
+
+public:
+    explicit RunReport(const string &strFile) : file(strFile), jobs(JValue::E_ARRAY), totals(JValue::E_OBJECT) {}
+
+    bool isEnabled() const {
+        return !file.empty();
+    }
+
+    void addJob(SigningJob &job, bool success) {
+        if (!isEnabled()) {
+            return;
+        }
+
+        JValue jvJob;
+        jvJob["input"] = job.task.inputPath;
+        jvJob["output"] = job.task.outputPath;
+        if (success) {
+            jvJob["status"] = job.bDeduped ? "deduped" : (job.bSkipped ? "skipped" : "signed");
+        } else if (job.cancel.IsCancelled()) {
+            jvJob["status"] = "aborted";
+            jvJob["error"] = job.cancel.GetReason();
+        } else {
+            jvJob["status"] = "failed";
+        }
+        jvJob["elapsed_ms"] = (job.uStartTime > 0) ? (GetMicroSecond() - job.uStartTime) / 1000.0 : 0.0;
+        jvJob["queue_wait_ms"] = job.uQueueWait / 1000.0;
+        int64_t nBytesIn = job.task.isZipFile ? GetFileSize(job.task.inputPath.c_str()) : GetFolderSize(job.task.inputPath.c_str());
+        int64_t nBytesOut = (success && !job.task.outputPath.empty()) ? GetFileSize(job.task.outputPath.c_str()) : 0;
+        jvJob["bytes_in"] = max<int64_t>(nBytesIn, 0);
+        jvJob["bytes_out"] = max<int64_t>(nBytesOut, 0);
+        job.timing.Write(jvJob);
+
+        lock_guard<mutex> lock(reportMutex);
+        ZJobTiming::AddTo(jvJob, totals);
+        totals["queue_wait_ms"] = totals["queue_wait_ms"].asFloat() + jvJob["queue_wait_ms"].asFloat();
+        totals["bytes_in"] = totals["bytes_in"].asInt64() + jvJob["bytes_in"].asInt64();
+        totals["bytes_out"] = totals["bytes_out"].asInt64() + jvJob["bytes_out"].asInt64();
+        jobs.push_back(jvJob);
+    }
+
+    void write(double elapsedTime, int nTotal, int nSucceeded, int nExtractThreads, int nSignThreads, int nArchiveThreads) {
+        if (!isEnabled()) {
+            return;
+        }
+
+        lock_guard<mutex> lock(reportMutex);
+        JValue jvReport;
+        jvReport["elapsed_ms"] = elapsedTime * 1000;
+        jvReport["apps"] = nTotal;
+        jvReport["succeeded"] = nSucceeded;
+        jvReport["failed"] = nTotal - nSucceeded;
+        jvReport["threads"]["extract"] = nExtractThreads;
+        jvReport["threads"]["sign"] = nSignThreads;
+        jvReport["threads"]["archive"] = nArchiveThreads;
+        jvReport["totals"] = totals;
+        if (elapsedTime > 0) {
+            jvReport["totals"]["apps_per_second"] = nTotal / elapsedTime;
+            jvReport["totals"]["bytes_in_per_second"] = totals["bytes_in"].asInt64() / elapsedTime;
+        }
+        jvReport["jobs"] = jobs;
+        if (!jvReport.styleWriteFile(file.c_str())) {
+            ZLog::ErrorV(">>> Can't Write Report! %s\n", file.c_str());
+            return;
+        }
+        ZLog::PrintV(">>> Report:\t%s\n", file.c_str());
+    }
+};
+
+// --prefetch: while the extractors are busy, a thread of its own asks the
+// kernel to read the next queued ipas into the page cache, at most nJobs of
+// them and uBudget bytes at a time. An extractor starting on one frees its
+// share. Inputs bigger than the whole budget and app folders are left alone.
+class InputPrefetcher {
+private:
+    struct Pending {
+        const SigningJob *job;
+        string path;
+        uint64_t size;
+        bool advised;
+    };
+    int maxJobs;
+    uint64_t budget;
+    mutex prefetchMutex;
+    condition_variable cv;
+    deque<Pending> pending;
+    uint64_t advisedBytes;
+    int totalJobs;
+    uint64_t totalBytes;
+    bool stopping;
+    thread worker;
+
+    // The first entry of the window that isn't advised yet and fits
+    Pending *next() {
+        for (size_t i = 0; i < pending.size() && i < (size_t)maxJobs; i++) {
+            Pending &entry = pending[i];
+            if (!entry.advised) {
+                return (advisedBytes + entry.size <= budget) ? &entry : NULL;
+            }
+        }
+        return NULL;
+    }
+
+    void run() {
+        unique_lock<mutex> lock(prefetchMutex);
+        while (true) {
+            cv.wait(lock, [&]() { return stopping || NULL != next(); });
+            if (stopping) {
+                return;
+            }
+            Pending *pEntry = next();
+            pEntry->advised = true;
+            advisedBytes += pEntry->size;
+            string strPath = pEntry->path;
+            uint64_t uSize = pEntry->size;
+            lock.unlock();
+            bool bAdvised = AdviseWillNeed(strPath.c_str(), uSize);
+            ZLog::DebugV(">>> Prefetch:\t%s (%s)%s\n", strPath.c_str(), FormatSize((int64_t)uSize).c_str(), bAdvised ? "" : " failed");
+            lock.lock();
+            if (bAdvised) {
+                totalJobs++;
+                totalBytes += uSize;
+            }
+        }
+    }
+
+public:
+    InputPrefetcher(int nJobs, uint64_t uBudget)
+        : maxJobs(nJobs), budget(uBudget), advisedBytes(0), totalJobs(0), totalBytes(0), stopping(false) {
+        if (maxJobs > 0 && budget > 0) {
+            worker = thread(&InputPrefetcher::run, this);
+        }
+    }
+
+    ~InputPrefetcher() {
+        {
+            lock_guard<mutex> lock(prefetchMutex);
+            stopping = true;
+            cv.notify_all();
+        }
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    void queued(const SigningJob &job) {
+        if (!worker.joinable() || !job.task.isZipFile) {
+            return;
+        }
+        int64_t nSize = GetFileSize(job.task.inputPath.c_str());
+        if (nSize <= 0 || (uint64_t)nSize > budget) {
+            return;
+        }
+        lock_guard<mutex> lock(prefetchMutex);
+        pending.push_back(Pending{&job, job.task.inputPath, (uint64_t)nSize, false});
+        cv.notify_all();
+    }
+
+    void started(const SigningJob &job) {
+        if (!worker.joinable()) {
+            return;
+        }
+        lock_guard<mutex> lock(prefetchMutex);
+        for (size_t i = 0; i < pending.size(); i++) {
+            if (pending[i].job == &job) {
+                if (pending[i].advised) {
+                    advisedBytes -= pending[i].size;
+                }
+                pending.erase(pending.begin() + i);
+                cv.notify_all();
+                break;
+            }
+        }
+    }
+
+    void print() {
+        if (!worker.joinable()) {
+            return;
+        }
+        lock_guard<mutex> lock(prefetchMutex);
+        ZLog::PrintV(">>> Prefetched: %d inputs, %s\n", totalJobs, FormatSize((int64_t)totalBytes).c_str());
+    }
+};
+
+// Open the input ipa and unpack it into a fresh workspace once its unpacked
+// size fits the in-flight budget. Folder inputs are signed in place and don't
+// count against it.
+bool ExtractJob(SigningJob &job, const SigningOptions &options, InflightBudget &budget, mutex &printMutex) {
+    if (!job.task.isZipFile) {
+        job.strFolder = job.task.inputPath;
+        return true;
+    }
+
+    if (!job.zipReader.Open(job.task.inputPath.c_str())) {
+        lock_guard<mutex> lock(printMutex);
+        ZLog::ErrorV(">>> Unzip Failed!\n");
+        return false;
+    }
+
+    uint64_t uUncompressedSize = job.zipReader.GetUncompressedSize();
+    uint64_t uWaitBegin = GetMicroSecond();
+    bool bAdmitted = budget.acquire(uUncompressedSize);
+    job.uQueueWait += GetMicroSecond() - uWaitBegin;
+    if (!bAdmitted) {
+        lock_guard<mutex> lock(printMutex);
+        ZLog::ErrorV(">>> Unzip Failed!\n");
+        return false;
+    }
+    job.uInflightBytes = uUncompressedSize;
+
+    ZPhaseTimer timer(ZJobTiming::E_PHASE_EXTRACT);
+    if (!job.workspace.Create("arksigning_folder_", job.uInflightBytes)) {
+        lock_guard<mutex> lock(printMutex);
+        ZLog::ErrorV(">>> Unzip Failed!\n");
+        return false;
+    }
+    job.strFolder = job.workspace.GetFolder();
+    {
+        lock_guard<mutex> lock(printMutex);
+        ZLog::PrintV(">>> Unzip:\t%s (%s) -> %s ... \n", job.task.inputPath.c_str(),
+                 GetFileSizeString(job.task.inputPath.c_str()).c_str(), job.strFolder.c_str());
+    }
+    if (!UnzipIpa(job.zipReader, job.bundle, job.strFolder, options.bSparse, options.nIOThreads)) {
+        lock_guard<mutex> lock(printMutex);
+        ZLog::ErrorV(">>> Unzip Failed!\n");
+        return false;
+    }
+    return true;
+}
+
+bool SignJob(SigningJob &job, const SigningOptions &options) {
+    job.bundle.SetThreadCount(options.nNodeThreads);
+    return job.bundle.SignFolder(options.pSignAsset, job.strFolder, options.strBundleId,
+                                 options.strBundleVersion, options.strDisplayName, options.arrDyLibFiles,
+                                 options.bForce, options.bWeakInject, !job.task.isZipFile,
+                                 options.bDontEmbedProfile);
+}
+
+bool ArchiveJob(SigningJob &job, const SigningOptions &options, mutex &printMutex, ZZipStats &zipStats) {
+    if (job.task.outputPath.empty()) {
+        return true;
+    }
+
+    size_t pos = job.bundle.m_strAppFolder.rfind("/Payload");
+    if (string::npos == pos) {
+        lock_guard<mutex> lock(printMutex);
+        ZLog::Error(">>> Can't Find Payload Directory!\n");
+        return false;
+    }
+
+    {
+        lock_guard<mutex> lock(printMutex);
+        ZLog::PrintV(">>> Archiving: \t%s ... \n", job.task.outputPath.c_str());
+    }
+    string strBaseFolder = job.bundle.m_strAppFolder.substr(0, pos);
+    ZZipStats stats;
+    bool bRet = false;
+    {
+        ZPhaseTimer timer(ZJobTiming::E_PHASE_ARCHIVE);
+        bRet = ZipIpa(job.bundle, job.zipReader, job.strFolder, strBaseFolder, job.task.outputPath,
+                      options.uZipLevel, options.nIOThreads, options.bDeterministic, stats);
+    }
+    if (!bRet) {
+        lock_guard<mutex> lock(printMutex);
+        ZLog::Error(">>> Archive Failed!\n");
+        return false;
+    }
+    lock_guard<mutex> lock(printMutex);
+    zipStats.Add(stats);
+    ZLog::PrintV(">>> Archive OK! (%s)\n", GetFileSizeString(job.task.outputPath.c_str()).c_str());
+    return true;
+}
+
+// Relative work of signing an app: an ipa is read, inflated, hashed and
+// deflated again, which scales with its compressed plus uncompressed size
+// taken from the central directory; a folder is hashed and archived.
+uint64_t EstimateSigningCost(const SigningTask& task) {
+    if (!task.isZipFile) {
+        return 2 * (uint64_t)GetFolderSize(task.inputPath.c_str());
+    }
+
+    ZZipReader zipReader;
+    int64_t nFileSize = GetFileSize(task.inputPath.c_str());
+    if (nFileSize < 0) {
+        return 0;
+    }
+    if (!zipReader.Open(task.inputPath.c_str())) {
+        return (uint64_t)nFileSize;
+    }
+    return (uint64_t)nFileSize + zipReader.GetUncompressedSize();
+}
+
+bool ParseBulkOrder(const char *szValue, eBulkOrder &eOrder) {
+    if (0 == strcmp(szValue, "lpt")) {
+        eOrder = E_ORDER_LPT;
+    } else if (0 == strcmp(szValue, "fifo")) {
+        eOrder = E_ORDER_FIFO;
+    } else if (0 == strcmp(szValue, "name")) {
+        eOrder = E_ORDER_NAME;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool ParseDedupMode(const char *szValue, eDedupMode &eDedup) {
+    if (0 == strcmp(szValue, "link")) {
+        eDedup = E_DEDUP_LINK;
+    } else if (0 == strcmp(szValue, "copy")) {
+        eDedup = E_DEDUP_COPY;
+    } else if (0 == strcmp(szValue, "off")) {
+        eDedup = E_DEDUP_OFF;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Parse --stage-threads <extract>:<sign>:<archive>, 0 keeps the default of a stage
+bool ParseStageThreads(const char *szValue, int arrThreads[3]) {
+    int nExtract = 0;
+    int nSign = 0;
+    int nArchive = 0;
+    char cEnd = 0;
+    if (3 != sscanf(szValue, "%d:%d:%d%c", &nExtract, &nSign, &nArchive, &cEnd) ||
+        nExtract < 0 || nSign < 0 || nArchive < 0) {
+        return false;
+    }
+    arrThreads[0] = nExtract;
+    arrThreads[1] = nSign;
+    arrThreads[2] = nArchive;
+    return true;
+}
+
+// Parse a time limit in seconds such as 90 or 2.5 into microseconds, 0 is none
+bool ParseTimeout(const char *szValue, uint64_t &uTimeout) {
+    double dSeconds = 0;
+    char cEnd = 0;
+    if (1 != sscanf(szValue, "%lf%c", &dSeconds, &cEnd) || dSeconds < 0) {
+        return false;
+    }
+    uTimeout = (uint64_t)(dSeconds * 1000000);
+    return true;
+}
+
+// <name>.ipa or an app folder <name> is written as <name>_signed.ipa
+string GetSignedOutputPath(const string &strOutputFolder, const string &strInputPath) {
+    string strName = strInputPath.substr(strInputPath.rfind('/') + 1);
+    size_t extPos = strName.rfind(".ipa");
+    if (string::npos != extPos) {
+        strName = strName.substr(0, extPos);
+    }
+    return strOutputFolder + "/" + strName + "_signed.ipa";
+}
+
+// A task for an input the scanner found. Outputs keep the input's folder
+// below --inputfolder, so same-named apps of different folders don't clash.
+SigningTask GetScannedTask(const string& outputFolder, const string& strInput, const string& strRelPath, bool bZipFile) {
+    SigningTask task;
+    task.inputPath = strInput;
+    task.isZipFile = bZipFile;
+    task.estimatedCost = 0;
+    size_t pos = strRelPath.rfind('/');
+    string strFolder = (string::npos == pos) ? outputFolder : outputFolder + "/" + strRelPath.substr(0, pos);
+    if (string::npos != pos) {
+        CreateFolderTree(strFolder);
+    }
+    task.outputPath = GetSignedOutputPath(strFolder, strRelPath);
+    return task;
+}
+
+// --manifest: one JSON object per line with "input", "output" and the
+// per-job overrides of a --serve request, including an "identity" from
+// --identities or the identity files "cert", "pkey", "prov", "entitlements"
+// and "password". Relative paths are taken
+// from the manifest's folder, a missing output is named like the input in
+// --outputfolder. Blank lines and lines starting with # are skipped.
+bool LoadManifest(const string& manifestFile, const string& outputFolder, vector<SigningTask>& allTasks) {
+    string strData;
+    if (!ReadFile(manifestFile.c_str(), strData)) {
+        ZLog::ErrorV(">>> Cannot read manifest: %s\n", manifestFile.c_str());
+        return false;
+    }
+
+    string strBaseFolder = manifestFile.substr(0, manifestFile.rfind('/'));
+    auto resolvePath = [&](const string& strPath) {
+        return (strPath.empty() || '/' == strPath[0]) ? strPath : strBaseFolder + "/" + strPath;
+    };
+
+    size_t uLine = 0;
+    size_t sBegin = 0;
+    while (sBegin < strData.size()) {
+        size_t sEnd = strData.find('\n', sBegin);
+        if (string::npos == sEnd) {
+            sEnd = strData.size();
+        }
+        string strLine = strData.substr(sBegin, sEnd - sBegin);
+        sBegin = sEnd + 1;
+        uLine++;
+
+        size_t pos = strLine.find_first_not_of(" \t\r");
+        if (string::npos == pos || '#' == strLine[pos]) {
+            continue;
+        }
+
+        SigningTask task;
+        string strError;
+        if (!task.overrides.read(strLine, &strError) || !task.overrides.isObject()) {
+            ZLog::ErrorV(">>> Invalid manifest line %zu: %s\n", uLine, strError.c_str());
+            return false;
+        }
+
+        JValue &jvJob = task.overrides;
+        const char *szUnsupported = GetUnsupportedOverride(jvJob);
+        if (NULL != szUnsupported) {
+            ZLog::ErrorV(">>> Manifest line %zu: \"%s\" is not supported per job\n", uLine, szUnsupported);
+            return false;
+        }
+
+        const char *arrPathKeys[] = {"input", "output", "cert", "pkey", "prov", "entitlements"};
+        for (const char *szKey : arrPathKeys) {
+            if (jvJob.has(szKey)) {
+                jvJob[szKey] = resolvePath(jvJob[szKey].asString());
+            }
+        }
+        if (jvJob.has("dylibs")) {
+            for (size_t i = 0; i < jvJob["dylibs"].size(); i++) {
+                jvJob["dylibs"][i] = resolvePath(jvJob["dylibs"][i].asString());
+            }
+        }
+
+        string strInput = jvJob["input"].asString();
+        task.inputPath = strInput;
+        task.isZipFile = !IsFolder(strInput.c_str()) && IsZipFile(strInput.c_str());
+        task.estimatedCost = 0;
+        if (strInput.empty() || (!task.isZipFile && !FindAppFolder(strInput, task.inputPath))) {
+            ZLog::ErrorV(">>> Manifest line %zu: no ipa or app folder at \"%s\"\n", uLine, strInput.c_str());
+            return false;
+        }
+
+        task.outputPath = jvJob["output"].asString();
+        if (task.outputPath.empty()) {
+            if (outputFolder.empty()) {
+                ZLog::ErrorV(">>> Manifest line %zu: no output and no --outputfolder\n", uLine);
+                return false;
+            }
+            task.outputPath = GetSignedOutputPath(outputFolder, strInput);
+        }
+        allTasks.push_back(task);
+    }
+    return true;
+}
+
+// Everything besides the input that a journal entry must match for its
+// output to be reused: the identity's key material and the options that
+// change what gets signed
+JValue GetJournalSettings(const SigningOptions &options) {
+    JValue jvSettings;
+    jvSettings["identity"] = options.pSignAsset->GetFingerprint();
+    jvSettings["bundle_id"] = options.strBundleId;
+    jvSettings["bundle_name"] = options.strDisplayName;
+    jvSettings["bundle_version"] = options.strBundleVersion;
+    jvSettings["dylibs"] = JValue(JValue::E_ARRAY);
+    for (const string &strDyLibFile : options.arrDyLibFiles) {
+        string strDyLibData;
+        string strDyLibHash;
+        ReadFile(strDyLibFile.c_str(), strDyLibData);
+        SHA1Text(strDyLibData, strDyLibHash);
+        jvSettings["dylibs"].push_back(string(basename((char *)strDyLibFile.c_str())) + ":" + strDyLibHash);
+    }
+    jvSettings["zip_level"] = (int)options.uZipLevel;
+    jvSettings["weak"] = options.bWeakInject;
+    jvSettings["no_embed_profile"] = options.bDontEmbedProfile;
+    jvSettings["deterministic"] = options.bDeterministic;
+    return jvSettings;
+}
+
+// True when the journal already has this job with the same input, identity
+// and options and its output is still what was written. The input is only
+// hashed when there is an entry to compare with; the hash is kept for the
+// entry the job records once it's done.
+bool IsJournaled(SigningJob &job, ZSignJournal &journal) {
+    JValue jvEntry;
+    if (!journal.Find(job.task.outputPath, jvEntry) ||
+        !ZSignJournal::HashFile(job.task.inputPath, job.strInputHash) ||
+        jvEntry["input_sha256"].asString() != job.strInputHash) {
+        return false;
+    }
+
+    string strSettings;
+    string strEntrySettings;
+    GetJournalSettings(job.options).write(strSettings);
+    jvEntry["settings"].write(strEntrySettings);
+    string strOutputHash;
+    return strSettings == strEntrySettings &&
+           ZSignJournal::HashFile(job.task.outputPath, strOutputHash) &&
+           strOutputHash == jvEntry["output_sha256"].asString();
+}
+
+bool JournalJob(const SigningJob &job, ZSignJournal &journal) {
+    string strInputHash = job.strInputHash;
+    string strOutputHash;
+    if ((strInputHash.empty() && !ZSignJournal::HashFile(job.task.inputPath, strInputHash)) ||
+        !ZSignJournal::HashFile(job.task.outputPath, strOutputHash)) {
+        return false;
+    }
+
+    JValue jvEntry;
+    jvEntry["input"] = job.task.inputPath;
+    jvEntry["input_sha256"] = strInputHash;
+    jvEntry["output"] = job.task.outputPath;
+    jvEntry["output_sha256"] = strOutputHash;
+    jvEntry["settings"] = GetJournalSettings(job.options);
+    jvEntry["time"] = (int64_t)time(NULL);
+    return journal.Append(jvEntry);
+}
+
+// Inputs with the same size and central directory (names, CRC-32s and
+// sizes of every entry) signed with the same settings give the same app.
+// Empty when the input can't be read.
+string GetDedupKey(const SigningJob &job) {
+    ZZipReader zipReader;
+    if (!zipReader.Open(job.task.inputPath.c_str())) {
+        return string();
+    }
 
-bool processFile(const SigningTask& task, arksigningAsset* pSignAsset, bool bForce, 
-               bool bWeakInject, bool bDontEmbedProfile, vector<string> arrDyLibFiles, 
-               string strBundleId, string strDisplayName, string strBundleVersion,
-               uint32_t uZipLevel, atomic<int>& completedTasks, int totalTasks, mutex& printMutex) {
-    ZTimer timer;
-    bool bEnableCache = !task.isZipFile;
-    string strFolder = task.inputPath;
-    bool bRet = false;
-    
-    {
-        lock_guard<mutex> lock(printMutex);
-        ZLog::PrintV(">>> Processing [%d/%d]: %s\n", completedTasks.load()+1, totalTasks, task.inputPath.c_str());
+    string strDirectory;
+    for (const auto &entry : zipReader.GetEntries()) {
+        char buf[64] = {0};
+        snprintf(buf, sizeof(buf), "\n%08x %llu ", entry.uCRC32, (unsigned long long)entry.uUncompressedSize);
+        strDirectory += buf;
+        strDirectory += entry.strName;
     }
-    
-    if (task.isZipFile) {
-        StringFormat(strFolder, "/tmp/arksigning_folder_%llu", timer.Reset());
-        {
-            lock_guard<mutex> lock(printMutex);
-            ZLog::PrintV(">>> Unzip:\t%s (%s) -> %s ... \n", task.inputPath.c_str(),
-                     GetFileSizeString(task.inputPath.c_str()).c_str(), strFolder.c_str());
+    string strKey;
+    SHA1Text(strDirectory, strKey);
+
+    string strSettings;
+    GetJournalSettings(job.options).write(strSettings);
+    StringFormat(strKey, "%llu:%s:%s", (unsigned long long)GetFileSize(job.task.inputPath.c_str()),
+                 strKey.c_str(), strSettings.c_str());
+    return strKey;
+}
+
+// The first job of each dedup key (the leader) is signed. Copies that show
+// up while it runs wait here without holding a worker and are finished
+// along with it; later ones take its output right away.
+class DedupTable {
+private:
+    struct Entry {
+        bool done;
+        bool success;
+        string output;
+        vector<unique_ptr<SigningJob>> followers;
+    };
+    mutex tableMutex;
+    map<string, Entry> entries;
+
+public:
+    enum eClaim { E_CLAIM_LEADER, E_CLAIM_WAITING, E_CLAIM_DONE };
+
+    // For E_CLAIM_DONE, strOutput is the leader's output if it succeeded
+    eClaim claim(SigningJob &job, string &strOutput) {
+        lock_guard<mutex> lock(tableMutex);
+        auto it = entries.find(job.strDedupKey);
+        if (it == entries.end()) {
+            Entry &entry = entries[job.strDedupKey];
+            entry.done = false;
+            entry.success = false;
+            entry.output = job.task.outputPath;
+            return E_CLAIM_LEADER;
         }
-        RemoveFolder(strFolder.c_str());
-        if (!SystemExec("unzip -qq -d '%s' '%s'", strFolder.c_str(),
-                    task.inputPath.c_str())) {
-            RemoveFolder(strFolder.c_str());
-            lock_guard<mutex> lock(printMutex);
-            ZLog::ErrorV(">>> Unzip Failed!\n");
-            completedTasks++;
-            return false;
+        if (it->second.done) {
+            strOutput = it->second.success ? it->second.output : string();
+            return E_CLAIM_DONE;
         }
+
+        unique_ptr<SigningJob> follower(new SigningJob());
+        follower->task = job.task;
+        follower->options = job.options;
+        follower->strInputHash = job.strInputHash;
+        follower->bDeduped = true;
+        follower->nNode = job.nNode;
+        it->second.followers.push_back(move(follower));
+        job.bDeferred = true;
+        return E_CLAIM_WAITING;
     }
-    
-    timer.Reset();
-    ZAppBundle bundle;
-    bRet = bundle.SignFolder(pSignAsset, strFolder, strBundleId,
-                            strBundleVersion, strDisplayName, arrDyLibFiles,
-                            bForce, bWeakInject, bEnableCache,
-                            bDontEmbedProfile);
-    
-    if (bRet && !task.outputPath.empty()) {
-        timer.Reset();
-        size_t pos = bundle.m_strAppFolder.rfind("/Payload");
-        if (string::npos == pos) {
-            lock_guard<mutex> lock(printMutex);
-            ZLog::Error(">>> Can't Find Payload Directory!\n");
-            completedTasks++;
-            return false;
-        }
 
-        lock_guard<mutex> lock(printMutex);
-        ZLog::PrintV(">>> Archiving: \t%s ... \n", task.outputPath.c_str());
-        string strBaseFolder = bundle.m_strAppFolder.substr(0, pos);
-        char szOldFolder[PATH_MAX] = {0};
-        if (NULL != getcwd(szOldFolder, PATH_MAX)) {
-            if (0 == chdir(strBaseFolder.c_str())) {
-                RemoveFile(task.outputPath.c_str());
-                SystemExec("zip -q -%u -r '%s' Payload", uZipLevel,
-                       task.outputPath.c_str());
-                chdir(szOldFolder);
-                if (!IsFileExists(task.outputPath.c_str())) {
-                    ZLog::Error(">>> Archive Failed!\n");
-                    completedTasks++;
-                    return false;
-                }
-            }
-        }
-        ZLog::PrintV(">>> Archive OK! (%s)\n", GetFileSizeString(task.outputPath.c_str()).c_str());
+    // The jobs that waited for this leader
+    vector<unique_ptr<SigningJob>> finish(const SigningJob &leader, bool success) {
+        lock_guard<mutex> lock(tableMutex);
+        Entry &entry = entries[leader.strDedupKey];
+        entry.done = true;
+        entry.success = success;
+        return move(entry.followers);
     }
-    
-    // Clean up
-    if (task.isZipFile && 0 == strFolder.find("/tmp/arksigning_folder_")) {
-        RemoveFolder(strFolder.c_str());
+};
+
+// Give an output the content of an identical job's output. Written next to
+// it and renamed into place, so a crash never leaves a partial output.
+bool LinkSignedOutput(const string &strSource, const string &strOutput, eDedupMode eDedup) {
+    if (strSource.empty()) {
+        return false;
     }
-    
-    {
-        lock_guard<mutex> lock(printMutex);
-        if (bRet) {
-            ZLog::PrintV(">>> Successfully signed: %s\n", task.inputPath.c_str());
-        } else {
-            ZLog::ErrorV(">>> Failed to sign: %s\n", task.inputPath.c_str());
-        }
+    string strTemp = strOutput + ".dedup";
+    unlink(strTemp.c_str());
+    if ((E_DEDUP_LINK != eDedup || 0 != link(strSource.c_str(), strTemp.c_str())) &&
+        !CopyFileContent(strSource.c_str(), strTemp.c_str())) {
+        unlink(strTemp.c_str());
+        return false;
     }
-    
-    completedTasks++;
-    return bRet;
+    return 0 == rename(strTemp.c_str(), strOutput.c_str());
 }
 
-bool bulkSign(const string& inputFolder, const string& outputFolder, arksigningAsset* pSignAsset,
-            bool bForce, bool bWeakInject, bool bDontEmbedProfile, vector<string> arrDyLibFiles,
-            string strBundleId, string strDisplayName, string strBundleVersion,
-            uint32_t uZipLevel, int threadCount) 
+bool bulkSign(const string& inputFolder, const string& outputFolder, const string& manifestFile,
+            ZInputScanner& scanner, const SigningOptions& defaults,
+            ZIdentityRegistry& registry, const ZSigningIdentity& defaultIdentity,
+            int threadCount, const int arrStageThreads[3], eBulkOrder eOrder, uint64_t uMaxInflightBytes,
+            bool bJournal, eDedupMode eDedup, bool bNumaPlacement, const string& reportFile,
+            int nPrefetchJobs, uint64_t uPrefetchBudget) 
 {
     // Create output folder if it doesn't exist
-    CreateFolder(outputFolder.c_str());
+    if (!outputFolder.empty()) {
+        CreateFolder(outputFolder.c_str());
+    }
     
-    // Find all app files in the input folder
-    vector<SigningTask> allTasks;
-    DIR* dir = opendir(inputFolder.c_str());
-    if (!dir) {
-        ZLog::ErrorV(">>> Cannot open input folder: %s\n", inputFolder.c_str());
+    // Jobs an earlier run of the same batch finished are skipped. Folder
+    // inputs are signed in place, so they can't be compared and always run.
+    ZSignJournal journal;
+    if (bJournal && !outputFolder.empty() && !journal.Open(outputFolder + "/.arksigning_journal")) {
         return false;
     }
-    
-    ZLog::PrintV(">>> Scanning folder: %s\n", inputFolder.c_str());
-    
-    dirent* entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_REG || entry->d_type == DT_DIR) {
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                continue;
-            }
-            
-            string fullPath = inputFolder + "/" + entry->d_name;
-            bool isZip = IsZipFile(fullPath.c_str());
-            bool isFolder = IsFolder(fullPath.c_str());
-            
-            if (isZip || (isFolder && FindAppFolder(fullPath.c_str(), fullPath))) {
-                SigningTask task;
-                task.inputPath = fullPath;
-                task.isZipFile = isZip;
-                
-                if (isZip) {
-                    string fileName = string(entry->d_name);
-                    size_t extPos = fileName.rfind(".ipa");
-                    if (extPos != string::npos) {
-                        fileName = fileName.substr(0, extPos) + "_signed.ipa";
-                    } else {
-                        fileName += "_signed.ipa";
-                    }
-                    task.outputPath = outputFolder + "/" + fileName;
-                } else {
-                    // For folders, we'll create an IPA with the folder name
-                    string folderName = string(entry->d_name);
-                    task.outputPath = outputFolder + "/" + folderName + "_signed.ipa";
-                }
-                
-                allTasks.push_back(task);
-            }
+
+    // In FIFO order jobs go to the pipeline while the input folder is still
+    // being scanned; the other orders need every app before the first starts
+    bool bStream = manifestFile.empty() && E_ORDER_FIFO == eOrder;
+    if (!outputFolder.empty()) {
+        scanner.SkipFolder(outputFolder);
+    }
+
+    vector<SigningTask> allTasks;
+    if (!manifestFile.empty()) {
+        if (!LoadManifest(manifestFile, outputFolder, allTasks)) {
+            return false;
+        }
+    } else if (!bStream) {
+        mutex tasksMutex;
+        bool bScanned = scanner.Scan(inputFolder, 0, [&](const string& strInput, const string& strRelPath, bool bZipFile) {
+            SigningTask task = GetScannedTask(outputFolder, strInput, strRelPath, bZipFile);
+            lock_guard<mutex> lock(tasksMutex);
+            allTasks.push_back(task);
+        });
+        if (!bScanned) {
+            return false;
         }
     }
-    closedir(dir);
-    
-    if (allTasks.empty()) {
-        ZLog::PrintV(">>> No valid apps found in the input folder.\n");
-        return false;
+
+    if (!bStream) {
+        if (allTasks.empty()) {
+            ZLog::PrintV(">>> No valid apps found to sign.\n");
+            return false;
+        }
+        ZLog::PrintV(">>> Found %zu apps to sign\n", allTasks.size());
+    }
+
+    // The batch can't finish before its biggest app, so starting the big ones
+    // first keeps a late giant from running alone at the end (LPT scheduling)
+    if (E_ORDER_LPT == eOrder) {
+        for (auto& task : allTasks) {
+            task.estimatedCost = EstimateSigningCost(task);
+        }
+        stable_sort(allTasks.begin(), allTasks.end(), [](const SigningTask& a, const SigningTask& b) {
+            return a.estimatedCost > b.estimatedCost;
+        });
+        for (const auto& task : allTasks) {
+            ZLog::DebugV(">>> Estimated: %s\t%s\n", FormatSize(task.estimatedCost).c_str(), task.inputPath.c_str());
+        }
+    } else if (E_ORDER_NAME == eOrder) {
+        sort(allTasks.begin(), allTasks.end(), [](const SigningTask& a, const SigningTask& b) {
+            return a.inputPath < b.inputPath;
+        });
     }
-    
-    ZLog::PrintV(">>> Found %zu apps to sign\n", allTasks.size());
     
     if (threadCount <= 0) {
         // Auto-detect optimal thread count
@@ -293,11 +1260,27 @@ bool bulkSign(const string& inputFolder, const string& outputFolder, arksigningA
             threadCount = 2; // Default fallback
         }
     }
-    
-    // Limit thread count to number of tasks
-    threadCount = min(threadCount, (int)allTasks.size());
-    
-    ZLog::PrintV(">>> Using %d worker threads\n", threadCount);
+
+    // Every app goes through three stages with their own workers: unzip (disk
+    // bound), sign (hashing, CPU bound) and archive (deflate and disk). By
+    // default the signers get the --parallel count and the two I/O stages half
+    // of it each, so the disks stay busy while the cores hash.
+    int nExtractThreads = (arrStageThreads[0] > 0) ? arrStageThreads[0] : max(1, (threadCount + 1) / 2);
+    int nSignThreads = (arrStageThreads[1] > 0) ? arrStageThreads[1] : threadCount;
+    int nArchiveThreads = (arrStageThreads[2] > 0) ? arrStageThreads[2] : max(1, (threadCount + 1) / 2);
+    if (!bStream) {
+        nExtractThreads = min(nExtractThreads, (int)allTasks.size());
+        nSignThreads = min(nSignThreads, (int)allTasks.size());
+        nArchiveThreads = min(nArchiveThreads, (int)allTasks.size());
+    }
+
+    ZLog::PrintV(">>> Using %d extract, %d sign and %d archive threads\n", nExtractThreads, nSignThreads, nArchiveThreads);
+
+    SigningOptions options = defaults;
+    // Share the cores between the extraction and archiving workers
+    options.nIOThreads = max(1, (int)thread::hardware_concurrency() / max(nExtractThreads, nArchiveThreads));
+    // and between the signers for the nested bundles of an app
+    options.nNodeThreads = max(1, (int)thread::hardware_concurrency() / nSignThreads);
 
     // Set up modern callback system
     ArkSigning::Callbacks::CallbackManager callbackManager;
@@ -305,55 +1288,222 @@ bool bulkSign(const string& inputFolder, const string& outputFolder, arksigningA
     callbackManager.setSigningErrorCallback(ArkSigning::Callbacks::createModernSigningErrorCallback());
     callbackManager.setSigningCompletionCallback(ArkSigning::Callbacks::createModernSigningCompletionCallback());
 
-    // Set up threading
-    ThreadSafeQueue taskQueue;
-    for (const auto& task : allTasks) {
-        taskQueue.push(task);
-    }
+    // The queues between stages hold at most one job per downstream worker, a
+    // stage that falls behind blocks the one before it instead of letting
+    // unpacked apps pile up on disk. Jobs waiting to start are kept few too,
+    // a streaming scan that runs ahead waits for the extractors.
+    SigningJobQueue extractQueue(4 * nExtractThreads);
+    SigningJobQueue signQueue(nSignThreads);
+    SigningJobQueue archiveQueue(nArchiveThreads);
+    atomic<int> totalTasks(0);
+    NodePlacement placement(bNumaPlacement);
+    RunReport report(reportFile);
+    InputPrefetcher prefetcher(nPrefetchJobs, uPrefetchBudget);
+    auto queueTask = [&](const SigningTask& task) {
+        unique_ptr<SigningJob> job(new SigningJob());
+        job->task = task;
+        job->options = options;
+        ApplySigningOverrides(task.overrides, job->options);
+        job->options.pSignAsset = ResolveSigningAsset(task.overrides, defaultIdentity, options.pSignAsset, registry);
+        job->nNode = placement.assign();
+        job->uQueuedTime = GetMicroSecond();
+        totalTasks++;
+        prefetcher.queued(*job);
+        extractQueue.push(move(job));
+    };
 
+    InflightBudget inflightBudget(uMaxInflightBytes);
+    DedupTable dedupTable;
     mutex printMutex;
-    atomic<int> completedTasks(0);
+    ZZipStats zipStats;
+    atomic<int> startedTasks(0);
     atomic<int> successfulTasks(0);
-    vector<thread> workers;
     auto startTime = chrono::high_resolution_clock::now();
-    
-    // Create modern worker lambdas with callback support
-    auto createWorkerLambda = [&]() {
-        return [&taskQueue, pSignAsset, bForce, bWeakInject, bDontEmbedProfile,
-                arrDyLibFiles, strBundleId, strDisplayName, strBundleVersion,
-                uZipLevel, &completedTasks, &successfulTasks, &printMutex, &allTasks, &callbackManager]() {
-            SigningTask task;
-            while (taskQueue.pop(task)) {
-                // Report progress using modern callback
-                int current = ++completedTasks;
-                callbackManager.reportSigningProgress(task.inputPath, current, static_cast<int>(allTasks.size()));
-
-                bool success = processFile(task, pSignAsset, bForce, bWeakInject, bDontEmbedProfile,
-                                      arrDyLibFiles, strBundleId, strDisplayName, strBundleVersion,
-                                      uZipLevel, completedTasks, allTasks.size(), printMutex);
-                if (success) {
-                    successfulTasks++;
+
+    auto reportJob = [&](SigningJob &job, bool success) {
+        report.addJob(job, success);
+        {
+            lock_guard<mutex> lock(printMutex);
+            if (success && job.bDeduped) {
+                ZLog::PrintV(">>> Same as an earlier input: %s -> %s\n", job.task.inputPath.c_str(), job.task.outputPath.c_str());
+            } else if (success && job.bSkipped) {
+                ZLog::PrintV(">>> Already signed: %s -> %s\n", job.task.inputPath.c_str(), job.task.outputPath.c_str());
+            } else if (success) {
+                ZLog::PrintV(">>> Successfully signed: %s\n", job.task.inputPath.c_str());
+            } else if (job.cancel.IsCancelled()) {
+                ZLog::ErrorV(">>> Aborted, %s: %s\n", job.cancel.GetReason().c_str(), job.task.inputPath.c_str());
+            } else {
+                ZLog::ErrorV(">>> Failed to sign: %s\n", job.task.inputPath.c_str());
+            }
+        }
+        if (success) {
+            successfulTasks++;
+        } else {
+            callbackManager.reportSigningError(job.task.inputPath, job.cancel.IsCancelled() ? "Aborted, " + job.cancel.GetReason() : string("Processing failed"));
+        }
+    };
+
+    // The output of a deduplicated job is its leader's
+    auto takeLeaderOutput = [&](SigningJob &job, const string &strOutput) {
+        if (!LinkSignedOutput(strOutput, job.task.outputPath, eDedup)) {
+            return false;
+        }
+        if (journal.IsOpen() && job.task.isZipFile && !JournalJob(job, journal)) {
+            lock_guard<mutex> lock(printMutex);
+            ZLog::WarnV(">>> Not journaled, a rerun will sign it again: %s\n", job.task.inputPath.c_str());
+        }
+        return true;
+    };
+
+    // A job leaves the pipeline after its last stage or at the first failure,
+    // copies of its input that waited on it leave with it
+    auto finishJob = [&](SigningJob &job, bool success) {
+        placement.addFinished(job.nNode, job.uInflightBytes, success);
+        job.workspace.Remove();
+        inflightBudget.release(job.uInflightBytes);
+        job.uInflightBytes = 0;
+        reportJob(job, success);
+        if (job.strDedupKey.empty()) {
+            return;
+        }
+        for (auto &follower : dedupTable.finish(job, success)) {
+            placement.addFinished(follower->nNode, 0, success);
+            reportJob(*follower, success && takeLeaderOutput(*follower, job.task.outputPath));
+        }
+    };
+
+    auto createStageWorker = [&](SigningJobQueue &input, SigningJobQueue *pOutput,
+                                 function<bool(SigningJob &)> stage) {
+        return [&input, pOutput, stage, &finishJob, &placement]() {
+            int nBoundNode = -1;
+            unique_ptr<SigningJob> job;
+            while (input.pop(job)) {
+                job->uQueueWait += GetMicroSecond() - job->uQueuedTime;
+                placement.bind(job->nNode, nBoundNode);
+                uint64_t uBeginTime = GetMicroSecond();
+                bool success = false;
+                {
+                    // Everything the stage runs, on this thread or the ones it
+                    // starts, polls the job's token and gives up once it's set.
+                    // Its wall clock is stopped while it waits between stages.
+                    ZCancelScope scope(&job->cancel);
+                    ZTimingScope timingScope(&job->timing);
+                    job->cancel.Resume();
+                    success = stage(*job);
+                    job->cancel.Pause();
+                }
+                placement.addBusy(job->nNode, GetMicroSecond() - uBeginTime);
+                if (job->bDeferred) {
+                    // Finished by the job it waits on
+                } else if (success && NULL != pOutput && !job->bSkipped) {
+                    job->uQueuedTime = GetMicroSecond();
+                    pOutput->push(move(job));
                 } else {
-                    callbackManager.reportSigningError(task.inputPath, "Processing failed");
+                    finishJob(*job, success);
                 }
+                job.reset();
             }
         };
     };
 
-    for (int i = 0; i < threadCount; i++) {
-        workers.emplace_back(createWorkerLambda());
+    vector<thread> extractWorkers;
+    vector<thread> signWorkers;
+    vector<thread> archiveWorkers;
+    for (int i = 0; i < nExtractThreads; i++) {
+        extractWorkers.emplace_back(createStageWorker(extractQueue, &signQueue, [&](SigningJob &job) {
+            // The job's time limits count from here to the end of archiving,
+            // leaving out the time it waits for the in-flight budget and in
+            // the queues between stages
+            prefetcher.started(job);
+            job.cancel.Start(job.options.uJobTimeout, job.options.uJobCPUTimeout);
+            job.uStartTime = GetMicroSecond();
+            // Report progress using modern callback
+            int current = ++startedTasks;
+            int total = totalTasks.load();
+            callbackManager.reportSigningProgress(job.task.inputPath, current, total);
+            {
+                lock_guard<mutex> lock(printMutex);
+                ZLog::PrintV(">>> Processing [%d/%d]: %s\n", current, total, job.task.inputPath.c_str());
+                if (NULL == job.options.pSignAsset) {
+                    ZLog::ErrorV(">>> No usable identity for: %s\n", job.task.inputPath.c_str());
+                    return false;
+                }
+            }
+            if (journal.IsOpen() && job.task.isZipFile && IsJournaled(job, journal)) {
+                job.bSkipped = true;
+                return true;
+            }
+            if (E_DEDUP_OFF != eDedup && job.task.isZipFile) {
+                job.strDedupKey = GetDedupKey(job);
+            }
+            if (!job.strDedupKey.empty()) {
+                string strOutput;
+                DedupTable::eClaim eClaim = dedupTable.claim(job, strOutput);
+                if (DedupTable::E_CLAIM_WAITING == eClaim) {
+                    return true;
+                }
+                if (DedupTable::E_CLAIM_DONE == eClaim) {
+                    job.strDedupKey.clear();
+                    job.bSkipped = true;
+                    job.bDeduped = true;
+                    return takeLeaderOutput(job, strOutput);
+                }
+            }
+            if (!ExtractJob(job, job.options, inflightBudget, printMutex)) {
+                return false;
+            }
+            // A new job's input is hashed for its journal entry right after
+            // unzipping, while it is still in the page cache
+            if (journal.IsOpen() && job.task.isZipFile && job.strInputHash.empty()) {
+                ZSignJournal::HashFile(job.task.inputPath, job.strInputHash);
+            }
+            return true;
+        }));
     }
-
-    // Wait for all tasks to be processed, then signal completion
-    while (completedTasks.load() < static_cast<int>(allTasks.size())) {
-        this_thread::sleep_for(chrono::milliseconds(100));
+    for (int i = 0; i < nSignThreads; i++) {
+        signWorkers.emplace_back(createStageWorker(signQueue, &archiveQueue, [&](SigningJob &job) {
+            return SignJob(job, job.options);
+        }));
+    }
+    for (int i = 0; i < nArchiveThreads; i++) {
+        archiveWorkers.emplace_back(createStageWorker(archiveQueue, NULL, [&](SigningJob &job) {
+            if (!ArchiveJob(job, job.options, printMutex, zipStats)) {
+                return false;
+            }
+            if (journal.IsOpen() && job.task.isZipFile && !JournalJob(job, journal)) {
+                lock_guard<mutex> lock(printMutex);
+                ZLog::WarnV(">>> Not journaled, a rerun will sign it again: %s\n", job.task.inputPath.c_str());
+            }
+            return true;
+        }));
     }
 
-    // Signal that no more tasks will be added
-    taskQueue.setDone();
+    bool bScanned = true;
+    if (bStream) {
+        bScanned = scanner.Scan(inputFolder, 0, [&](const string& strInput, const string& strRelPath, bool bZipFile) {
+            queueTask(GetScannedTask(outputFolder, strInput, strRelPath, bZipFile));
+        });
+        if (bScanned) {
+            ZLog::PrintV(">>> Found %d apps to sign\n", totalTasks.load());
+        }
+    } else {
+        for (const auto& task : allTasks) {
+            queueTask(task);
+        }
+    }
+    extractQueue.setDone();
 
-    // Wait for all threads to complete
-    for (auto& worker : workers) {
+    // Shut the stages down front to back, each one's queue is closed once
+    // every worker feeding it has finished
+    for (auto& worker : extractWorkers) {
+        worker.join();
+    }
+    signQueue.setDone();
+    for (auto& worker : signWorkers) {
+        worker.join();
+    }
+    archiveQueue.setDone();
+    for (auto& worker : archiveWorkers) {
         worker.join();
     }
 
@@ -361,9 +1511,115 @@ bool bulkSign(const string& inputFolder, const string& outputFolder, arksigningA
     auto endTime = chrono::high_resolution_clock::now();
     auto elapsedTime = chrono::duration<double>(endTime - startTime).count();
 
-    callbackManager.reportSigningCompletion(successfulTasks.load(), static_cast<int>(allTasks.size()), elapsedTime);
+    if (0 == totalTasks.load()) {
+        if (bScanned) {
+            ZLog::PrintV(">>> No valid apps found to sign.\n");
+        }
+        return false;
+    }
+    callbackManager.reportSigningCompletion(successfulTasks.load(), totalTasks.load(), elapsedTime);
+    placement.print(elapsedTime);
+    prefetcher.print();
+    report.write(elapsedTime, totalTasks.load(), successfulTasks.load(), nExtractThreads, nSignThreads, nArchiveThreads);
+
+    // Size and CPU per compression class over all archives
+    if (ZIP_LEVEL_AUTO == defaults.uZipLevel || ZLog::IsDebug()) {
+        zipStats.Print();
+    }
+
+    return bScanned && successfulTasks.load() == totalTasks.load();
+}
+
+// One --serve request, run through the same stages as a bulk job. The
+// request may override the per-app options the server was started with.
+bool ServeSignRequest(const JValue &jvRequest, const SigningOptions &defaults,
+                      ZIdentityRegistry &registry, const ZSigningIdentity &defaultIdentity,
+                      InflightBudget &budget, mutex &printMutex,
+                      const ZSignServer::EventSink &sink, string &strError) {
+    SigningJob job;
+    string strInput = jvRequest["input"].asString();
+    job.task.inputPath = strInput;
+    job.task.outputPath = jvRequest["output"].asString();
+    job.task.isZipFile = !IsFolder(strInput.c_str()) && IsZipFile(strInput.c_str());
+    job.task.estimatedCost = 0;
+    if (strInput.empty() || '/' != strInput[0] ||
+        (!job.task.isZipFile && !FindAppFolder(strInput, job.task.inputPath))) {
+        strError = "Invalid input, expected the absolute path of an ipa or app folder: " + strInput;
+        return false;
+    }
+    if (!job.task.outputPath.empty() && '/' != job.task.outputPath[0]) {
+        strError = "Output must be an absolute path: " + job.task.outputPath;
+        return false;
+    }
+
+    const char *szUnsupported = GetUnsupportedOverride(jvRequest);
+    if (NULL != szUnsupported) {
+        strError = string("\"") + szUnsupported + "\" is not supported per request";
+        return false;
+    }
+
+    SigningOptions options = defaults;
+    ApplySigningOverrides(jvRequest, options);
+    options.pSignAsset = ResolveSigningAsset(jvRequest, defaultIdentity, defaults.pSignAsset, registry);
+    if (NULL == options.pSignAsset) {
+        strError = jvRequest.has("identity") ? "Unknown or ambiguous identity: " + jvRequest["identity"].asString()
+                                             : string("No usable identity");
+        return false;
+    }
+
+    auto reportStage = [&](const char *szStage) {
+        JValue jvEvent;
+        jvEvent["event"] = "progress";
+        jvEvent["stage"] = szStage;
+        sink(jvEvent);
+    };
+
+    ZZipStats zipStats;
+    const char *szStage = "extract";
+    bool bRet = false;
+    job.cancel.Start(options.uJobTimeout, options.uJobCPUTimeout);
+    {
+        ZCancelScope scope(&job.cancel);
+        reportStage(szStage);
+        bRet = ExtractJob(job, options, budget, printMutex);
+        if (bRet) {
+            szStage = "sign";
+            reportStage(szStage);
+            bRet = SignJob(job, options);
+        }
+        if (bRet) {
+            szStage = "archive";
+            reportStage(szStage);
+            bRet = ArchiveJob(job, options, printMutex, zipStats);
+        }
+    }
+
+    job.workspace.Remove();
+    budget.release(job.uInflightBytes);
+    if (!bRet && job.cancel.IsCancelled()) {
+        strError = string(szStage) + " aborted, " + job.cancel.GetReason() + ": " + strInput;
+    } else if (!bRet) {
+        strError = string(szStage) + " failed: " + strInput;
+    }
+    return bRet;
+}
 
-    return static_cast<size_t>(successfulTasks.load()) == allTasks.size();
+// --client: hand the job to a running --serve and follow its progress
+bool SubmitSignRequest(const string &strSocketPath, const JValue &jvRequest) {
+    return ZSignServer::Submit(strSocketPath, jvRequest, [](const JValue &jvEvent) {
+        string strEvent = jvEvent["event"].asString();
+        if ("queued" == strEvent) {
+            ZLog::PrintV(">>> Queued: \t%d ahead\n", jvEvent["position"].asInt());
+        } else if ("progress" == strEvent) {
+            ZLog::PrintV(">>> Stage: \t%s ...\n", jvEvent["stage"].asCString());
+        } else if ("done" == strEvent) {
+            if (jvEvent["ok"].asBool()) {
+                ZLog::PrintV(">>> Done! (%lldms)\n", (long long)jvEvent["elapsed_ms"].asInt64());
+            } else {
+                ZLog::ErrorV(">>> %s\n", jvEvent["error"].asCString());
+            }
+        }
+    });
 }
 
 // Function already declared in bundle.cpp, removed to fix build error
@@ -376,7 +1632,10 @@ int main(int argc, char *argv[]) {
   bool bWeakInject = false;
   bool bDontEmbedProfile = false;
   bool bBulkMode = false;
+  bool bSparse = false;
+  bool bDeterministic = false;
   uint32_t uZipLevel = 0;
+  bool bZipLevel = false;
 
   string strCertFile;
   string strPKeyFile;
@@ -391,6 +1650,28 @@ int main(int argc, char *argv[]) {
   string strInputFolder;
   string strOutputFolder;
   int nParallelThreads = 0;
+  int arrStageThreads[3] = {0, 0, 0};
+  eBulkOrder eOrder = E_ORDER_LPT;
+  uint64_t uMaxInflightBytes = 0;
+  string strServeSocket;
+  string strManifestFile;
+  string strClientSocket;
+  string strIdentitiesFile;
+  string strIdentity;
+  bool bLazyIdentities = false;
+  bool bJournal = true;
+  bool bNumaPlacement = false;
+  uint64_t uJobTimeout = 0;
+  uint64_t uJobCPUTimeout = 0;
+  string strReportFile;
+  int nPrefetchJobs = 0;
+  uint64_t uPrefetchBudget = 1024ULL * 1024 * 1024;
+  eDedupMode eDedup = E_DEDUP_LINK;
+  ZInputScanner scanner;
+  string strRamFolder;
+  string strSignCacheFolder;
+  uint64_t uSignCacheSize = 1024ULL * 1024 * 1024;
+  uint64_t uRamBudget = 0;
 
   vector<string> arrDyLibFiles;
 
@@ -439,7 +1720,8 @@ int main(int argc, char *argv[]) {
       strOutputFile = GetCanonicalizePath(optarg);
       break;
     case 'z':
-      uZipLevel = atoi(optarg);
+      uZipLevel = (0 == strcmp(optarg, "auto")) ? ZIP_LEVEL_AUTO : atoi(optarg);
+      bZipLevel = true;
       break;
     case 'w':
       bWeakInject = true;
@@ -469,6 +1751,114 @@ int main(int argc, char *argv[]) {
         nParallelThreads = -1; // Auto-detect
       }
       break;
+    case 1003: // sparse
+      bSparse = true;
+      break;
+    case 1004: // workdir
+      if (!ZWorkspace::SetRoot(GetCanonicalizePath(optarg))) {
+        return -1;
+      }
+      break;
+    case 1005: // ramdir
+      strRamFolder = GetCanonicalizePath(optarg);
+      break;
+    case 1006: // ram-budget
+      if (!ParseSize(optarg, uRamBudget)) {
+        ZLog::ErrorV(">>> Invalid --ram-budget: %s, expected a size such as 512M or 4G\n", optarg);
+        return -1;
+      }
+      break;
+    case 1007: // no-io-uring
+      ZBatchIO::SetUringEnabled(false);
+      break;
+    case 1008: // deterministic
+      bDeterministic = true;
+      break;
+    case 1009: // stage-threads
+      if (!ParseStageThreads(optarg, arrStageThreads)) {
+        ZLog::ErrorV(">>> Invalid --stage-threads: %s, expected extract:sign:archive\n", optarg);
+        return -1;
+      }
+      break;
+    case 1010: // order
+      if (!ParseBulkOrder(optarg, eOrder)) {
+        ZLog::ErrorV(">>> Invalid --order: %s, expected lpt, fifo or name\n", optarg);
+        return -1;
+      }
+      break;
+    case 1011: // max-inflight-bytes
+      if (!ParseSize(optarg, uMaxInflightBytes)) {
+        ZLog::ErrorV(">>> Invalid --max-inflight-bytes: %s, expected a size such as 512M or 4G\n", optarg);
+        return -1;
+      }
+      break;
+    case 1012: // serve
+      strServeSocket = GetCanonicalizePath(optarg);
+      break;
+    case 1013: // client
+      strClientSocket = GetCanonicalizePath(optarg);
+      break;
+    case 1014: // manifest
+      strManifestFile = GetCanonicalizePath(optarg);
+      break;
+    case 1015: // identities
+      strIdentitiesFile = GetCanonicalizePath(optarg);
+      break;
+    case 1016: // identity
+      strIdentity = optarg;
+      break;
+    case 1017: // lazy-identities
+      bLazyIdentities = true;
+      break;
+    case 1018: // no-journal
+      bJournal = false;
+      break;
+    case 1019: // recursive
+      scanner.SetRecursive(true);
+      break;
+    case 1020: // include
+      scanner.AddInclude(optarg);
+      break;
+    case 1021: // exclude
+      scanner.AddExclude(optarg);
+      break;
+    case 1022: // dedup
+      if (!ParseDedupMode(optarg, eDedup)) {
+        ZLog::ErrorV(">>> Invalid --dedup: %s, expected link, copy or off\n", optarg);
+        return -1;
+      }
+      break;
+    case 1023: // sign-cache
+      strSignCacheFolder = GetCanonicalizePath(optarg);
+      break;
+    case 1024: // sign-cache-size
+      if (!ParseSize(optarg, uSignCacheSize)) {
+        ZLog::ErrorV(">>> Invalid --sign-cache-size: %s, expected a size such as 512M or 4G\n", optarg);
+        return -1;
+      }
+      break;
+    case 1025: // numa
+      bNumaPlacement = true;
+      break;
+    case 1026: // job-timeout
+    case 1027: // job-cpu-timeout
+      if (!ParseTimeout(optarg, (1026 == opt) ? uJobTimeout : uJobCPUTimeout)) {
+        ZLog::ErrorV(">>> Invalid --%s: %s, expected seconds\n", (1026 == opt) ? "job-timeout" : "job-cpu-timeout", optarg);
+        return -1;
+      }
+      break;
+    case 1028: // report
+      strReportFile = optarg;
+      break;
+    case 1029: // prefetch
+      nPrefetchJobs = max(0, atoi(optarg));
+      break;
+    case 1030: // prefetch-budget
+      if (!ParseSize(optarg, uPrefetchBudget)) {
+        ZLog::ErrorV(">>> Invalid --prefetch-budget: %s, expected a size such as 512M or 4G\n", optarg);
+        return -1;
+      }
+      break;
     case 'h':
     case '?':
       return usage();
@@ -480,13 +1870,17 @@ int main(int argc, char *argv[]) {
       }
       
       string strFolder = strPath;
-      ZTimer timer;
+      ZWorkspace workspace;
       if (IsZipFile(strPath.c_str())) {
-        StringFormat(strFolder, "/tmp/arksigning_info_%llu", timer.Reset());
+        ZZipReader zipReader;
+        if (!zipReader.Open(strPath.c_str()) ||
+            !workspace.Create("arksigning_info_", zipReader.GetUncompressedSize())) {
+          ZLog::ErrorV(">>> Unzip Failed!\n");
+          return -1;
+        }
+        strFolder = workspace.GetFolder();
         ZLog::PrintV(">>> Unzip:\t%s -> %s ... \n", strPath.c_str(), strFolder.c_str());
-        RemoveFolder(strFolder.c_str());
-        if (!SystemExec("unzip -qq -d '%s' '%s'", strFolder.c_str(), strPath.c_str())) {
-          RemoveFolder(strFolder.c_str());
+        if (!zipReader.ExtractAll(strFolder)) {
           ZLog::ErrorV(">>> Unzip Failed!\n");
           return -1;
         }
@@ -506,46 +1900,156 @@ int main(int argc, char *argv[]) {
         jvInfo.styleWrite(strJson);
         printf("%s\n", strJson.c_str());
       }
-      
-      if (0 == strFolder.find("/tmp/arksigning_info_")) {
-        RemoveFolder(strFolder.c_str());
-      }
       return 0;
     }
     }
     ZLog::DebugV(">>> Option:\t-%c, %s\n", opt, optarg);
   }
 
-  if (bBulkMode) {
-    if (strInputFolder.empty() || strOutputFolder.empty()) {
+  if (!strRamFolder.empty() &&
+      !ZWorkspace::SetMemoryRoot(strRamFolder, uRamBudget)) {
+    return -1;
+  }
+
+  if (!strSignCacheFolder.empty() &&
+      !ZFileCache::SetFolder(strSignCacheFolder, uSignCacheSize)) {
+    return -1;
+  }
+
+  // Per-app options shared by bulk, manifest and server jobs
+  SigningOptions defaults;
+  defaults.pSignAsset = NULL;
+  defaults.bForce = bForce;
+  defaults.bWeakInject = bWeakInject;
+  defaults.bDontEmbedProfile = bDontEmbedProfile;
+  defaults.arrDyLibFiles = arrDyLibFiles;
+  defaults.strBundleId = strBundleId;
+  defaults.strDisplayName = strDisplayName;
+  defaults.strBundleVersion = strBundleVersion;
+  defaults.uZipLevel = uZipLevel;
+  defaults.bSparse = bSparse;
+  defaults.bDeterministic = bDeterministic;
+  defaults.nIOThreads = 0;
+  defaults.nNodeThreads = 0;
+  defaults.uJobTimeout = uJobTimeout;
+  defaults.uJobCPUTimeout = uJobCPUTimeout;
+
+  ZSigningIdentity defaultIdentity;
+  defaultIdentity.strCertFile = strCertFile;
+  defaultIdentity.strPKeyFile = strPKeyFile;
+  defaultIdentity.strProvFile = strProvFile;
+  defaultIdentity.strEntitlementsFile = strEntitlementsFile;
+  defaultIdentity.strPassword = strPassword;
+
+  // Every identity of the process is parsed once and shared by all its jobs
+  ZIdentityRegistry registry;
+  if (bDeterministic) {
+    registry.SetDeterministic(GetSourceDateEpoch());
+  }
+  if (!strIdentitiesFile.empty() && !registry.LoadFile(strIdentitiesFile, bLazyIdentities)) {
+    return -1;
+  }
+  auto getDefaultAsset = [&]() {
+    return strIdentity.empty() ? registry.Get(defaultIdentity) : registry.Find(strIdentity);
+  };
+  // Jobs that bring their own identity don't need a default one
+  bool bNeedDefault = !strIdentity.empty() || !strPKeyFile.empty();
+
+  if (bBulkMode || !strManifestFile.empty()) {
+    if (strManifestFile.empty() && (strInputFolder.empty() || strOutputFolder.empty())) {
       ZLog::ErrorV(">>> Bulk mode requires both --inputfolder and --outputfolder parameters\n");
       return usage();
     }
     
-    if (!IsFolder(strInputFolder.c_str())) {
+    if (strManifestFile.empty() && !IsFolder(strInputFolder.c_str())) {
       ZLog::ErrorV(">>> Input folder does not exist or is not a directory: %s\n", strInputFolder.c_str());
       return -1;
     }
     
-    arksigningAsset arksigningAsset;
-    if (!arksigningAsset.Init(strCertFile, strPKeyFile, strProvFile,
-                         strEntitlementsFile, strPassword)) {
-      return -1;
+    if (bNeedDefault || strManifestFile.empty()) {
+      defaults.pSignAsset = getDefaultAsset();
+      if (NULL == defaults.pSignAsset) {
+        return -1;
+      }
     }
     
-    bool bSuccess = bulkSign(strInputFolder, strOutputFolder, &arksigningAsset,
-                           bForce, bWeakInject, bDontEmbedProfile, arrDyLibFiles,
-                           strBundleId, strDisplayName, strBundleVersion,
-                           uZipLevel, nParallelThreads);
+    bool bSuccess = bulkSign(strInputFolder, strOutputFolder, strManifestFile, scanner, defaults, registry, defaultIdentity,
+                           nParallelThreads, arrStageThreads, eOrder, uMaxInflightBytes, bJournal, eDedup, bNumaPlacement, strReportFile,
+                           nPrefetchJobs, uPrefetchBudget);
     
     gtimer.Print(">>> Bulk signing completed.");
     return bSuccess ? 0 : -1;
   }
   
+  if (!strServeSocket.empty()) {
+    if (bNeedDefault || strIdentitiesFile.empty()) {
+      defaults.pSignAsset = getDefaultAsset();
+      if (NULL == defaults.pSignAsset) {
+        return -1;
+      }
+    }
+
+    ZSignServer server;
+    if (!server.Listen(strServeSocket)) {
+      return -1;
+    }
+
+    int nWorkers = (nParallelThreads > 0) ? nParallelThreads : max(1, (int)thread::hardware_concurrency());
+    defaults.nIOThreads = max(1, (int)thread::hardware_concurrency() / nWorkers);
+    defaults.nNodeThreads = defaults.nIOThreads;
+
+    InflightBudget inflightBudget(uMaxInflightBytes);
+    mutex printMutex;
+    bool bRet = server.Run([&](const JValue &jvRequest, const ZSignServer::EventSink &sink, string &strError) {
+      return ServeSignRequest(jvRequest, defaults, registry, defaultIdentity, inflightBudget, printMutex, sink, strError);
+    }, nWorkers);
+    return bRet ? 0 : -1;
+  }
+
   if (optind >= argc) {
     return usage();
   }
 
+  if (!strClientSocket.empty()) {
+    JValue jvRequest;
+    jvRequest["input"] = GetCanonicalizePath(argv[optind]);
+    jvRequest["output"] = strOutputFile;
+    if (!strIdentity.empty()) {
+      jvRequest["identity"] = strIdentity;
+    }
+    // Only what was given on the command line, the server's defaults cover the rest
+    if (bZipLevel) {
+      jvRequest["zip_level"] = (ZIP_LEVEL_AUTO == uZipLevel) ? JValue("auto") : JValue((int)uZipLevel);
+    }
+    if (!strBundleId.empty()) {
+      jvRequest["bundle_id"] = strBundleId;
+    }
+    if (!strDisplayName.empty()) {
+      jvRequest["bundle_name"] = strDisplayName;
+    }
+    if (!strBundleVersion.empty()) {
+      jvRequest["bundle_version"] = strBundleVersion;
+    }
+    for (const string &strDyLibFile : arrDyLibFiles) {
+      jvRequest["dylibs"].push_back(GetCanonicalizePath(strDyLibFile.c_str()));
+    }
+    if (bForce) {
+      jvRequest["force"] = true;
+    }
+    if (bWeakInject) {
+      jvRequest["weak"] = true;
+    }
+    if (bDontEmbedProfile) {
+      jvRequest["no_embed_profile"] = true;
+    }
+    if (bSparse) {
+      jvRequest["sparse"] = true;
+    }
+    bool bRet = SubmitSignRequest(strClientSocket, jvRequest);
+    gtimer.Print(">>> Done.");
+    return bRet ? 0 : -1;
+  }
+
   strPath = GetCanonicalizePath(argv[optind]);
   if (!IsFileExists(strPath.c_str())) {
     ZLog::ErrorV(">>> Invalid Path! %s\n", strPath.c_str());
@@ -579,24 +2083,29 @@ int main(int argc, char *argv[]) {
   }
 
   ZTimer timer;
-  arksigningAsset arksigningAsset;
-  if (!arksigningAsset.Init(strCertFile, strPKeyFile, strProvFile,
-                       strEntitlementsFile, strPassword)) {
+  arksigningAsset *pSignAsset = getDefaultAsset();
+  if (NULL == pSignAsset) {
     return -1;
   }
 
   bool bEnableCache = true;
   string strFolder = strPath;
+  ZZipReader zipReader;
+  ZWorkspace workspace;
+  ZAppBundle bundle;
   if (bZipFile) {
     bForce = true;
     bEnableCache = false;
-    StringFormat(strFolder, "/tmp/arksigning_folder_%llu", timer.Reset());
+    timer.Reset();
+    if (!zipReader.Open(strPath.c_str()) ||
+        !workspace.Create("arksigning_folder_", zipReader.GetUncompressedSize())) {
+      ZLog::ErrorV(">>> Unzip Failed!\n");
+      return -1;
+    }
+    strFolder = workspace.GetFolder();
     ZLog::PrintV(">>> Unzip:\t%s (%s) -> %s ... \n", strPath.c_str(),
                  GetFileSizeString(strPath.c_str()).c_str(), strFolder.c_str());
-    RemoveFolder(strFolder.c_str());
-    if (!SystemExec("unzip -qq -d '%s' '%s'", strFolder.c_str(),
-                    strPath.c_str())) {
-      RemoveFolder(strFolder.c_str());
+    if (!UnzipIpa(zipReader, bundle, strFolder, bSparse, 0)) {
       ZLog::ErrorV(">>> Unzip Failed!\n");
       return -1;
     }
@@ -604,15 +2113,17 @@ int main(int argc, char *argv[]) {
   }
 
   timer.Reset();
-  ZAppBundle bundle;
-  bool bRet = bundle.SignFolder(&arksigningAsset, strFolder, strBundleId,
+  bool bRet = bundle.SignFolder(pSignAsset, strFolder, strBundleId,
                                 strBundleVersion, strDisplayName, arrDyLibFiles,
                                 bForce, bWeakInject, bEnableCache,
                                 bDontEmbedProfile);
   timer.PrintResult(bRet, ">>> Signed %s!", bRet ? "OK" : "Failed");
 
+  bool bTempOutput = false;
   if (bInstall && strOutputFile.empty()) {
-    StringFormat(strOutputFile, "/tmp/arksigning_temp_%llu.ipa", GetMicroSecond());
+    StringFormat(strOutputFile, "%s/arksigning_temp_%llu_%d.ipa",
+                 ZWorkspace::GetRoot().c_str(), GetMicroSecond(), (int)getpid());
+    bTempOutput = true;
   }
 
   if (!strOutputFile.empty()) {
@@ -625,35 +2136,28 @@ int main(int argc, char *argv[]) {
 
     ZLog::PrintV(">>> Archiving: \t%s ... \n", strOutputFile.c_str());
     string strBaseFolder = bundle.m_strAppFolder.substr(0, pos);
-    char szOldFolder[PATH_MAX] = {0};
-    if (NULL != getcwd(szOldFolder, PATH_MAX)) {
-      if (0 == chdir(strBaseFolder.c_str())) {
-        uZipLevel = uZipLevel > 9 ? 9 : uZipLevel;
-        RemoveFile(strOutputFile.c_str());
-        SystemExec("zip -q -%u -r '%s' Payload", uZipLevel,
-                   strOutputFile.c_str());
-        chdir(szOldFolder);
-        if (!IsFileExists(strOutputFile.c_str())) {
-          ZLog::Error(">>> Archive Failed!\n");
-          return -1;
-        }
-      }
+    ZZipStats zipStats;
+    if (!ZipIpa(bundle, zipReader, strFolder, strBaseFolder, strOutputFile,
+                uZipLevel, 0, bDeterministic, zipStats)) {
+      ZLog::Error(">>> Archive Failed!\n");
+      return -1;
     }
     timer.PrintResult(true, ">>> Archive OK! (%s)",
                       GetFileSizeString(strOutputFile.c_str()).c_str());
+    if (ZIP_LEVEL_AUTO == uZipLevel || ZLog::IsDebug()) {
+      zipStats.Print();
+    }
   }
 
   if (bRet && bInstall) {
     SystemExec("ideviceinstaller -i '%s'", strOutputFile.c_str());
   }
 
-  if (0 == strOutputFile.find("/tmp/arksigning_tmp_")) {
+  if (bTempOutput) {
     RemoveFile(strOutputFile.c_str());
   }
 
-  if (0 == strFolder.find("/tmp/arksigning_folder_")) {
-    RemoveFolder(strFolder.c_str());
-  }
+  workspace.Remove();
 
   gtimer.Print(">>> Done.");
   return bRet ? 0 : -1;
@@ -153,7 +153,7 @@ ASN1_TYPE *_GenerateASN1Type(const string &value)
 	return ret;
 }
 
-bool _GenerateCMS(X509 *scert, EVP_PKEY *spkey, const string &strCDHashData, const string &strCDHashesPlist, const string &strCodeDirectorySlotSHA1, const string &strAltnateCodeDirectorySlot256, string &strCMSOutput)
+bool _GenerateCMS(X509 *scert, EVP_PKEY *spkey, const string &strCDHashData, const string &strCDHashesPlist, const string &strCodeDirectorySlotSHA1, const string &strAltnateCodeDirectorySlot256, time_t tSigningTime, string &strCMSOutput)
 {
 	// Suppress unused parameter warning - parameter kept for API compatibility
 	(void)strCodeDirectorySlotSHA1;
@@ -265,6 +265,17 @@ bool _GenerateCMS(X509 *scert, EVP_PKEY *spkey, const string &strCDHashData, con
         return CMSError();
     }
 
+	// CMS_final stamps the current time unless a signing time is already there
+	if (tSigningTime > 0)
+	{
+		ASN1_TIME *pTime = ASN1_TIME_set(nullptr, tSigningTime);
+		int addSigningTime = pTime ? CMS_signed_add1_attr_by_NID(si, NID_pkcs9_signingTime, pTime->type, pTime, -1) : 0;
+		ASN1_TIME_free(pTime);
+		if (!addSigningTime) {
+			return CMSError();
+		}
+	}
+
 	if (!CMS_final(cms.get(), in.get(), nullptr, nFlags))
 	{
 		return CMSError();
@@ -312,7 +323,7 @@ bool GenerateCMS(const string &strSignerCertData, const string &strSignerPKeyDat
 		return CMSError();
 	}
 
-	return ::_GenerateCMS(scert.get(), spkey.get(), strCDHashData, strCDHashesPlist, "", "", strCMSOutput);
+	return ::_GenerateCMS(scert.get(), spkey.get(), strCDHashData, strCDHashesPlist, "", "", 0, strCMSOutput);
 }
 
 Optional<string> GenerateCMSOptional(const string &strSignerCertData, const string &strSignerPKeyData, const string &strCDHashData, const string &strCDHashPlist)
@@ -692,6 +703,44 @@ arksigningAsset::arksigningAsset()
 {
 	m_evpPKey = NULL;
 	m_x509Cert = NULL;
+	m_tSigningTime = 0;
+}
+
+void arksigningAsset::SetSigningTime(time_t tSigningTime)
+{
+	m_tSigningTime = tSigningTime;
+}
+
+string arksigningAsset::GetFingerprint() const
+{
+	string strCertData;
+	if (NULL != m_x509Cert)
+	{
+		unsigned char *pDER = NULL;
+		int nLength = i2d_X509((X509 *)m_x509Cert, &pDER);
+		if (nLength > 0)
+		{
+			strCertData.assign((const char *)pDER, nLength);
+			OPENSSL_free(pDER);
+		}
+	}
+
+	string strFingerprint;
+	char szSigningTime[32] = {0};
+	snprintf(szSigningTime, sizeof(szSigningTime), "\n%lld\n", (long long)m_tSigningTime);
+	SHA1Text(strCertData + "\n" + m_strTeamId + szSigningTime + m_strProvisionData + "\n" + m_strEntitlementsData, strFingerprint);
+	return strFingerprint;
+}
+
+time_t arksigningAsset::GetCertNotBefore() const
+{
+	struct tm tmTime;
+	memset(&tmTime, 0, sizeof(tmTime));
+	if (NULL == m_x509Cert || 1 != ASN1_TIME_to_tm(X509_get0_notBefore((X509 *)m_x509Cert), &tmTime))
+	{
+		return 0;
+	}
+	return timegm(&tmTime);
 }
 
 bool arksigningAsset::Init(const string &strSignerCertFile, const string &strSignerPKeyFile, const string &strProvisionFile, const string &strEntitlementsFile, const string &strPassword)
@@ -711,6 +760,7 @@ bool arksigningAsset::Init(const string &strSignerCertFile, const string &strSig
 		if (jvProv.readPList(strProvContent))
 		{
 			m_strTeamId = jvProv["TeamIdentifier"][0].asCString();
+			m_strProfileName = jvProv["Name"].asString();
 			if (m_strEntitlementsData.empty())
 			{
 				jvProv["Entitlements"].writePList(m_strEntitlementsData);
@@ -824,5 +874,5 @@ bool arksigningAsset::Init(const string &strSignerCertFile, const string &strSig
 
 bool arksigningAsset::GenerateCMS(const string &strCDHashData, const string &strCDHashesPlist, const string &strCodeDirectorySlotSHA1, const string &strAltnateCodeDirectorySlot256, string &strCMSOutput)
 {
-	return ::_GenerateCMS((X509 *)m_x509Cert, (EVP_PKEY *)m_evpPKey, strCDHashData, strCDHashesPlist, strCodeDirectorySlotSHA1, strAltnateCodeDirectorySlot256, strCMSOutput);
+	return ::_GenerateCMS((X509 *)m_x509Cert, (EVP_PKEY *)m_evpPKey, strCDHashData, strCDHashesPlist, strCodeDirectorySlotSHA1, strAltnateCodeDirectorySlot256, m_tSigningTime, strCMSOutput);
 }
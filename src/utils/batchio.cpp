@@ -0,0 +1,505 @@
+#include "utils/batchio.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+#define ZBATCH_HAVE_URING 1
+#endif
+#endif
+#endif
+
+// Files per submission, and the read buffer each of them gets
+#define ZBATCH_ENTRIES 64
+#define ZBATCH_SLOT_SIZE (64 * 1024)
+// Waits for the operations of a failed batch before giving up on them
+#define ZBATCH_DRAIN_TRIES 16
+
+atomic<bool> ZBatchIO::s_bUringEnabled(true);
+
+// Hand a file to the sink once its first sRead bytes are in pBuffer. A read can
+// come back short (NFS, FUSE), so the file's size decides: a small file is
+// finished in its slot, one longer than the slot is mapped and passed in one piece.
+static void _BatchDeliver(int fd, size_t uIndex, uint8_t *pBuffer, size_t sRead, const ZBatchIO::ReadSink &sink)
+{
+	struct stat st;
+	if (0 != fstat(fd, &st))
+	{
+		sink(uIndex, NULL, 0, errno);
+		return;
+	}
+	if ((uint64_t)st.st_size <= sRead)
+	{
+		sink(uIndex, pBuffer, sRead, 0);
+		return;
+	}
+
+	if (st.st_size <= ZBATCH_SLOT_SIZE)
+	{
+		while (sRead < (size_t)st.st_size)
+		{
+			ssize_t nRead = pread(fd, pBuffer + sRead, (size_t)st.st_size - sRead, (off_t)sRead);
+			if (nRead < 0 && EINTR == errno)
+			{
+				continue;
+			}
+			if (nRead < 0)
+			{
+				sink(uIndex, NULL, 0, errno);
+				return;
+			}
+			if (0 == nRead)
+			{
+				break;
+			}
+			sRead += nRead;
+		}
+		sink(uIndex, pBuffer, sRead, 0);
+		return;
+	}
+
+	size_t sSize = (size_t)st.st_size;
+	void *pBase = mmap(NULL, sSize, PROT_READ, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == pBase)
+	{
+		sink(uIndex, NULL, 0, errno);
+		return;
+	}
+	sink(uIndex, (const uint8_t *)pBase, sSize, 0);
+	munmap(pBase, sSize);
+}
+
+static void _BatchReadFile(const string &strPath, size_t uIndex, uint8_t *pBuffer, const ZBatchIO::ReadSink &sink)
+{
+	int fd = open(strPath.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		sink(uIndex, NULL, 0, errno);
+		return;
+	}
+
+	size_t sRead = 0;
+	while (sRead < ZBATCH_SLOT_SIZE)
+	{
+		ssize_t nRead = read(fd, pBuffer + sRead, ZBATCH_SLOT_SIZE - sRead);
+		if (nRead < 0 && EINTR == errno)
+		{
+			continue;
+		}
+		if (nRead < 0)
+		{
+			sink(uIndex, NULL, 0, errno);
+			close(fd);
+			return;
+		}
+		if (0 == nRead)
+		{
+			break;
+		}
+		sRead += nRead;
+	}
+	_BatchDeliver(fd, uIndex, pBuffer, sRead, sink);
+	close(fd);
+}
+
+#ifdef ZBATCH_HAVE_URING
+
+// The mapped submission and completion queues of one io_uring
+struct ZURing
+{
+	int fd;
+	unsigned *pSQTail;
+	unsigned *pSQMask;
+	unsigned *pSQArray;
+	unsigned *pCQHead;
+	unsigned *pCQTail;
+	unsigned *pCQMask;
+	io_uring_sqe *pSQEs;
+	io_uring_cqe *pCQEs;
+	void *pSQRing;
+	void *pCQRing;
+	size_t sSQRingSize;
+	size_t sCQRingSize;
+	size_t sSQEsSize;
+	unsigned uQueued;
+};
+
+static void _URingFree(ZURing *pRing)
+{
+	if (NULL != pRing->pSQEs)
+	{
+		munmap(pRing->pSQEs, pRing->sSQEsSize);
+	}
+	if (NULL != pRing->pCQRing && pRing->pCQRing != pRing->pSQRing)
+	{
+		munmap(pRing->pCQRing, pRing->sCQRingSize);
+	}
+	if (NULL != pRing->pSQRing)
+	{
+		munmap(pRing->pSQRing, pRing->sSQRingSize);
+	}
+	if (pRing->fd >= 0)
+	{
+		close(pRing->fd);
+	}
+	delete pRing;
+}
+
+// Every opcode a batch uses must be there, io_uring grew them over several kernel releases
+static bool _URingProbe(int fd)
+{
+	vector<uint8_t> arrProbe(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+	io_uring_probe *pProbe = (io_uring_probe *)&arrProbe[0];
+	if (0 != syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, pProbe, 256))
+	{
+		return false;
+	}
+
+	const uint8_t arrOps[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE};
+	for (uint8_t uOp : arrOps)
+	{
+		if (uOp > pProbe->last_op || 0 == (pProbe->ops[uOp].flags & IO_URING_OP_SUPPORTED))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static ZURing *_URingCreate()
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = (int)syscall(__NR_io_uring_setup, ZBATCH_ENTRIES, &params);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+
+	ZURing *pRing = new ZURing;
+	memset(pRing, 0, sizeof(ZURing));
+	pRing->fd = fd;
+	if (!_URingProbe(fd))
+	{
+		_URingFree(pRing);
+		return NULL;
+	}
+
+	pRing->sSQRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	pRing->sCQRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		pRing->sSQRingSize = pRing->sCQRingSize = max(pRing->sSQRingSize, pRing->sCQRingSize);
+	}
+
+	void *pSQRing = mmap(NULL, pRing->sSQRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (MAP_FAILED == pSQRing)
+	{
+		_URingFree(pRing);
+		return NULL;
+	}
+	pRing->pSQRing = pSQRing;
+
+	void *pCQRing = pSQRing;
+	if (0 == (params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		pCQRing = mmap(NULL, pRing->sCQRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (MAP_FAILED == pCQRing)
+		{
+			_URingFree(pRing);
+			return NULL;
+		}
+	}
+	pRing->pCQRing = pCQRing;
+
+	pRing->sSQEsSize = params.sq_entries * sizeof(io_uring_sqe);
+	void *pSQEs = mmap(NULL, pRing->sSQEsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (MAP_FAILED == pSQEs)
+	{
+		_URingFree(pRing);
+		return NULL;
+	}
+	pRing->pSQEs = (io_uring_sqe *)pSQEs;
+
+	uint8_t *pSQ = (uint8_t *)pSQRing;
+	uint8_t *pCQ = (uint8_t *)pCQRing;
+	pRing->pSQTail = (unsigned *)(pSQ + params.sq_off.tail);
+	pRing->pSQMask = (unsigned *)(pSQ + params.sq_off.ring_mask);
+	pRing->pSQArray = (unsigned *)(pSQ + params.sq_off.array);
+	pRing->pCQHead = (unsigned *)(pCQ + params.cq_off.head);
+	pRing->pCQTail = (unsigned *)(pCQ + params.cq_off.tail);
+	pRing->pCQMask = (unsigned *)(pCQ + params.cq_off.ring_mask);
+	pRing->pCQEs = (io_uring_cqe *)(pCQ + params.cq_off.cqes);
+	return pRing;
+}
+
+static io_uring_sqe *_URingQueue(ZURing *pRing, uint8_t uOpcode, int fd, const void *pAddr, uint32_t uLength, uint64_t uUserData)
+{
+	unsigned uTail = *pRing->pSQTail;
+	unsigned uIndex = uTail & *pRing->pSQMask;
+	io_uring_sqe *pSQE = &pRing->pSQEs[uIndex];
+	memset(pSQE, 0, sizeof(io_uring_sqe));
+	pSQE->opcode = uOpcode;
+	pSQE->fd = fd;
+	pSQE->addr = (uint64_t)(uintptr_t)pAddr;
+	pSQE->len = uLength;
+	pSQE->user_data = uUserData;
+	pRing->pSQArray[uIndex] = uIndex;
+	__atomic_store_n(pRing->pSQTail, uTail + 1, __ATOMIC_RELEASE);
+	pRing->uQueued++;
+	return pSQE;
+}
+
+// Move the completions that are there into arrResults[user_data], returns how many
+static unsigned _URingReap(ZURing *pRing, vector<int> &arrResults)
+{
+	unsigned uHead = *pRing->pCQHead;
+	unsigned uTail = __atomic_load_n(pRing->pCQTail, __ATOMIC_ACQUIRE);
+	unsigned uReaped = 0;
+	while (uHead != uTail)
+	{
+		const io_uring_cqe &cqe = pRing->pCQEs[uHead & *pRing->pCQMask];
+		if (cqe.user_data < arrResults.size())
+		{
+			arrResults[cqe.user_data] = cqe.res;
+		}
+		uHead++;
+		uReaped++;
+	}
+	__atomic_store_n(pRing->pCQHead, uHead, __ATOMIC_RELEASE);
+	return uReaped;
+}
+
+// Submit everything queued and wait for all of it, arrResults[user_data] gets each
+// result. On failure uInFlight is how many submitted operations haven't completed.
+static bool _URingWait(ZURing *pRing, vector<int> &arrResults, unsigned &uInFlight)
+{
+	unsigned uSubmit = pRing->uQueued;
+	unsigned uPending = pRing->uQueued;
+	pRing->uQueued = 0;
+	uInFlight = 0;
+	while (uPending > 0)
+	{
+		int nRet = (int)syscall(__NR_io_uring_enter, pRing->fd, uSubmit, uPending, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (nRet < 0)
+		{
+			if (EINTR == errno || EAGAIN == errno || EBUSY == errno)
+			{
+				continue;
+			}
+			uInFlight = uPending - uSubmit;
+			return false;
+		}
+		uSubmit -= min<unsigned>(uSubmit, nRet);
+		uPending -= min<unsigned>(uPending, _URingReap(pRing, arrResults));
+	}
+	return true;
+}
+
+// After a failed wait, collect what was still in flight so the kernel holds no
+// fd or buffer of ours. False if that didn't work either.
+static bool _URingDrain(ZURing *pRing, vector<int> &arrResults, unsigned uInFlight)
+{
+	for (int nTry = 0; uInFlight > 0 && nTry < ZBATCH_DRAIN_TRIES; nTry++)
+	{
+		int nRet = (int)syscall(__NR_io_uring_enter, pRing->fd, 0, uInFlight, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (nRet < 0 && EINTR != errno && EAGAIN != errno && EBUSY != errno)
+		{
+			return false;
+		}
+		uInFlight -= min<unsigned>(uInFlight, _URingReap(pRing, arrResults));
+	}
+	return (0 == uInFlight);
+}
+
+#endif
+
+ZBatchIO::ZBatchIO()
+{
+	m_pRing = NULL;
+}
+
+ZBatchIO::~ZBatchIO()
+{
+	FreeRing();
+}
+
+size_t ZBatchIO::GetMaxFileSize()
+{
+	return ZBATCH_SLOT_SIZE;
+}
+
+void ZBatchIO::SetUringEnabled(bool bEnable)
+{
+	s_bUringEnabled = bEnable;
+}
+
+bool ZBatchIO::IsUring() const
+{
+	return (NULL != m_pRing);
+}
+
+bool ZBatchIO::InitRing()
+{
+#ifdef ZBATCH_HAVE_URING
+	if (NULL == m_pRing && s_bUringEnabled)
+	{
+		m_pRing = _URingCreate();
+		if (NULL == m_pRing)
+		{
+			// Seccomp, io_uring_disabled or an old kernel, don't try again
+			ZLog::Debug(">>> io_uring unavailable, using plain file I/O\n");
+			s_bUringEnabled = false;
+		}
+	}
+#endif
+	return (NULL != m_pRing);
+}
+
+void ZBatchIO::FreeRing()
+{
+#ifdef ZBATCH_HAVE_URING
+	if (NULL != m_pRing)
+	{
+		_URingFree((ZURing *)m_pRing);
+		m_pRing = NULL;
+	}
+#endif
+}
+
+void ZBatchIO::AbandonRing(bool bDrained)
+{
+	if (!bDrained)
+	{
+		// Reads may still land in the buffer after the ring is gone, so it is never freed
+		vector<uint8_t> *pLost = new vector<uint8_t>();
+		pLost->swap(m_arrBuffer);
+		m_arrBuffer.resize((size_t)ZBATCH_ENTRIES * ZBATCH_SLOT_SIZE);
+	}
+	ZLog::Debug(">>> io_uring failed, using plain file I/O\n");
+	FreeRing();
+}
+
+void ZBatchIO::ReadFiles(const vector<string> &arrPaths, const ReadSink &sink)
+{
+	if (arrPaths.empty())
+	{
+		return;
+	}
+
+	m_arrBuffer.resize((size_t)ZBATCH_ENTRIES * ZBATCH_SLOT_SIZE);
+	size_t i = 0;
+	if (InitRing())
+	{
+		while (i < arrPaths.size() && NULL != m_pRing)
+		{
+			size_t uEnd = min<size_t>(i + ZBATCH_ENTRIES, arrPaths.size());
+			if (!ReadBatch(arrPaths, i, uEnd, sink))
+			{
+				// Nothing of this batch reached the sink, it is read again below
+				break;
+			}
+			i = uEnd;
+		}
+	}
+
+	for (; i < arrPaths.size(); i++)
+	{
+		_BatchReadFile(arrPaths[i], i, &m_arrBuffer[0], sink);
+	}
+}
+
+// Three submissions per batch: all opens, all reads, then all closes once the
+// sink has seen the data. A file that fills its slot is finished through its fd.
+// When the ring fails before the sink is called, the batch's fds are closed, the
+// ring is dropped and false is returned. A failure among the closes drops the
+// ring too, but the batch counts as read.
+bool ZBatchIO::ReadBatch(const vector<string> &arrPaths, size_t uBegin, size_t uEnd, const ReadSink &sink)
+{
+#ifdef ZBATCH_HAVE_URING
+	ZURing *pRing = (ZURing *)m_pRing;
+	size_t uCount = uEnd - uBegin;
+	vector<int> arrFds(uCount, -ECANCELED);
+	vector<int> arrReads(uCount, -ECANCELED);
+	unsigned uInFlight = 0;
+
+	for (size_t i = 0; i < uCount; i++)
+	{
+		io_uring_sqe *pSQE = _URingQueue(pRing, IORING_OP_OPENAT, AT_FDCWD, arrPaths[uBegin + i].c_str(), 0, i);
+		pSQE->open_flags = O_RDONLY | O_CLOEXEC;
+	}
+	if (!_URingWait(pRing, arrFds, uInFlight))
+	{
+		bool bDrained = _URingDrain(pRing, arrFds, uInFlight);
+		for (size_t i = 0; i < uCount; i++)
+		{
+			if (arrFds[i] >= 0)
+			{
+				close(arrFds[i]);
+			}
+		}
+		AbandonRing(bDrained);
+		return false;
+	}
+
+	for (size_t i = 0; i < uCount; i++)
+	{
+		if (arrFds[i] >= 0)
+		{
+			_URingQueue(pRing, IORING_OP_READ, arrFds[i], &m_arrBuffer[i * ZBATCH_SLOT_SIZE], ZBATCH_SLOT_SIZE, i);
+		}
+	}
+	if (!_URingWait(pRing, arrReads, uInFlight))
+	{
+		// A read still in flight holds its own reference to the file, closing is safe
+		bool bDrained = _URingDrain(pRing, arrReads, uInFlight);
+		for (size_t i = 0; i < uCount; i++)
+		{
+			if (arrFds[i] >= 0)
+			{
+				close(arrFds[i]);
+			}
+		}
+		AbandonRing(bDrained);
+		return false;
+	}
+
+	for (size_t i = 0; i < uCount; i++)
+	{
+		if (arrFds[i] < 0)
+		{
+			sink(uBegin + i, NULL, 0, -arrFds[i]);
+		}
+		else if (arrReads[i] < 0)
+		{
+			sink(uBegin + i, NULL, 0, -arrReads[i]);
+		}
+		else
+		{
+			_BatchDeliver(arrFds[i], uBegin + i, &m_arrBuffer[i * ZBATCH_SLOT_SIZE], arrReads[i], sink);
+		}
+	}
+
+	vector<int> arrCloses(uCount, 0);
+	for (size_t i = 0; i < uCount; i++)
+	{
+		if (arrFds[i] >= 0)
+		{
+			_URingQueue(pRing, IORING_OP_CLOSE, arrFds[i], NULL, 0, i);
+		}
+	}
+	if (!_URingWait(pRing, arrCloses, uInFlight))
+	{
+		// Closing again could hit an fd number reused meanwhile, an undrained close leaks instead
+		AbandonRing(_URingDrain(pRing, arrCloses, uInFlight));
+	}
+	return true;
+#else
+	(void)arrPaths;
+	(void)uBegin;
+	(void)uEnd;
+	(void)sink;
+	return false;
+#endif
+}
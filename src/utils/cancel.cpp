@@ -0,0 +1,153 @@
+#include "utils/cancel.h"
+#include <chrono>
+
+// CPU time is read every this many polls, the clock is a system call
+#define CANCEL_CPU_POLLS 32
+
+struct ZCancelThreadState
+{
+	ZCancelToken *pToken;
+	uint64_t uCPUTime;
+	uint32_t uPolls;
+};
+
+static thread_local ZCancelThreadState s_state = {NULL, 0, 0};
+
+static uint64_t _ThreadCPUTime()
+{
+	struct timespec ts;
+	if (0 != clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+	{
+		return 0;
+	}
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t _SteadyMicroSecond()
+{
+	return (uint64_t)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Charge what the thread used since the last reading to its token
+static void _FlushCPUTime(ZCancelToken *pToken)
+{
+	uint64_t uNow = _ThreadCPUTime();
+	if (NULL != pToken && uNow > s_state.uCPUTime)
+	{
+		pToken->AddCPUTime(uNow - s_state.uCPUTime);
+	}
+	s_state.uCPUTime = uNow;
+	s_state.uPolls = 0;
+}
+
+ZCancelToken::ZCancelToken()
+	: m_bCancelled(false), m_uCPUTime(0), m_uWallUsed(0), m_uRunningSince(0)
+{
+	m_uWallLimit = 0;
+	m_uCPULimit = 0;
+}
+
+void ZCancelToken::Start(uint64_t uWallLimit, uint64_t uCPULimit)
+{
+	m_uWallLimit = uWallLimit;
+	m_uWallUsed = 0;
+	m_uRunningSince = _SteadyMicroSecond();
+	m_uCPULimit = uCPULimit;
+	m_uCPUTime = 0;
+}
+
+void ZCancelToken::Pause()
+{
+	uint64_t uSince = m_uRunningSince.exchange(0);
+	if (uSince > 0)
+	{
+		m_uWallUsed += _SteadyMicroSecond() - uSince;
+	}
+}
+
+void ZCancelToken::Resume()
+{
+	uint64_t uNotRunning = 0;
+	m_uRunningSince.compare_exchange_strong(uNotRunning, _SteadyMicroSecond());
+}
+
+void ZCancelToken::Cancel(const string &strReason)
+{
+	lock_guard<mutex> lock(m_mutex);
+	if (!m_bCancelled)
+	{
+		m_strReason = strReason;
+		m_bCancelled = true;
+	}
+}
+
+bool ZCancelToken::IsCancelled()
+{
+	if (m_bCancelled)
+	{
+		return true;
+	}
+	uint64_t uWallTime = m_uWallUsed;
+	uint64_t uSince = m_uRunningSince;
+	if (uSince > 0)
+	{
+		uWallTime += _SteadyMicroSecond() - uSince;
+	}
+	if (m_uWallLimit > 0 && uWallTime > m_uWallLimit)
+	{
+		Cancel("wall-clock limit exceeded");
+	}
+	else if (m_uCPULimit > 0 && m_uCPUTime > m_uCPULimit)
+	{
+		Cancel("CPU limit exceeded");
+	}
+	return m_bCancelled;
+}
+
+string ZCancelToken::GetReason()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_strReason;
+}
+
+uint64_t ZCancelToken::GetCPUTime() const
+{
+	return m_uCPUTime;
+}
+
+void ZCancelToken::AddCPUTime(uint64_t uCPUTime)
+{
+	m_uCPUTime += uCPUTime;
+}
+
+ZCancelToken *ZCancelToken::GetCurrent()
+{
+	return s_state.pToken;
+}
+
+bool ZCancelToken::IsCurrentCancelled()
+{
+	ZCancelToken *pToken = s_state.pToken;
+	if (NULL == pToken)
+	{
+		return false;
+	}
+	if (++s_state.uPolls >= CANCEL_CPU_POLLS)
+	{
+		_FlushCPUTime(pToken);
+	}
+	return pToken->IsCancelled();
+}
+
+ZCancelScope::ZCancelScope(ZCancelToken *pToken)
+{
+	m_pPrevious = s_state.pToken;
+	_FlushCPUTime(m_pPrevious);
+	s_state.pToken = pToken;
+}
+
+ZCancelScope::~ZCancelScope()
+{
+	_FlushCPUTime(s_state.pToken);
+	s_state.pToken = m_pPrevious;
+}
@@ -4,6 +4,7 @@
 #include <sys/stat.h>
 #include <inttypes.h>
 #include <openssl/sha.h>
+#include <openssl/evp.h>
 #include <functional>
 #include <thread>
 #include <atomic>
@@ -31,8 +32,7 @@
 bool IsRegularFile(const char *file)
 {
 	struct stat info;
-	stat(file, &info);
-	return S_ISREG(info.st_mode);
+	return (0 == stat(file, &info) && S_ISREG(info.st_mode));
 }
 
 void *MapFile(const char *path, size_t offset, size_t size, size_t *psize, bool ro)
@@ -66,6 +66,29 @@ void *MapFile(const char *path, size_t offset, size_t size, size_t *psize, bool
 	return base;
 }
 
+bool AdviseWillNeed(const char *szFile, uint64_t uLength)
+{
+	int fd = open(szFile, O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	bool bRet = false;
+#if defined(__APPLE__)
+	struct radvisory ra;
+	ra.ra_offset = 0;
+	ra.ra_count = (int)min<uint64_t>(uLength, INT_MAX);
+	bRet = (-1 != fcntl(fd, F_RDADVISE, &ra));
+#elif defined(POSIX_FADV_WILLNEED)
+	bRet = (0 == posix_fadvise(fd, 0, (off_t)uLength, POSIX_FADV_WILLNEED));
+#else
+	(void)uLength;
+#endif
+	close(fd);
+	return bRet;
+}
+
 bool WriteFile(const char *szFile, const char *szData, size_t sLen)
 {
 	if (NULL == szFile)
@@ -100,6 +123,29 @@ bool WriteFile(const char *szFile, const char *szData, size_t sLen)
 	return false;
 }
 
+bool CopyFileContent(const char *szSrcFile, const char *szDstFile)
+{
+	struct stat st;
+	if (0 != stat(szSrcFile, &st) || !S_ISREG(st.st_mode))
+	{
+		return false;
+	}
+	if (0 == st.st_size)
+	{
+		return WriteFile(szDstFile, string());
+	}
+
+	size_t sSize = 0;
+	char *pBase = (char *)MapFile(szSrcFile, 0, 0, &sSize, true);
+	if (NULL == pBase)
+	{
+		return false;
+	}
+	bool bRet = WriteFile(szDstFile, pBase, sSize);
+	munmap(pBase, sSize);
+	return bRet;
+}
+
 bool WriteFile(const char *szFile, const string &strData)
 {
 	return WriteFile(szFile, strData.data(), strData.size());
@@ -205,8 +251,7 @@ bool AppendFile(const char *szFile, const string &strData)
 bool IsFolder(const char *szFolder)
 {
 	struct stat st;
-	stat(szFolder, &st);
-	return S_ISDIR(st.st_mode);
+	return (0 == stat(szFolder, &st) && S_ISDIR(st.st_mode));
 }
 
 bool IsFolderV(const char *szFormatPath, ...)
@@ -234,6 +279,15 @@ bool CreateFolderV(const char *szFormatPath, ...)
 	return CreateFolder(szFolder);
 }
 
+void CreateFolderTree(const string &strFolder)
+{
+	for (size_t pos = strFolder.find('/', 1); string::npos != pos; pos = strFolder.find('/', pos + 1))
+	{
+		CreateFolder(strFolder.substr(0, pos).c_str());
+	}
+	CreateFolder(strFolder.c_str());
+}
+
 int RemoveFolderCallBack(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
 {
 	// Suppress unused parameter warnings - parameters required by nftw() API
@@ -449,6 +503,40 @@ int64_t GetFileSizeV(const char *szFormatPath, ...)
 	return GetFileSize(szFile);
 }
 
+int64_t GetFolderSize(const char *szFolder)
+{
+	int64_t nSize = 0;
+	DIR *dir = opendir(szFolder);
+	if (NULL == dir)
+	{
+		return 0;
+	}
+
+	dirent *ptr = readdir(dir);
+	while (NULL != ptr)
+	{
+		if (0 != strcmp(ptr->d_name, ".") && 0 != strcmp(ptr->d_name, ".."))
+		{
+			string strPath = string(szFolder) + "/" + ptr->d_name;
+			struct stat st;
+			if (0 == lstat(strPath.c_str(), &st))
+			{
+				if (S_ISDIR(st.st_mode))
+				{
+					nSize += GetFolderSize(strPath.c_str());
+				}
+				else if (S_ISREG(st.st_mode))
+				{
+					nSize += st.st_size;
+				}
+			}
+		}
+		ptr = readdir(dir);
+	}
+	closedir(dir);
+	return nSize;
+}
+
 string GetFileSizeString(const char *szFile)
 {
 	return FormatSize(GetFileSize(szFile), 1024);
@@ -485,6 +573,53 @@ string FormatSize(int64_t size, int64_t base)
 	return ret;
 }
 
+bool ParseSize(const char *szSize, uint64_t &uSize, uint64_t base)
+{
+	// Plain decimals only, strtod alone would also take "inf", "0x10", "1e3", blanks and a sign
+	size_t sDigits = strspn(szSize, "0123456789.");
+	char *szUnit = NULL;
+	double fsize = strtod(szSize, &szUnit);
+	if (0 == sDigits || szUnit != szSize + sDigits)
+	{
+		return false;
+	}
+
+	if ('\0' != *szUnit)
+	{
+		const char *szUnits = "KMGT";
+		const char *pUnit = strchr(szUnits, toupper(*szUnit));
+		if (NULL == pUnit)
+		{
+			return false;
+		}
+		for (int i = 0; i <= pUnit - szUnits; i++)
+		{
+			fsize *= base;
+		}
+		szUnit++;
+		// "2G", "2GB" and "2GiB" all mean the same
+		if ('i' == *szUnit && 'B' == toupper(szUnit[1]))
+		{
+			szUnit++;
+		}
+		if ('B' == toupper(*szUnit))
+		{
+			szUnit++;
+		}
+		if ('\0' != *szUnit)
+		{
+			return false;
+		}
+	}
+
+	if (fsize >= 18446744073709551616.0)
+	{
+		return false;
+	}
+	uSize = (uint64_t)fsize;
+	return true;
+}
+
 bool IsPathSuffix(const string &strPath, const char *suffix)
 {
 	size_t nPos = strPath.rfind(suffix);
@@ -728,6 +863,46 @@ bool SHASumBase64File(const char *szFile, string &strSHA1Base64, string &strSHA2
 	return (!strSHA1Base64.empty() && !strSHA256Base64.empty());
 }
 
+ZSHASum::ZSHASum()
+{
+	m_pSHA1Ctx = EVP_MD_CTX_new();
+	m_pSHA256Ctx = EVP_MD_CTX_new();
+	EVP_DigestInit_ex((EVP_MD_CTX *)m_pSHA1Ctx, EVP_sha1(), NULL);
+	EVP_DigestInit_ex((EVP_MD_CTX *)m_pSHA256Ctx, EVP_sha256(), NULL);
+}
+
+ZSHASum::~ZSHASum()
+{
+	EVP_MD_CTX_free((EVP_MD_CTX *)m_pSHA1Ctx);
+	EVP_MD_CTX_free((EVP_MD_CTX *)m_pSHA256Ctx);
+}
+
+void ZSHASum::Update(const uint8_t *pData, size_t sLength)
+{
+	EVP_DigestUpdate((EVP_MD_CTX *)m_pSHA1Ctx, pData, sLength);
+	EVP_DigestUpdate((EVP_MD_CTX *)m_pSHA256Ctx, pData, sLength);
+}
+
+void ZSHASum::Final(string &strSHA1, string &strSHA256)
+{
+	uint8_t hash1[20];
+	uint8_t hash256[32];
+	EVP_DigestFinal_ex((EVP_MD_CTX *)m_pSHA1Ctx, hash1, NULL);
+	EVP_DigestFinal_ex((EVP_MD_CTX *)m_pSHA256Ctx, hash256, NULL);
+	strSHA1.assign((const char *)hash1, 20);
+	strSHA256.assign((const char *)hash256, 32);
+}
+
+void ZSHASum::FinalBase64(ZFileDigest &digest)
+{
+	ZBase64 b64;
+	string strSHA1;
+	string strSHA256;
+	Final(strSHA1, strSHA256);
+	digest.strSHA1Base64 = b64.Encode(strSHA1);
+	digest.strSHA256Base64 = b64.Encode(strSHA256);
+}
+
 ZBuffer::ZBuffer()
 {
 	m_pData = nullptr;
@@ -0,0 +1,158 @@
+#include "utils/filecache.h"
+#include <dirent.h>
+#include <algorithm>
+#include <thread>
+
+#define FILE_CACHE_SUFFIX ".cache"
+
+mutex ZFileCache::s_mutex;
+string ZFileCache::s_strFolder;
+uint64_t ZFileCache::s_uBudget = 0;
+uint64_t ZFileCache::s_uUsed = 0;
+map<string, ZFileCache::Entry> ZFileCache::s_mapEntries;
+
+bool ZFileCache::SetFolder(const string &strFolder, uint64_t uBudget)
+{
+	CreateFolderTree(strFolder);
+	DIR *dir = opendir(strFolder.c_str());
+	if (NULL == dir)
+	{
+		ZLog::ErrorV(">>> Invalid Cache Folder! %s\n", strFolder.c_str());
+		return false;
+	}
+
+	lock_guard<mutex> lock(s_mutex);
+	s_mapEntries.clear();
+	s_uUsed = 0;
+	dirent *ptr = NULL;
+	while (NULL != (ptr = readdir(dir)))
+	{
+		string strName = ptr->d_name;
+		struct stat st;
+		if (!IsPathSuffix(strName, FILE_CACHE_SUFFIX) || 0 != stat((strFolder + "/" + strName).c_str(), &st) || !S_ISREG(st.st_mode))
+		{
+			continue;
+		}
+		Entry &entry = s_mapEntries[strName.substr(0, strName.size() - strlen(FILE_CACHE_SUFFIX))];
+		entry.uSize = (uint64_t)st.st_size;
+		entry.tUsed = st.st_mtime;
+		s_uUsed += entry.uSize;
+	}
+	closedir(dir);
+
+	s_strFolder = strFolder;
+	s_uBudget = uBudget;
+	Trim();
+	ZLog::PrintV(">>> Cache:\t%s (%zu entries, %s of %s)\n", strFolder.c_str(), s_mapEntries.size(),
+				 FormatSize(s_uUsed).c_str(), FormatSize(s_uBudget).c_str());
+	return true;
+}
+
+bool ZFileCache::IsEnabled()
+{
+	return !s_strFolder.empty();
+}
+
+string ZFileCache::GetEntryPath(const string &strKey)
+{
+	return s_strFolder + "/" + strKey + FILE_CACHE_SUFFIX;
+}
+
+// A name no other thread or process writes to at the same time
+static string _GetTempPath(const string &strFile)
+{
+	string strTemp;
+	StringFormat(strTemp, "%s.%d.%zu.tmp", strFile.c_str(), (int)getpid(), hash<thread::id>()(this_thread::get_id()));
+	return strTemp;
+}
+
+bool ZFileCache::Load(const string &strKey, const string &strFile)
+{
+	if (!IsEnabled())
+	{
+		return false;
+	}
+
+	// Another process may have added the entry since the folder was listed
+	string strEntry = GetEntryPath(strKey);
+	struct stat st;
+	if (0 != stat(strEntry.c_str(), &st))
+	{
+		return false;
+	}
+
+	// The entry keeps the mode signing left on the file, which need not be the extracted one
+	string strTemp = _GetTempPath(strFile);
+	if (!CopyFileContent(strEntry.c_str(), strTemp.c_str()) ||
+		0 != chmod(strTemp.c_str(), st.st_mode & 07777) ||
+		0 != rename(strTemp.c_str(), strFile.c_str()))
+	{
+		unlink(strTemp.c_str());
+		return false;
+	}
+
+	// Used just now, so it is evicted last
+	utimes(strEntry.c_str(), NULL);
+	lock_guard<mutex> lock(s_mutex);
+	Entry &entry = s_mapEntries[strKey];
+	if (0 == entry.uSize)
+	{
+		s_uUsed += (uint64_t)st.st_size;
+	}
+	entry.uSize = (uint64_t)st.st_size;
+	entry.tUsed = time(NULL);
+	return true;
+}
+
+void ZFileCache::Store(const string &strKey, const string &strFile)
+{
+	if (!IsEnabled())
+	{
+		return;
+	}
+
+	struct stat st;
+	if (0 != stat(strFile.c_str(), &st) || (uint64_t)st.st_size > s_uBudget)
+	{
+		return;
+	}
+	uint64_t uSize = (uint64_t)st.st_size;
+
+	string strEntry = GetEntryPath(strKey);
+	string strTemp = _GetTempPath(strEntry);
+	if (!CopyFileContent(strFile.c_str(), strTemp.c_str()) ||
+		0 != chmod(strTemp.c_str(), st.st_mode & 07777) ||
+		0 != rename(strTemp.c_str(), strEntry.c_str()))
+	{
+		unlink(strTemp.c_str());
+		return;
+	}
+
+	lock_guard<mutex> lock(s_mutex);
+	Entry &entry = s_mapEntries[strKey];
+	s_uUsed = s_uUsed - entry.uSize + uSize;
+	entry.uSize = uSize;
+	entry.tUsed = time(NULL);
+	Trim();
+}
+
+void ZFileCache::Trim()
+{
+	if (s_uUsed <= s_uBudget)
+	{
+		return;
+	}
+
+	vector<pair<time_t, string>> arrEntries;
+	for (const auto &entry : s_mapEntries)
+	{
+		arrEntries.push_back(make_pair(entry.second.tUsed, entry.first));
+	}
+	sort(arrEntries.begin(), arrEntries.end());
+	for (size_t i = 0; i < arrEntries.size() && s_uUsed > s_uBudget; i++)
+	{
+		unlink(GetEntryPath(arrEntries[i].second).c_str());
+		s_uUsed -= s_mapEntries[arrEntries[i].second].uSize;
+		s_mapEntries.erase(arrEntries[i].second);
+	}
+}
@@ -0,0 +1,109 @@
+#include "utils/timing.h"
+
+static thread_local ZJobTiming *s_pCurrentTiming = NULL;
+
+static const char *s_arrPhaseNames[ZJobTiming::E_PHASE_COUNT] = {
+	"extract", "scan", "code_resources", "macho_hash", "cms", "archive"};
+
+static const char *s_arrCounterNames[ZJobTiming::E_COUNT_COUNT] = {
+	"files_sealed", "files_hashed", "macho_bytes_hashed"};
+
+ZJobTiming::ZJobTiming()
+{
+	for (int i = 0; i < E_PHASE_COUNT; i++)
+	{
+		m_arrTimes[i] = 0;
+	}
+	for (int i = 0; i < E_COUNT_COUNT; i++)
+	{
+		m_arrCounts[i] = 0;
+	}
+}
+
+void ZJobTiming::AddTime(ePhase ePhase, uint64_t uMicros)
+{
+	m_arrTimes[ePhase] += uMicros;
+}
+
+void ZJobTiming::AddCount(eCounter eCounter, uint64_t uCount)
+{
+	m_arrCounts[eCounter] += uCount;
+}
+
+uint64_t ZJobTiming::GetTime(ePhase ePhase) const
+{
+	return m_arrTimes[ePhase];
+}
+
+uint64_t ZJobTiming::GetCount(eCounter eCounter) const
+{
+	return m_arrCounts[eCounter];
+}
+
+void ZJobTiming::Write(JValue &jvTiming) const
+{
+	JValue &jvPhases = jvTiming["phases_ms"];
+	jvPhases = JValue(JValue::E_OBJECT);
+	for (int i = 0; i < E_PHASE_COUNT; i++)
+	{
+		jvPhases[s_arrPhaseNames[i]] = m_arrTimes[i] / 1000.0;
+	}
+	for (int i = 0; i < E_COUNT_COUNT; i++)
+	{
+		jvTiming[s_arrCounterNames[i]] = (int64_t)m_arrCounts[i];
+	}
+}
+
+void ZJobTiming::AddTo(const JValue &jvTiming, JValue &jvTotals)
+{
+	JValue &jvPhases = jvTotals["phases_ms"];
+	for (int i = 0; i < E_PHASE_COUNT; i++)
+	{
+		const char *szName = s_arrPhaseNames[i];
+		jvPhases[szName] = jvPhases[szName].asFloat() + jvTiming["phases_ms"][szName].asFloat();
+	}
+	for (int i = 0; i < E_COUNT_COUNT; i++)
+	{
+		const char *szName = s_arrCounterNames[i];
+		jvTotals[szName] = jvTotals[szName].asInt64() + jvTiming[szName].asInt64();
+	}
+}
+
+ZJobTiming *ZJobTiming::GetCurrent()
+{
+	return s_pCurrentTiming;
+}
+
+void ZJobTiming::AddCurrentCount(eCounter eCounter, uint64_t uCount)
+{
+	if (NULL != s_pCurrentTiming)
+	{
+		s_pCurrentTiming->AddCount(eCounter, uCount);
+	}
+}
+
+ZTimingScope::ZTimingScope(ZJobTiming *pTiming)
+{
+	m_pPrevious = s_pCurrentTiming;
+	s_pCurrentTiming = pTiming;
+}
+
+ZTimingScope::~ZTimingScope()
+{
+	s_pCurrentTiming = m_pPrevious;
+}
+
+ZPhaseTimer::ZPhaseTimer(ZJobTiming::ePhase ePhase)
+{
+	m_pTiming = s_pCurrentTiming;
+	m_ePhase = ePhase;
+	m_uBeginTime = (NULL != m_pTiming) ? GetMicroSecond() : 0;
+}
+
+ZPhaseTimer::~ZPhaseTimer()
+{
+	if (NULL != m_pTiming)
+	{
+		m_pTiming->AddTime(m_ePhase, GetMicroSecond() - m_uBeginTime);
+	}
+}
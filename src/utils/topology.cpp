@@ -0,0 +1,168 @@
+#include "utils/topology.h"
+#include <algorithm>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#if defined(__has_include)
+#if __has_include(<linux/mempolicy.h>)
+#include <linux/mempolicy.h>
+#endif
+#endif
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#endif
+
+#define SYSFS_NODE_FOLDER "/sys/devices/system/node"
+
+// "0-3,8,10-11" as used by cpulist files
+static bool _ParseCpuList(const string &strList, vector<int> &arrCpus)
+{
+	size_t sBegin = 0;
+	while (sBegin < strList.size())
+	{
+		size_t sEnd = strList.find(',', sBegin);
+		if (string::npos == sEnd)
+		{
+			sEnd = strList.size();
+		}
+		string strRange = strList.substr(sBegin, sEnd - sBegin);
+		sBegin = sEnd + 1;
+		if (strRange.empty())
+		{
+			continue;
+		}
+
+		int nFirst = 0;
+		int nLast = 0;
+		int nFields = sscanf(strRange.c_str(), "%d-%d", &nFirst, &nLast);
+		if (nFields < 1 || nFirst < 0)
+		{
+			return false;
+		}
+		if (1 == nFields)
+		{
+			nLast = nFirst;
+		}
+		for (int nCpu = nFirst; nCpu <= nLast; nCpu++)
+		{
+			arrCpus.push_back(nCpu);
+		}
+	}
+	return true;
+}
+
+bool ZCpuTopology::Load()
+{
+	m_arrNodes.clear();
+
+#ifdef __linux__
+	cpu_set_t setAllowed;
+	CPU_ZERO(&setAllowed);
+	bool bAllowed = (0 == sched_getaffinity(0, sizeof(setAllowed), &setAllowed));
+
+	DIR *dir = opendir(SYSFS_NODE_FOLDER);
+	if (NULL != dir)
+	{
+		dirent *ptr = readdir(dir);
+		while (NULL != ptr)
+		{
+			int nId = -1;
+			char cEnd = 0;
+			if (1 == sscanf(ptr->d_name, "node%d%c", &nId, &cEnd) && nId >= 0)
+			{
+				string strList;
+				vector<int> arrCpus;
+				if (ReadFile(strList, "%s/%s/cpulist", SYSFS_NODE_FOLDER, ptr->d_name) &&
+					_ParseCpuList(strList.substr(0, strList.find_last_not_of(" \n") + 1), arrCpus))
+				{
+					// Cores outside the process's cpuset (taskset, containers) are left out
+					Node node;
+					node.nId = nId;
+					for (int nCpu : arrCpus)
+					{
+						if (!bAllowed || (nCpu < CPU_SETSIZE && CPU_ISSET(nCpu, &setAllowed)))
+						{
+							node.arrCpus.push_back(nCpu);
+						}
+					}
+					if (!node.arrCpus.empty())
+					{
+						m_arrNodes.push_back(node);
+					}
+				}
+			}
+			ptr = readdir(dir);
+		}
+		closedir(dir);
+	}
+	sort(m_arrNodes.begin(), m_arrNodes.end(), [](const Node &a, const Node &b) { return a.nId < b.nId; });
+#endif
+
+	if (m_arrNodes.empty())
+	{
+		Node node;
+		node.nId = 0;
+		int nCpus = max(1, (int)thread::hardware_concurrency());
+		for (int nCpu = 0; nCpu < nCpus; nCpu++)
+		{
+			node.arrCpus.push_back(nCpu);
+		}
+		m_arrNodes.push_back(node);
+		return false;
+	}
+	return true;
+}
+
+size_t ZCpuTopology::GetNodeCount() const
+{
+	return m_arrNodes.size();
+}
+
+int ZCpuTopology::GetNodeId(size_t uNode) const
+{
+	return m_arrNodes[uNode].nId;
+}
+
+const vector<int> &ZCpuTopology::GetNodeCpus(size_t uNode) const
+{
+	return m_arrNodes[uNode].arrCpus;
+}
+
+bool ZCpuTopology::BindThread(size_t uNode) const
+{
+	if (uNode >= m_arrNodes.size())
+	{
+		return false;
+	}
+
+#ifdef __linux__
+	const Node &node = m_arrNodes[uNode];
+	cpu_set_t setCpus;
+	CPU_ZERO(&setCpus);
+	for (int nCpu : node.arrCpus)
+	{
+		if (nCpu < CPU_SETSIZE)
+		{
+			CPU_SET(nCpu, &setCpus);
+		}
+	}
+	if (0 != pthread_setaffinity_np(pthread_self(), sizeof(setCpus), &setCpus))
+	{
+		return false;
+	}
+
+#ifdef __NR_set_mempolicy
+	// Preferred rather than bound, a full node still falls back to the others
+	const size_t uBits = 8 * sizeof(unsigned long);
+	vector<unsigned long> arrMask(node.nId / uBits + 1, 0);
+	arrMask[node.nId / uBits] |= 1UL << (node.nId % uBits);
+	syscall(__NR_set_mempolicy, MPOL_PREFERRED, arrMask.data(), arrMask.size() * uBits + 1);
+#endif
+	return true;
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,140 @@
+#include "utils/workspace.h"
+#include <sys/statvfs.h>
+
+mutex ZWorkspace::s_mutex;
+string ZWorkspace::s_strRoot = "/tmp";
+string ZWorkspace::s_strMemoryRoot;
+uint64_t ZWorkspace::s_uMemoryBudget = 0;
+uint64_t ZWorkspace::s_uMemoryUsed = 0;
+
+ZWorkspace::ZWorkspace()
+{
+	m_uReserved = 0;
+	m_bInMemory = false;
+}
+
+ZWorkspace::~ZWorkspace()
+{
+	Remove();
+}
+
+bool ZWorkspace::SetRoot(const string &strFolder)
+{
+	CreateFolder(strFolder.c_str());
+	if (!IsFolder(strFolder.c_str()))
+	{
+		ZLog::ErrorV(">>> Invalid Work Folder! %s\n", strFolder.c_str());
+		return false;
+	}
+	s_strRoot = strFolder;
+	return true;
+}
+
+bool ZWorkspace::SetMemoryRoot(const string &strFolder, uint64_t uBudget)
+{
+	if (!IsFolder(strFolder.c_str()))
+	{
+		ZLog::ErrorV(">>> Invalid RAM Folder! %s\n", strFolder.c_str());
+		return false;
+	}
+
+	if (0 == uBudget)
+	{
+		// Default to a quarter of the physical memory
+		long nPages = sysconf(_SC_PHYS_PAGES);
+		long nPageSize = sysconf(_SC_PAGESIZE);
+		if (nPages > 0 && nPageSize > 0)
+		{
+			uBudget = (uint64_t)nPages * (uint64_t)nPageSize / 4;
+		}
+	}
+
+	s_strMemoryRoot = strFolder;
+	s_uMemoryBudget = uBudget;
+	return true;
+}
+
+const string &ZWorkspace::GetRoot()
+{
+	return s_strRoot;
+}
+
+bool ZWorkspace::Reserve(uint64_t uSize)
+{
+	lock_guard<mutex> lock(s_mutex);
+	if (s_uMemoryUsed + uSize > s_uMemoryBudget)
+	{
+		return false;
+	}
+
+	// The tmpfs may be shared with other processes, so also check what is actually free
+	struct statvfs st;
+	if (0 == statvfs(s_strMemoryRoot.c_str(), &st) && (uint64_t)st.f_bavail * st.f_frsize < uSize)
+	{
+		return false;
+	}
+
+	s_uMemoryUsed += uSize;
+	return true;
+}
+
+void ZWorkspace::Release(uint64_t uSize)
+{
+	lock_guard<mutex> lock(s_mutex);
+	s_uMemoryUsed -= min(uSize, s_uMemoryUsed);
+}
+
+bool ZWorkspace::Create(const char *szPrefix, uint64_t uExpectedSize)
+{
+	Remove();
+
+	m_bInMemory = (!s_strMemoryRoot.empty() && Reserve(uExpectedSize));
+	string strTemplate = (m_bInMemory ? s_strMemoryRoot : s_strRoot) + "/" + szPrefix + "XXXXXX";
+
+	vector<char> arrTemplate(strTemplate.begin(), strTemplate.end());
+	arrTemplate.push_back('\0');
+	if (NULL == mkdtemp(&arrTemplate[0]))
+	{
+		ZLog::ErrorV(">>> Can't Create Workspace! %s, %s\n", strTemplate.c_str(), strerror(errno));
+		if (m_bInMemory)
+		{
+			Release(uExpectedSize);
+			m_bInMemory = false;
+		}
+		return false;
+	}
+
+	m_strFolder = &arrTemplate[0];
+	m_uReserved = m_bInMemory ? uExpectedSize : 0;
+	if (!s_strMemoryRoot.empty())
+	{
+		ZLog::DebugV(">>> Workspace:\t%s (%s, %s)\n", m_strFolder.c_str(), m_bInMemory ? "RAM" : "disk", FormatSize(uExpectedSize).c_str());
+	}
+	return true;
+}
+
+void ZWorkspace::Remove()
+{
+	if (!m_strFolder.empty())
+	{
+		RemoveFolder(m_strFolder.c_str());
+		m_strFolder.clear();
+	}
+
+	if (m_uReserved > 0)
+	{
+		Release(m_uReserved);
+		m_uReserved = 0;
+	}
+	m_bInMemory = false;
+}
+
+const string &ZWorkspace::GetFolder() const
+{
+	return m_strFolder;
+}
+
+bool ZWorkspace::IsInMemory() const
+{
+	return m_bInMemory;
+}
@@ -0,0 +1,1787 @@
+#include "utils/zip.h"
+#include "utils/cancel.h"
+#include <zlib.h>
+#include <algorithm>
+#include <condition_variable>
+
+#define ZIP_LOCAL_HEADER_SIGNATURE 0x04034b50
+#define ZIP_CENTRAL_HEADER_SIGNATURE 0x02014b50
+#define ZIP_END_OF_CENTRAL_DIR_SIGNATURE 0x06054b50
+#define ZIP64_END_OF_CENTRAL_DIR_SIGNATURE 0x06064b50
+#define ZIP64_END_OF_CENTRAL_DIR_LOCATOR_SIGNATURE 0x07064b50
+
+#define ZIP_LOCAL_HEADER_SIZE 30
+#define ZIP_CENTRAL_HEADER_SIZE 46
+#define ZIP_END_OF_CENTRAL_DIR_SIZE 22
+#define ZIP64_END_OF_CENTRAL_DIR_SIZE 56
+#define ZIP64_END_OF_CENTRAL_DIR_LOCATOR_SIZE 20
+
+#define ZIP_METHOD_STORE 0
+#define ZIP_METHOD_DEFLATE 8
+
+#define ZIP_FLAG_ENCRYPTED 0x0001
+#define ZIP_FLAG_UTF8 0x0800
+#define ZIP_HOST_UNIX 3
+#define ZIP_VERSION_MADE_BY ((ZIP_HOST_UNIX << 8) | 30)
+#define ZIP_VERSION_STORE 10
+#define ZIP_VERSION_DEFLATE 20
+#define ZIP_VERSION_ZIP64 45
+#define ZIP_DOS_ATTR_FOLDER 0x10
+#define ZIP_EXTRA_TIMESTAMP 0x5455
+#define ZIP_EXTRA_ZIP64 0x0001
+
+#define ZIP64_MARKER_16 0xffff
+#define ZIP64_MARKER_32 0xffffffff
+// Entries this large get Zip64 local sizes up front, deflate may still grow them a little
+#define ZIP64_LOCAL_THRESHOLD 0xff000000ULL
+
+#define ZIP_INFLATE_BUFFER_SIZE (256 * 1024)
+#define ZIP_INFLATE_MAX_INPUT (1024 * 1024 * 1024)
+#define ZIP_DEFLATE_BLOCK_SIZE (512 * 1024)
+#define ZIP_DEFLATE_DICT_SIZE (32 * 1024)
+#define ZIP_DEFLATE_BLOCKS_PER_THREAD 4
+#define ZIP_WRITE_BUFFER_SIZE (1024 * 1024)
+// Small files read per ZBatchIO call
+#define ZIP_BATCH_FILES 64
+
+// ZIP_LEVEL_AUTO: bytes sampled per entry, and the entropy (bits per byte) above
+// which data is taken as already compressed or below which it is worth level 9
+#define ZIP_POLICY_SAMPLE_SIZE (16 * 1024)
+#define ZIP_POLICY_STORE_ENTROPY 7.5
+#define ZIP_POLICY_BEST_ENTROPY 5.0
+#define ZIP_POLICY_FAST_LEVEL 1
+#define ZIP_POLICY_BEST_LEVEL 9
+// Fixed levels up to this one are reported as "fast" in the stats
+#define ZIP_POLICY_FAST_MAX_LEVEL 5
+
+static uint16_t _ZipRead16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t _ZipRead32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t _ZipRead64(const uint8_t *p)
+{
+	return (uint64_t)_ZipRead32(p) | ((uint64_t)_ZipRead32(p + 4) << 32);
+}
+
+static void _ZipWrite16(string &strOutput, uint16_t uValue)
+{
+	strOutput.push_back((char)(uValue & 0xff));
+	strOutput.push_back((char)((uValue >> 8) & 0xff));
+}
+
+static void _ZipWrite32(string &strOutput, uint32_t uValue)
+{
+	_ZipWrite16(strOutput, (uint16_t)(uValue & 0xffff));
+	_ZipWrite16(strOutput, (uint16_t)(uValue >> 16));
+}
+
+static void _ZipWrite64(string &strOutput, uint64_t uValue)
+{
+	_ZipWrite32(strOutput, (uint32_t)(uValue & 0xffffffff));
+	_ZipWrite32(strOutput, (uint32_t)(uValue >> 32));
+}
+
+static void _ZipDosTime(time_t tTime, bool bUTC, uint16_t &uTime, uint16_t &uDate)
+{
+	struct tm tmLocal;
+	memset(&tmLocal, 0, sizeof(tmLocal));
+	if (bUTC)
+	{
+		gmtime_r(&tTime, &tmLocal);
+	}
+	else
+	{
+		localtime_r(&tTime, &tmLocal);
+	}
+	if (tmLocal.tm_year < 80)
+	{
+		uTime = 0;
+		uDate = (1 << 5) | 1; // 1980-01-01
+		return;
+	}
+	uTime = (uint16_t)((tmLocal.tm_hour << 11) | (tmLocal.tm_min << 5) | (tmLocal.tm_sec / 2));
+	uDate = (uint16_t)(((tmLocal.tm_year - 80) << 9) | ((tmLocal.tm_mon + 1) << 5) | tmLocal.tm_mday);
+}
+
+static time_t _ZipUnixTime(uint16_t uTime, uint16_t uDate)
+{
+	struct tm tmLocal;
+	memset(&tmLocal, 0, sizeof(tmLocal));
+	tmLocal.tm_year = ((uDate >> 9) & 0x7f) + 80;
+	tmLocal.tm_mon = ((uDate >> 5) & 0x0f) - 1;
+	tmLocal.tm_mday = uDate & 0x1f;
+	tmLocal.tm_hour = (uTime >> 11) & 0x1f;
+	tmLocal.tm_min = (uTime >> 5) & 0x3f;
+	tmLocal.tm_sec = (uTime & 0x1f) * 2;
+	tmLocal.tm_isdst = -1;
+	return mktime(&tmLocal);
+}
+
+static uint64_t _ThreadCPUTime()
+{
+	struct timespec ts;
+	if (0 != clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+	{
+		return 0;
+	}
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Formats that are compressed already, deflating them again gains next to nothing
+static const char *s_arrStoreExtensions[] = {
+	"png", "jpg", "jpeg", "gif", "webp", "heic", "heif", "avif", "car",
+	"mp4", "m4v", "m4a", "mov", "mp3", "aac", "ogg", "opus", "webm",
+	"zip", "ipa", "jar", "apk", "gz", "tgz", "bz2", "xz", "lz4", "lzma", "zst", "7z", "br", "ccz",
+	"woff", "woff2", "unity3d", NULL};
+
+// Small, highly redundant metadata where level 9 is cheap
+static const char *s_arrBestExtensions[] = {
+	"plist", "strings", "stringsdict", "json", "xml", "js", "html", "htm", "css", "svg", "txt",
+	"nib", "mobileprovision", "xcent", "entitlements", NULL};
+
+static bool _ZipHasExtension(const string &strName, const char **arrExtensions)
+{
+	size_t pos = strName.rfind('.');
+	if (string::npos == pos || string::npos != strName.find('/', pos))
+	{
+		return false;
+	}
+
+	string strExt = strName.substr(pos + 1);
+	transform(strExt.begin(), strExt.end(), strExt.begin(), ::tolower);
+	for (size_t i = 0; NULL != arrExtensions[i]; i++)
+	{
+		if (strExt == arrExtensions[i])
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// Shannon entropy of the sample in bits per byte, 8 for random data
+static double _ZipEntropy(const uint8_t *pData, size_t sLength)
+{
+	if (0 == sLength)
+	{
+		return 0;
+	}
+
+	size_t arrCounts[256] = {0};
+	for (size_t i = 0; i < sLength; i++)
+	{
+		arrCounts[pData[i]]++;
+	}
+
+	double fEntropy = 0;
+	for (size_t i = 0; i < 256; i++)
+	{
+		if (arrCounts[i] > 0)
+		{
+			double p = (double)arrCounts[i] / sLength;
+			fEntropy -= p * log2(p);
+		}
+	}
+	return fEntropy;
+}
+
+// Names are written as they are, which on every host we run on is UTF-8
+static uint16_t _ZipNameFlags(const string &strName)
+{
+	for (size_t i = 0; i < strName.size(); i++)
+	{
+		if ((uint8_t)strName[i] >= 0x80)
+		{
+			return ZIP_FLAG_UTF8;
+		}
+	}
+	return 0;
+}
+
+static int _ZipClassLevel(int nLevel, int nClass)
+{
+	if (ZIP_LEVEL_AUTO != nLevel)
+	{
+		return nLevel;
+	}
+
+	switch (nClass)
+	{
+	case E_ZIP_FAST:
+		return ZIP_POLICY_FAST_LEVEL;
+	case E_ZIP_BEST:
+		return ZIP_POLICY_BEST_LEVEL;
+	default:
+		return 0;
+	}
+}
+
+static int _GetThreadCount(int nThreadCount)
+{
+	if (nThreadCount <= 0)
+	{
+		nThreadCount = (int)thread::hardware_concurrency();
+		if (nThreadCount <= 0)
+		{
+			nThreadCount = 2;
+		}
+	}
+	return nThreadCount;
+}
+
+// Buffered sequential writer that can still patch bytes it has already written
+class ZZipOutput
+{
+public:
+	ZZipOutput(int fd) : m_fd(fd), m_uOffset(0), m_uFlushed(0) {}
+
+	uint64_t GetOffset() const
+	{
+		return m_uOffset;
+	}
+
+	bool Write(const char *pData, size_t sLength)
+	{
+		if (m_strBuffer.size() + sLength > ZIP_WRITE_BUFFER_SIZE && !Flush())
+		{
+			return false;
+		}
+
+		m_uOffset += sLength;
+		if (sLength >= ZIP_WRITE_BUFFER_SIZE)
+		{
+			m_uFlushed += sLength;
+			return WriteAll(pData, sLength);
+		}
+		m_strBuffer.append(pData, sLength);
+		return true;
+	}
+
+	bool Write(const string &strData)
+	{
+		return Write(strData.data(), strData.size());
+	}
+
+	bool Patch(uint64_t uOffset, const string &strData)
+	{
+		// The patch may straddle what was flushed and what is still buffered
+		size_t sFlushed = (uOffset < m_uFlushed) ? (size_t)min<uint64_t>(m_uFlushed - uOffset, strData.size()) : 0;
+		if (sFlushed > 0 && (ssize_t)sFlushed != pwrite(m_fd, strData.data(), sFlushed, uOffset))
+		{
+			return false;
+		}
+		if (sFlushed < strData.size())
+		{
+			memcpy(&m_strBuffer[uOffset + sFlushed - m_uFlushed], strData.data() + sFlushed, strData.size() - sFlushed);
+		}
+		return true;
+	}
+
+	bool Flush()
+	{
+		bool bRet = WriteAll(m_strBuffer.data(), m_strBuffer.size());
+		m_uFlushed += m_strBuffer.size();
+		m_strBuffer.clear();
+		return bRet;
+	}
+
+private:
+	bool WriteAll(const char *pData, size_t sLength)
+	{
+		while (sLength > 0)
+		{
+			ssize_t nWrite = write(m_fd, pData, sLength);
+			if (nWrite <= 0)
+			{
+				return false;
+			}
+			pData += nWrite;
+			sLength -= nWrite;
+		}
+		return true;
+	}
+
+private:
+	int m_fd;
+	uint64_t m_uOffset;
+	uint64_t m_uFlushed;
+	string m_strBuffer;
+};
+
+// Reject absolute names and ".." components so entries can't escape the workspace
+static bool _IsSafeEntryName(const string &strName)
+{
+	if (strName.empty() || '/' == strName[0] || '\\' == strName[0])
+	{
+		return false;
+	}
+
+	vector<string> arrParts;
+	StringSplit(strName, "/", arrParts);
+	for (const auto &strPart : arrParts)
+	{
+		if (".." == strPart)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool ZZipEntry::IsFolder() const
+{
+	return (!strName.empty() && '/' == strName[strName.size() - 1]);
+}
+
+bool ZZipEntry::IsSymLink() const
+{
+	return (ZIP_HOST_UNIX == (uVersionMadeBy >> 8) && S_ISLNK(GetMode()));
+}
+
+uint32_t ZZipEntry::GetMode() const
+{
+	if (ZIP_HOST_UNIX == (uVersionMadeBy >> 8))
+	{
+		return (uExternalAttr >> 16) & 0xffff;
+	}
+	return 0;
+}
+
+ZZipReader::ZZipReader()
+{
+	m_pBase = NULL;
+	m_sSize = 0;
+}
+
+ZZipReader::~ZZipReader()
+{
+	Close();
+}
+
+bool ZZipReader::Open(const char *szFile)
+{
+	Close();
+
+	m_strFile = szFile;
+	m_pBase = (uint8_t *)MapFile(szFile, 0, 0, &m_sSize, true);
+	if (NULL == m_pBase)
+	{
+		ZLog::ErrorV(">>> Can't Open Zip File! %s, %s\n", szFile, strerror(errno));
+		return false;
+	}
+
+	if (!ReadCentralDirectory())
+	{
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void ZZipReader::Close()
+{
+	if (NULL != m_pBase && m_sSize > 0)
+	{
+		munmap(m_pBase, m_sSize);
+	}
+	m_pBase = NULL;
+	m_sSize = 0;
+	m_arrEntries.clear();
+	m_arrErrors.clear();
+}
+
+const vector<ZZipEntry> &ZZipReader::GetEntries() const
+{
+	return m_arrEntries;
+}
+
+const vector<string> &ZZipReader::GetErrors() const
+{
+	return m_arrErrors;
+}
+
+uint64_t ZZipReader::GetUncompressedSize() const
+{
+	uint64_t uSize = 0;
+	for (const auto &entry : m_arrEntries)
+	{
+		// Saturates instead of wrapping on forged sizes
+		uSize = (entry.uUncompressedSize > UINT64_MAX - uSize) ? UINT64_MAX : uSize + entry.uUncompressedSize;
+	}
+	return uSize;
+}
+
+bool ZZipReader::ReadCentralDirectory()
+{
+	if (m_sSize < ZIP_END_OF_CENTRAL_DIR_SIZE)
+	{
+		ZLog::ErrorV(">>> Invalid Zip File! %s\n", m_strFile.c_str());
+		return false;
+	}
+
+	// The end record sits behind an optional comment of at most 64 KiB
+	const uint8_t *pEnd = NULL;
+	size_t sMinPos = (m_sSize > 0xffff + ZIP_END_OF_CENTRAL_DIR_SIZE) ? m_sSize - 0xffff - ZIP_END_OF_CENTRAL_DIR_SIZE : 0;
+	for (size_t pos = m_sSize - ZIP_END_OF_CENTRAL_DIR_SIZE + 1; pos-- > sMinPos;)
+	{
+		if (ZIP_END_OF_CENTRAL_DIR_SIGNATURE == _ZipRead32(m_pBase + pos))
+		{
+			pEnd = m_pBase + pos;
+			break;
+		}
+	}
+
+	if (NULL == pEnd)
+	{
+		ZLog::ErrorV(">>> Can't Find Zip Central Directory! %s\n", m_strFile.c_str());
+		return false;
+	}
+
+	uint64_t uEntryCount = _ZipRead16(pEnd + 10);
+	uint64_t uDirSize = _ZipRead32(pEnd + 12);
+	uint64_t uDirOffset = _ZipRead32(pEnd + 16);
+
+	// Zip64: a locator right in front of the end record points at the 64-bit end record
+	const uint8_t *pLocator = pEnd - ZIP64_END_OF_CENTRAL_DIR_LOCATOR_SIZE;
+	if (pEnd - m_pBase >= ZIP64_END_OF_CENTRAL_DIR_LOCATOR_SIZE && ZIP64_END_OF_CENTRAL_DIR_LOCATOR_SIGNATURE == _ZipRead32(pLocator))
+	{
+		uint64_t uEnd64Offset = _ZipRead64(pLocator + 8);
+		if (m_sSize < ZIP64_END_OF_CENTRAL_DIR_SIZE || uEnd64Offset > m_sSize - ZIP64_END_OF_CENTRAL_DIR_SIZE ||
+			ZIP64_END_OF_CENTRAL_DIR_SIGNATURE != _ZipRead32(m_pBase + uEnd64Offset))
+		{
+			ZLog::ErrorV(">>> Invalid Zip64 End Of Central Directory! %s\n", m_strFile.c_str());
+			return false;
+		}
+
+		const uint8_t *pEnd64 = m_pBase + uEnd64Offset;
+		uEntryCount = _ZipRead64(pEnd64 + 32);
+		uDirSize = _ZipRead64(pEnd64 + 40);
+		uDirOffset = _ZipRead64(pEnd64 + 48);
+	}
+	else if (ZIP64_MARKER_32 == uDirSize || ZIP64_MARKER_32 == uDirOffset)
+	{
+		ZLog::ErrorV(">>> Can't Find Zip64 End Of Central Directory! %s\n", m_strFile.c_str());
+		return false;
+	}
+
+	if (uDirOffset > m_sSize || uDirSize > m_sSize - uDirOffset)
+	{
+		ZLog::ErrorV(">>> Invalid Zip Central Directory! %s\n", m_strFile.c_str());
+		return false;
+	}
+
+	m_arrEntries.reserve((size_t)min<uint64_t>(uEntryCount, uDirSize / ZIP_CENTRAL_HEADER_SIZE));
+	set<string> setNames;
+	const uint8_t *p = m_pBase + uDirOffset;
+	const uint8_t *pDirEnd = p + uDirSize;
+	for (uint64_t i = 0; i < uEntryCount; i++)
+	{
+		// Bounds are checked on what's left of the directory, offsets read from
+		// the archive never go into pointer arithmetic unchecked
+		size_t sLeft = (size_t)(pDirEnd - p);
+		if (sLeft < ZIP_CENTRAL_HEADER_SIZE || ZIP_CENTRAL_HEADER_SIGNATURE != _ZipRead32(p))
+		{
+			ZLog::ErrorV(">>> Invalid Zip Central Directory Entry! %s, #%llu\n", m_strFile.c_str(), (unsigned long long)i);
+			return false;
+		}
+
+		uint16_t uNameLength = _ZipRead16(p + 28);
+		uint16_t uExtraLength = _ZipRead16(p + 30);
+		uint16_t uCommentLength = _ZipRead16(p + 32);
+		if (sLeft - ZIP_CENTRAL_HEADER_SIZE < (size_t)uNameLength + uExtraLength + uCommentLength)
+		{
+			ZLog::ErrorV(">>> Invalid Zip Central Directory Entry! %s, #%llu\n", m_strFile.c_str(), (unsigned long long)i);
+			return false;
+		}
+
+		ZZipEntry entry;
+		entry.uVersionMadeBy = _ZipRead16(p + 4);
+		entry.uFlags = _ZipRead16(p + 8);
+		entry.uMethod = _ZipRead16(p + 10);
+		entry.uModTime = _ZipRead16(p + 12);
+		entry.uModDate = _ZipRead16(p + 14);
+		entry.uCRC32 = _ZipRead32(p + 16);
+		entry.uCompressedSize = _ZipRead32(p + 20);
+		entry.uUncompressedSize = _ZipRead32(p + 24);
+		entry.uExternalAttr = _ZipRead32(p + 38);
+		entry.uLocalHeaderOffset = _ZipRead32(p + 42);
+		entry.strName.assign((const char *)p + ZIP_CENTRAL_HEADER_SIZE, uNameLength);
+
+		// Fields that overflowed 32 bits are stored, in this order, in the Zip64 extra field
+		const uint8_t *pExtra = p + ZIP_CENTRAL_HEADER_SIZE + uNameLength;
+		size_t sExtra = 0;
+		while (sExtra + 4 <= uExtraLength)
+		{
+			uint16_t uTag = _ZipRead16(pExtra + sExtra);
+			uint16_t uSize = _ZipRead16(pExtra + sExtra + 2);
+			size_t sField = sExtra + 4;
+			size_t sFieldEnd = min<size_t>(sField + uSize, uExtraLength);
+			if (ZIP_EXTRA_ZIP64 == uTag)
+			{
+				uint64_t *arrFields[] = {&entry.uUncompressedSize, &entry.uCompressedSize, &entry.uLocalHeaderOffset};
+				for (uint64_t *pValue : arrFields)
+				{
+					if (ZIP64_MARKER_32 == *pValue && sField + 8 <= sFieldEnd)
+					{
+						*pValue = _ZipRead64(pExtra + sField);
+						sField += 8;
+					}
+				}
+			}
+			sExtra += 4 + (size_t)uSize;
+		}
+
+		// Two entries for one path are ambiguous, and a symlink and a file of
+		// the same name would let the file be written through the link
+		if (!entry.IsFolder() && !setNames.insert(entry.strName).second)
+		{
+			ZLog::ErrorV(">>> Duplicate Zip Entry! %s, %s\n", m_strFile.c_str(), entry.strName.c_str());
+			return false;
+		}
+		m_arrEntries.push_back(entry);
+
+		p += ZIP_CENTRAL_HEADER_SIZE + uNameLength + uExtraLength + uCommentLength;
+	}
+
+	return true;
+}
+
+bool ZZipReader::GetEntryData(const ZZipEntry &entry, const uint8_t *&pData, string &strError)
+{
+	if (m_sSize < ZIP_LOCAL_HEADER_SIZE || entry.uLocalHeaderOffset > m_sSize - ZIP_LOCAL_HEADER_SIZE)
+	{
+		strError = "local header out of range";
+		return false;
+	}
+
+	const uint8_t *pHeader = m_pBase + entry.uLocalHeaderOffset;
+	if (ZIP_LOCAL_HEADER_SIGNATURE != _ZipRead32(pHeader))
+	{
+		strError = "bad local header signature";
+		return false;
+	}
+
+	uint64_t uDataOffset = entry.uLocalHeaderOffset + ZIP_LOCAL_HEADER_SIZE + _ZipRead16(pHeader + 26) + _ZipRead16(pHeader + 28);
+	if (uDataOffset > m_sSize || entry.uCompressedSize > m_sSize - uDataOffset)
+	{
+		strError = "data out of range";
+		return false;
+	}
+
+	pData = m_pBase + uDataOffset;
+	return true;
+}
+
+bool ZZipReader::ReadEntry(const ZZipEntry &entry, const function<bool(const uint8_t *, size_t)> &sink, string &strError)
+{
+	if (entry.uFlags & ZIP_FLAG_ENCRYPTED)
+	{
+		strError = "encrypted entries are not supported";
+		return false;
+	}
+
+	const uint8_t *pData = NULL;
+	if (!GetEntryData(entry, pData, strError))
+	{
+		return false;
+	}
+
+	uLong uCRC = crc32(0L, Z_NULL, 0);
+	if (ZIP_METHOD_STORE == entry.uMethod)
+	{
+		if (entry.uCompressedSize != entry.uUncompressedSize)
+		{
+			strError = "size mismatch";
+			return false;
+		}
+
+		uint64_t uOffset = 0;
+		while (uOffset < entry.uCompressedSize)
+		{
+			if (ZCancelToken::IsCurrentCancelled())
+			{
+				strError = "cancelled";
+				return false;
+			}
+			size_t sLength = (size_t)min<uint64_t>(entry.uCompressedSize - uOffset, ZIP_INFLATE_BUFFER_SIZE);
+			uCRC = crc32(uCRC, pData + uOffset, (uInt)sLength);
+			if (!sink(pData + uOffset, sLength))
+			{
+				strError = "write failed";
+				return false;
+			}
+			uOffset += sLength;
+		}
+	}
+	else if (ZIP_METHOD_DEFLATE == entry.uMethod)
+	{
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+		if (Z_OK != inflateInit2(&zs, -MAX_WBITS))
+		{
+			strError = "inflateInit failed";
+			return false;
+		}
+
+		ZBuffer buffer;
+		uint8_t *pOutput = (uint8_t *)buffer.GetBuffer(ZIP_INFLATE_BUFFER_SIZE);
+		uint64_t uInputOffset = 0;
+		uint64_t uTotalOutput = 0;
+		int nRet = Z_OK;
+		while (Z_STREAM_END != nRet)
+		{
+			if (ZCancelToken::IsCurrentCancelled())
+			{
+				inflateEnd(&zs);
+				strError = "cancelled";
+				return false;
+			}
+			if (0 == zs.avail_in && uInputOffset < entry.uCompressedSize)
+			{
+				uint64_t uInput = min<uint64_t>(entry.uCompressedSize - uInputOffset, ZIP_INFLATE_MAX_INPUT);
+				zs.next_in = (Bytef *)(pData + uInputOffset);
+				zs.avail_in = (uInt)uInput;
+				uInputOffset += uInput;
+			}
+
+			zs.next_out = pOutput;
+			zs.avail_out = ZIP_INFLATE_BUFFER_SIZE;
+			nRet = inflate(&zs, Z_NO_FLUSH);
+			if (Z_OK != nRet && Z_STREAM_END != nRet)
+			{
+				inflateEnd(&zs);
+				StringFormat(strError, "inflate failed (%d)", nRet);
+				return false;
+			}
+
+			size_t sHave = ZIP_INFLATE_BUFFER_SIZE - zs.avail_out;
+			if (sHave > 0)
+			{
+				// An entry inflating past its recorded size is corrupt or a bomb, stop before the disk fills
+				uCRC = crc32(uCRC, pOutput, (uInt)sHave);
+				uTotalOutput += sHave;
+				if (uTotalOutput > entry.uUncompressedSize)
+				{
+					inflateEnd(&zs);
+					strError = "size mismatch";
+					return false;
+				}
+				if (!sink(pOutput, sHave))
+				{
+					inflateEnd(&zs);
+					strError = "write failed";
+					return false;
+				}
+			}
+		}
+		inflateEnd(&zs);
+
+		if (uTotalOutput != entry.uUncompressedSize)
+		{
+			strError = "size mismatch";
+			return false;
+		}
+	}
+	else
+	{
+		StringFormat(strError, "unsupported compression method %u", entry.uMethod);
+		return false;
+	}
+
+	if (uCRC != entry.uCRC32)
+	{
+		strError = "crc32 mismatch";
+		return false;
+	}
+	return true;
+}
+
+bool ZZipReader::ReadEntry(const ZZipEntry &entry, string &strData)
+{
+	// The recorded size is only a hint, a forged one mustn't allocate the world
+	strData.clear();
+	strData.reserve((size_t)min<uint64_t>(entry.uUncompressedSize, ZIP_INFLATE_MAX_INPUT));
+
+	string strError;
+	bool bRet = ReadEntry(entry, [&strData](const uint8_t *pData, size_t sLength) {
+		strData.append((const char *)pData, sLength);
+		return true;
+	}, strError);
+
+	if (!bRet)
+	{
+		AddError(entry.strName, strError);
+	}
+	return bRet;
+}
+
+bool ZZipReader::ExtractEntry(const string &strFolder, const ZZipEntry &entry, const ZZipExtractFilter *pFilter, ZFileDigest *pDigest, bool &bSkipped, string &strError)
+{
+	bSkipped = false;
+	string strPath = strFolder + "/" + entry.strName;
+	if (entry.IsSymLink())
+	{
+		string strTarget;
+		bool bRet = ReadEntry(entry, [&strTarget](const uint8_t *pData, size_t sLength) {
+			strTarget.append((const char *)pData, sLength);
+			return true;
+		}, strError);
+
+		if (bRet && 0 != symlink(strTarget.c_str(), strPath.c_str()))
+		{
+			strError = strerror(errno);
+			return false;
+		}
+		return bRet;
+	}
+
+	// Without a filter every file is written, otherwise the first chunk decides
+	int fd = -1;
+	bool bDecided = false;
+	bool bWrite = true;
+	string strOpenError;
+	ZSHASum sha;
+	auto decideLambda = [&](const uint8_t *pHead, size_t sHeadLength) {
+		bDecided = true;
+		bWrite = (NULL == pFilter) || (*pFilter)(entry, pHead, sHeadLength);
+		if (bWrite)
+		{
+			mode_t uMode = entry.GetMode() & 0777;
+			// Never through a symlink, one in the archive could point anywhere
+			fd = open(strPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, (0 != uMode) ? uMode : 0644);
+			if (fd < 0)
+			{
+				strOpenError = strerror(errno);
+				return false;
+			}
+		}
+		return true;
+	};
+
+	if (NULL == pFilter && !decideLambda(NULL, 0))
+	{
+		strError = strOpenError;
+		return false;
+	}
+
+	bool bRet = ReadEntry(entry, [&](const uint8_t *pData, size_t sLength) {
+		if (!bDecided && !decideLambda(pData, sLength))
+		{
+			return false;
+		}
+
+		if (NULL != pDigest)
+		{
+			sha.Update(pData, sLength);
+		}
+
+		if (!bWrite)
+		{
+			return true;
+		}
+
+		while (sLength > 0)
+		{
+			ssize_t nWrite = write(fd, pData, sLength);
+			if (nWrite <= 0)
+			{
+				return false;
+			}
+			pData += nWrite;
+			sLength -= nWrite;
+		}
+		return true;
+	}, strError);
+
+	if (bRet && !bDecided)
+	{
+		bRet = decideLambda(NULL, 0);
+	}
+
+	if (!strOpenError.empty())
+	{
+		strError = strOpenError;
+	}
+
+	if (fd >= 0 && 0 != close(fd) && bRet)
+	{
+		strError = strerror(errno);
+		bRet = false;
+	}
+
+	if (bRet && NULL != pDigest)
+	{
+		sha.FinalBase64(*pDigest);
+	}
+	bSkipped = bRet && !bWrite;
+	return bRet;
+}
+
+bool ZZipReader::ExtractAll(const string &strFolder, int nThreadCount)
+{
+	return Extract(strFolder, NULL, NULL, NULL, nThreadCount);
+}
+
+bool ZZipReader::ExtractAll(const string &strFolder, map<string, ZFileDigest> &mapDigests, int nThreadCount)
+{
+	return Extract(strFolder, NULL, &mapDigests, NULL, nThreadCount);
+}
+
+bool ZZipReader::ExtractSparse(const string &strFolder, const ZZipExtractFilter &filter, map<string, ZFileDigest> &mapDigests, set<string> &setSkipped, int nThreadCount)
+{
+	return Extract(strFolder, &filter, &mapDigests, &setSkipped, nThreadCount);
+}
+
+bool ZZipReader::Extract(const string &strFolder, const ZZipExtractFilter *pFilter, map<string, ZFileDigest> *pDigests, set<string> *pSkipped, int nThreadCount)
+{
+	m_arrErrors.clear();
+
+	// Create the folder tree up front so the workers only ever write files.
+	// Symlinks come last, once no file is written anymore, so no write can go
+	// through one of them.
+	set<string> setFolders;
+	vector<const ZZipEntry *> arrFiles;
+	vector<const ZZipEntry *> arrLinks;
+	for (const auto &entry : m_arrEntries)
+	{
+		if (!_IsSafeEntryName(entry.strName))
+		{
+			AddError(entry.strName, "unsafe path");
+			continue;
+		}
+
+		size_t pos = entry.strName.rfind('/', entry.IsFolder() ? entry.strName.size() - 2 : string::npos);
+		if (string::npos != pos)
+		{
+			setFolders.insert(entry.strName.substr(0, pos));
+		}
+
+		if (entry.IsFolder())
+		{
+			setFolders.insert(entry.strName.substr(0, entry.strName.size() - 1));
+		}
+		else if (entry.IsSymLink())
+		{
+			arrLinks.push_back(&entry);
+		}
+		else
+		{
+			arrFiles.push_back(&entry);
+		}
+	}
+
+	CreateFolderTree(strFolder);
+	for (const auto &strSubFolder : setFolders)
+	{
+		CreateFolderTree(strFolder + "/" + strSubFolder);
+	}
+
+	// Biggest entries first so one large binary doesn't end up last in line
+	sort(arrFiles.begin(), arrFiles.end(), [](const ZZipEntry *a, const ZZipEntry *b) {
+		return a->uUncompressedSize > b->uUncompressedSize;
+	});
+
+	nThreadCount = (int)min<size_t>(_GetThreadCount(nThreadCount), max<size_t>(arrFiles.size(), 1));
+
+	// Each worker owns its slot, the digest map is assembled after the join
+	vector<ZFileDigest> arrDigests((NULL != pDigests) ? arrFiles.size() : 0);
+	vector<char> arrSkipped(arrFiles.size(), 0);
+
+	// Workers stop taking entries once the job is cancelled
+	ZCancelToken *pCancelToken = ZCancelToken::GetCurrent();
+	atomic<size_t> index(0);
+	auto workerLambda = [&]() {
+		ZCancelScope scope(pCancelToken);
+		size_t currentIndex;
+		while (!ZCancelToken::IsCurrentCancelled() && (currentIndex = index.fetch_add(1)) < arrFiles.size())
+		{
+			const ZZipEntry *pEntry = arrFiles[currentIndex];
+			bool bSkipped = false;
+			string strError;
+			ZFileDigest *pDigest = (NULL != pDigests) ? &arrDigests[currentIndex] : NULL;
+			if (!ExtractEntry(strFolder, *pEntry, pFilter, pDigest, bSkipped, strError))
+			{
+				AddError(pEntry->strName, strError);
+			}
+			arrSkipped[currentIndex] = bSkipped ? 1 : 0;
+		}
+	};
+
+	vector<thread> workers;
+	for (int i = 1; i < nThreadCount; i++)
+	{
+		workers.emplace_back(workerLambda);
+	}
+	workerLambda();
+	for (auto &worker : workers)
+	{
+		worker.join();
+	}
+	if (ZCancelToken::IsCurrentCancelled())
+	{
+		return false;
+	}
+
+	for (const ZZipEntry *pEntry : arrLinks)
+	{
+		bool bSkipped = false;
+		string strError;
+		if (!ExtractEntry(strFolder, *pEntry, pFilter, NULL, bSkipped, strError))
+		{
+			AddError(pEntry->strName, strError);
+		}
+	}
+
+	if (NULL != pDigests)
+	{
+		pDigests->clear();
+		for (size_t i = 0; i < arrFiles.size(); i++)
+		{
+			(*pDigests)[arrFiles[i]->strName] = arrDigests[i];
+		}
+	}
+
+	if (NULL != pSkipped)
+	{
+		pSkipped->clear();
+		for (size_t i = 0; i < arrFiles.size(); i++)
+		{
+			if (arrSkipped[i])
+			{
+				pSkipped->insert(arrFiles[i]->strName);
+			}
+		}
+	}
+
+	for (const auto &strError : m_arrErrors)
+	{
+		ZLog::ErrorV(">>> Unzip Entry Failed! %s\n", strError.c_str());
+	}
+	return m_arrErrors.empty();
+}
+
+void ZZipReader::AddError(const string &strName, const string &strError)
+{
+	lock_guard<mutex> lock(m_mutexErrors);
+	m_arrErrors.push_back(strName + ": " + strError);
+}
+
+ZZipStats::ZZipStats()
+{
+	memset(arrEntries, 0, sizeof(arrEntries));
+	memset(arrInputBytes, 0, sizeof(arrInputBytes));
+	memset(arrOutputBytes, 0, sizeof(arrOutputBytes));
+	memset(arrCPUTime, 0, sizeof(arrCPUTime));
+}
+
+void ZZipStats::Add(const ZZipStats &stats)
+{
+	for (int i = 0; i < E_ZIP_CLASS_COUNT; i++)
+	{
+		arrEntries[i] += stats.arrEntries[i];
+		arrInputBytes[i] += stats.arrInputBytes[i];
+		arrOutputBytes[i] += stats.arrOutputBytes[i];
+		arrCPUTime[i] += stats.arrCPUTime[i];
+	}
+}
+
+void ZZipStats::Print() const
+{
+	static const char *s_arrNames[E_ZIP_CLASS_COUNT] = {"copy", "store", "fast", "best"};
+	for (int i = 0; i < E_ZIP_CLASS_COUNT; i++)
+	{
+		if (0 == arrEntries[i])
+		{
+			continue;
+		}
+
+		uint64_t uSaved = (arrInputBytes[i] > arrOutputBytes[i]) ? (arrInputBytes[i] - arrOutputBytes[i]) : 0;
+		ZLog::PrintV(">>> Zip %s:\t%llu files, %s -> %s, saved %s, cpu %.3fs\n", s_arrNames[i],
+					 (unsigned long long)arrEntries[i],
+					 FormatSize(arrInputBytes[i]).c_str(),
+					 FormatSize(arrOutputBytes[i]).c_str(),
+					 FormatSize(uSaved).c_str(),
+					 arrCPUTime[i] / 1000000.0);
+	}
+}
+
+ZZipWriter::ZZipWriter()
+{
+	m_nLevel = 0;
+	m_nThreadCount = 0;
+	m_bDeterministic = false;
+	m_tFixedTime = 0;
+}
+
+void ZZipWriter::SetLevel(int nLevel)
+{
+	if (ZIP_LEVEL_AUTO == nLevel)
+	{
+		m_nLevel = nLevel;
+		return;
+	}
+	m_nLevel = (nLevel < 0) ? 0 : ((nLevel > 9) ? 9 : nLevel);
+}
+
+void ZZipWriter::SetThreadCount(int nThreadCount)
+{
+	m_nThreadCount = nThreadCount;
+}
+
+void ZZipWriter::SetDeterministic(time_t tModTime)
+{
+	m_bDeterministic = true;
+	m_tFixedTime = tModTime;
+}
+
+const vector<string> &ZZipWriter::GetErrors() const
+{
+	return m_arrErrors;
+}
+
+const ZZipStats &ZZipWriter::GetStats() const
+{
+	return m_stats;
+}
+
+bool ZZipWriter::AddFolder(const string &strBaseFolder, const string &strName)
+{
+	return AddNode(strBaseFolder + "/" + strName, strName, NULL);
+}
+
+bool ZZipWriter::AddFolder(const string &strBaseFolder, const string &strName, const set<string> &setExcludes)
+{
+	return AddNode(strBaseFolder + "/" + strName, strName, &setExcludes);
+}
+
+bool ZZipWriter::AddFile(const string &strPath, const string &strName)
+{
+	return AddNode(strPath, strName, NULL);
+}
+
+bool ZZipWriter::AddEntry(ZZipReader *pReader, const ZZipEntry &entry, const string &strName)
+{
+	Source source;
+	source.strName = strName;
+	source.uMode = entry.GetMode();
+	if (0 == (source.uMode & S_IFMT))
+	{
+		source.uMode |= entry.IsFolder() ? S_IFDIR : S_IFREG;
+	}
+	if (0 == (source.uMode & 0777))
+	{
+		source.uMode |= entry.IsFolder() ? 0755 : 0644;
+	}
+	source.tModTime = _ZipUnixTime(entry.uModTime, entry.uModDate);
+	source.uSize = entry.IsFolder() ? 0 : entry.uUncompressedSize;
+	source.pReader = pReader;
+	source.pEntry = &entry;
+	source.nClass = E_ZIP_COPY;
+	m_arrSources.push_back(source);
+	return true;
+}
+
+bool ZZipWriter::AddNode(const string &strPath, const string &strName, const set<string> *pExcludes)
+{
+	struct stat st;
+	if (0 != lstat(strPath.c_str(), &st))
+	{
+		ZLog::ErrorV(">>> Can't Stat File! %s, %s\n", strPath.c_str(), strerror(errno));
+		return false;
+	}
+
+	Source source;
+	source.strName = strName;
+	source.strPath = strPath;
+	source.uMode = st.st_mode;
+	source.tModTime = st.st_mtime;
+	source.uSize = 0;
+	source.pReader = NULL;
+	source.pEntry = NULL;
+	source.nClass = -1;
+
+	if (NULL != pExcludes && !S_ISDIR(st.st_mode) && pExcludes->count(strName) > 0)
+	{
+		return true;
+	}
+
+	if (S_ISDIR(st.st_mode))
+	{
+		source.strName += "/";
+		m_arrSources.push_back(source);
+
+		DIR *dir = opendir(strPath.c_str());
+		if (NULL == dir)
+		{
+			ZLog::ErrorV(">>> Can't Open Folder! %s, %s\n", strPath.c_str(), strerror(errno));
+			return false;
+		}
+
+		bool bRet = true;
+		dirent *ptr = readdir(dir);
+		while (NULL != ptr && bRet)
+		{
+			if (0 != strcmp(ptr->d_name, ".") && 0 != strcmp(ptr->d_name, ".."))
+			{
+				bRet = AddNode(strPath + "/" + ptr->d_name, strName + "/" + ptr->d_name, pExcludes);
+			}
+			ptr = readdir(dir);
+		}
+		closedir(dir);
+		return bRet;
+	}
+	else if (S_ISLNK(st.st_mode))
+	{
+		char szTarget[PATH_MAX] = {0};
+		ssize_t nLength = readlink(strPath.c_str(), szTarget, sizeof(szTarget) - 1);
+		if (nLength < 0)
+		{
+			ZLog::ErrorV(">>> Can't Read Link! %s, %s\n", strPath.c_str(), strerror(errno));
+			return false;
+		}
+		source.strLinkTarget.assign(szTarget, nLength);
+		source.uSize = nLength;
+		m_arrSources.push_back(source);
+	}
+	else if (S_ISREG(st.st_mode))
+	{
+		source.uSize = st.st_size;
+		m_arrSources.push_back(source);
+	}
+	return true;
+}
+
+bool ZZipWriter::ReadSource(const Source &source, uint64_t uOffset, uint64_t uLength, string &strData, string &strError)
+{
+	if (S_ISLNK(source.uMode))
+	{
+		strData = source.strLinkTarget.substr(uOffset, uLength);
+		return true;
+	}
+
+	int fd = open(source.strPath.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		strError = strerror(errno);
+		return false;
+	}
+
+	strData.resize(uLength);
+	uint64_t uRead = 0;
+	while (uRead < uLength)
+	{
+		ssize_t nRead = pread(fd, &strData[uRead], uLength - uRead, uOffset + uRead);
+		if (nRead <= 0)
+		{
+			strError = (nRead < 0) ? strerror(errno) : "file changed while archiving";
+			close(fd);
+			return false;
+		}
+		uRead += nRead;
+	}
+	close(fd);
+	return true;
+}
+
+int ZZipWriter::ChooseClass(const Source &source, const uint8_t *pHead, size_t sHeadLength) const
+{
+	if (ZIP_LEVEL_AUTO != m_nLevel)
+	{
+		// Fixed level, classified for the stats only
+		if (0 == m_nLevel)
+		{
+			return E_ZIP_STORE;
+		}
+		return (m_nLevel <= ZIP_POLICY_FAST_MAX_LEVEL) ? E_ZIP_FAST : E_ZIP_BEST;
+	}
+
+	if (S_ISLNK(source.uMode) || _ZipHasExtension(source.strName, s_arrStoreExtensions))
+	{
+		return E_ZIP_STORE;
+	}
+
+	// CodeResources is an XML plist without an extension
+	string strFileName = source.strName.substr(source.strName.rfind('/') + 1);
+	if (_ZipHasExtension(source.strName, s_arrBestExtensions) || "CodeResources" == strFileName)
+	{
+		return E_ZIP_BEST;
+	}
+
+	// Unknown type, let the data decide
+	if (sHeadLength > 0)
+	{
+		double fEntropy = _ZipEntropy(pHead, sHeadLength);
+		if (fEntropy >= ZIP_POLICY_STORE_ENTROPY)
+		{
+			return E_ZIP_STORE;
+		}
+		if (fEntropy < ZIP_POLICY_BEST_ENTROPY)
+		{
+			return E_ZIP_BEST;
+		}
+	}
+	return E_ZIP_FAST;
+}
+
+bool ZZipWriter::CompressBlock(Block &block, const uint8_t *pData)
+{
+	const Source &source = m_arrSources[block.uSource];
+	if (NULL != source.pEntry)
+	{
+		// Passthrough: the data stays in the source mapping and is written from there
+		block.uMethod = source.pEntry->uMethod;
+		block.uCRC32 = source.pEntry->uCRC32;
+		return source.pReader->GetEntryData(*source.pEntry, block.pRawData, block.strError);
+	}
+
+	// Later blocks are primed with the preceding 32 KiB so the ratio matches a single stream
+	uint64_t uDictLength = (block.bFirst || 0 == _ZipClassLevel(m_nLevel, block.nClass)) ? 0 : min<uint64_t>(block.uOffset, ZIP_DEFLATE_DICT_SIZE);
+	string strInput;
+	if (NULL != pData)
+	{
+		// Whole file already read by the caller
+		uDictLength = 0;
+	}
+	else if (!ReadSource(source, block.uOffset - uDictLength, block.uLength + uDictLength, strInput, block.strError))
+	{
+		return false;
+	}
+	else
+	{
+		pData = (const uint8_t *)strInput.data();
+	}
+
+	const Bytef *pInput = (const Bytef *)pData + uDictLength;
+	block.uCRC32 = (uint32_t)crc32(crc32(0L, Z_NULL, 0), pInput, (uInt)block.uLength);
+
+	if (block.nClass < 0)
+	{
+		block.nClass = ChooseClass(source, pInput, min<uint64_t>(block.uLength, ZIP_POLICY_SAMPLE_SIZE));
+	}
+
+	int nLevel = _ZipClassLevel(m_nLevel, block.nClass);
+	if (0 == nLevel)
+	{
+		block.uMethod = ZIP_METHOD_STORE;
+		block.strData.assign((const char *)pInput, block.uLength);
+		return true;
+	}
+
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (Z_OK != deflateInit2(&zs, nLevel, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY))
+	{
+		block.strError = "deflateInit failed";
+		return false;
+	}
+
+	if (uDictLength > 0)
+	{
+		deflateSetDictionary(&zs, (const Bytef *)pData, (uInt)uDictLength);
+	}
+
+	block.strData.resize(deflateBound(&zs, (uLong)block.uLength) + 16);
+	zs.next_in = (Bytef *)pInput;
+	zs.avail_in = (uInt)block.uLength;
+	zs.next_out = (Bytef *)&block.strData[0];
+	zs.avail_out = (uInt)block.strData.size();
+
+	// Non-final blocks end on a byte boundary with a sync flush so they can be concatenated
+	int nRet = deflate(&zs, block.bLast ? Z_FINISH : Z_SYNC_FLUSH);
+	bool bRet = block.bLast ? (Z_STREAM_END == nRet) : (Z_OK == nRet && 0 == zs.avail_in);
+	block.strData.resize(zs.total_out);
+	deflateEnd(&zs);
+
+	if (!bRet)
+	{
+		StringFormat(block.strError, "deflate failed (%d)", nRet);
+		return false;
+	}
+
+	block.uMethod = ZIP_METHOD_DEFLATE;
+	if (block.bFirst && block.bLast && block.strData.size() >= block.uLength)
+	{
+		block.uMethod = ZIP_METHOD_STORE;
+		block.strData.assign((const char *)pInput, block.uLength);
+	}
+	return true;
+}
+
+bool ZZipWriter::WriteTo(const char *szFile)
+{
+	m_arrErrors.clear();
+	m_stats = ZZipStats();
+
+	// readdir() order and the order passthrough entries were added in vary between runs
+	if (m_bDeterministic)
+	{
+		stable_sort(m_arrSources.begin(), m_arrSources.end(), [](const Source &a, const Source &b) {
+			return a.strName < b.strName;
+		});
+	}
+
+	vector<Block> arrBlocks;
+	for (size_t i = 0; i < m_arrSources.size(); i++)
+	{
+		const Source &source = m_arrSources[i];
+		if (S_ISDIR(source.uMode))
+		{
+			continue;
+		}
+
+		// All blocks of an entry must agree on its compression, so entries spanning
+		// several blocks are classified here. Single-block entries are classified
+		// by the worker that reads them anyway.
+		int nClass = source.nClass;
+		if (nClass < 0 && source.uSize > ZIP_DEFLATE_BLOCK_SIZE)
+		{
+			string strHead;
+			string strError;
+			if (ZIP_LEVEL_AUTO == m_nLevel)
+			{
+				ReadSource(source, 0, ZIP_POLICY_SAMPLE_SIZE, strHead, strError);
+			}
+			nClass = ChooseClass(source, (const uint8_t *)strHead.data(), strHead.size());
+		}
+
+		uint64_t uOffset = 0;
+		do
+		{
+			Block block;
+			block.uSource = i;
+			block.uOffset = uOffset;
+			block.uLength = min<uint64_t>(source.uSize - uOffset, ZIP_DEFLATE_BLOCK_SIZE);
+			if (NULL != source.pEntry)
+			{
+				block.uLength = source.uSize;
+			}
+			block.bFirst = (0 == uOffset);
+			block.bLast = (uOffset + block.uLength >= source.uSize);
+			block.bDone = false;
+			block.bFailed = false;
+			block.pRawData = NULL;
+			block.uMethod = ZIP_METHOD_STORE;
+			block.uCRC32 = 0;
+			block.nClass = nClass;
+			block.uCPUTime = 0;
+			arrBlocks.push_back(block);
+			uOffset += block.uLength;
+		} while (uOffset < source.uSize);
+	}
+
+	// Written next to szFile and renamed over it once complete, so a failed
+	// write keeps what was there and other hard links to it are never touched
+	string strTempFile = string(szFile) + ".tmp";
+	unlink(strTempFile.c_str());
+	int fd = open(strTempFile.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+	{
+		ZLog::ErrorV(">>> Can't Create Zip File! %s, %s\n", strTempFile.c_str(), strerror(errno));
+		return false;
+	}
+
+	// Workers compress ahead of the writer within a bounded window of input bytes.
+	// Passthrough blocks stay in the source mapping and don't count.
+	vector<uint64_t> arrWindowEnds(arrBlocks.size());
+	uint64_t uWindowEnd = 0;
+	for (size_t i = 0; i < arrBlocks.size(); i++)
+	{
+		uWindowEnd += (NULL != m_arrSources[arrBlocks[i].uSource].pEntry) ? 0 : arrBlocks[i].uLength;
+		arrWindowEnds[i] = uWindowEnd;
+	}
+
+	mutex mutexBlocks;
+	condition_variable cvWork;
+	condition_variable cvDone;
+	size_t uNextBlock = 0;
+	size_t uWrittenBlocks = 0;
+	bool bAbort = false;
+	int nThreadCount = (int)min<size_t>(_GetThreadCount(m_nThreadCount), max<size_t>(arrBlocks.size(), 1));
+	uint64_t uWindow = (uint64_t)nThreadCount * ZIP_DEFLATE_BLOCKS_PER_THREAD * ZIP_DEFLATE_BLOCK_SIZE;
+
+	auto inWindowLambda = [&](size_t uIndex) {
+		uint64_t uWindowStart = (uWrittenBlocks > 0) ? arrWindowEnds[uWrittenBlocks - 1] : 0;
+		return uIndex == uWrittenBlocks || arrWindowEnds[uIndex] - uWindowStart <= uWindow;
+	};
+
+	auto isBatchLambda = [&](size_t uIndex) {
+		const Block &block = arrBlocks[uIndex];
+		const Source &source = m_arrSources[block.uSource];
+		return NULL == source.pEntry && S_ISREG(source.uMode) && block.bFirst && block.bLast && source.uSize <= ZBatchIO::GetMaxFileSize();
+	};
+
+	auto finishLambda = [&](Block &block, bool bRet) {
+		lock_guard<mutex> lock(mutexBlocks);
+		block.bFailed = !bRet;
+		block.bDone = true;
+		cvDone.notify_all();
+	};
+
+	ZCancelToken *pCancelToken = ZCancelToken::GetCurrent();
+	auto workerLambda = [&]() {
+		ZCancelScope scope(pCancelToken);
+		ZBatchIO batchIO;
+		vector<string> arrPaths;
+		while (true)
+		{
+			unique_lock<mutex> lock(mutexBlocks);
+			cvWork.wait(lock, [&] {
+				return bAbort || uNextBlock >= arrBlocks.size() || inWindowLambda(uNextBlock);
+			});
+			if (bAbort || uNextBlock >= arrBlocks.size())
+			{
+				break;
+			}
+
+			// A run of small files is taken as a whole so it can be read in one batch
+			size_t uFirst = uNextBlock++;
+			if (isBatchLambda(uFirst))
+			{
+				while (uNextBlock < arrBlocks.size() && uNextBlock - uFirst < ZIP_BATCH_FILES &&
+					   isBatchLambda(uNextBlock) && inWindowLambda(uNextBlock))
+				{
+					uNextBlock++;
+				}
+			}
+			size_t uLast = uNextBlock;
+			lock.unlock();
+
+			// Fail what is taken so the writer stops at its next block
+			if (ZCancelToken::IsCurrentCancelled())
+			{
+				for (size_t i = uFirst; i < uLast; i++)
+				{
+					arrBlocks[i].strError = "cancelled";
+					finishLambda(arrBlocks[i], false);
+				}
+				continue;
+			}
+
+			if (uLast - uFirst == 1)
+			{
+				Block &block = arrBlocks[uFirst];
+				uint64_t uStartTime = _ThreadCPUTime();
+				bool bRet = CompressBlock(block);
+				block.uCPUTime = _ThreadCPUTime() - uStartTime;
+				finishLambda(block, bRet);
+				continue;
+			}
+
+			arrPaths.clear();
+			for (size_t i = uFirst; i < uLast; i++)
+			{
+				arrPaths.push_back(m_arrSources[arrBlocks[i].uSource].strPath);
+			}
+
+			batchIO.ReadFiles(arrPaths, [&](size_t uIndex, const uint8_t *pData, size_t sLength, int nError) {
+				Block &block = arrBlocks[uFirst + uIndex];
+				uint64_t uStartTime = _ThreadCPUTime();
+				bool bRet = false;
+				if (0 != nError)
+				{
+					block.strError = strerror(nError);
+				}
+				else if (sLength != block.uLength)
+				{
+					block.strError = "file changed while archiving";
+				}
+				else
+				{
+					bRet = CompressBlock(block, pData);
+				}
+				block.uCPUTime = _ThreadCPUTime() - uStartTime;
+				finishLambda(block, bRet);
+			});
+		}
+	};
+
+	vector<thread> workers;
+	for (int i = 0; i < nThreadCount; i++)
+	{
+		workers.emplace_back(workerLambda);
+	}
+
+	auto waitBlock = [&](Block &block) {
+		unique_lock<mutex> lock(mutexBlocks);
+		cvDone.wait(lock, [&] { return block.bDone; });
+		if (block.bFailed)
+		{
+			m_arrErrors.push_back(m_arrSources[block.uSource].strName + ": " + block.strError);
+			return false;
+		}
+		return true;
+	};
+
+	auto releaseBlock = [&](Block &block) {
+		string().swap(block.strData);
+		lock_guard<mutex> lock(mutexBlocks);
+		uWrittenBlocks++;
+		cvWork.notify_all();
+	};
+
+	auto blockSize = [&](const Block &block) {
+		return (NULL != block.pRawData) ? m_arrSources[block.uSource].pEntry->uCompressedSize : (uint64_t)block.strData.size();
+	};
+
+	ZZipOutput output(fd);
+	string strCentralDir;
+	size_t uBlock = 0;
+	bool bRet = true;
+	for (size_t i = 0; i < m_arrSources.size() && bRet; i++)
+	{
+		const Source &source = m_arrSources[i];
+		uint64_t uHeaderOffset = output.GetOffset();
+		uint16_t uMethod = ZIP_METHOD_STORE;
+		uint32_t uCRC32 = 0;
+		uint64_t uCompressedSize = 0;
+		bool bPatch = false;
+
+		if (!S_ISDIR(source.uMode))
+		{
+			if (!waitBlock(arrBlocks[uBlock]))
+			{
+				bRet = false;
+				break;
+			}
+			uMethod = arrBlocks[uBlock].uMethod;
+			if (arrBlocks[uBlock].bLast)
+			{
+				uCRC32 = arrBlocks[uBlock].uCRC32;
+				uCompressedSize = blockSize(arrBlocks[uBlock]);
+			}
+			else
+			{
+				bPatch = true;
+			}
+		}
+
+		uint16_t uTime = 0;
+		uint16_t uDate = 0;
+		_ZipDosTime(m_bDeterministic ? m_tFixedTime : source.tModTime, m_bDeterministic, uTime, uDate);
+		uint16_t uVersion = (ZIP_METHOD_DEFLATE == uMethod) ? ZIP_VERSION_DEFLATE : ZIP_VERSION_STORE;
+		uint16_t uFlags = _ZipNameFlags(source.strName);
+
+		string strExtra;
+		if (!m_bDeterministic)
+		{
+			_ZipWrite16(strExtra, ZIP_EXTRA_TIMESTAMP);
+			_ZipWrite16(strExtra, 5);
+			strExtra.push_back(1);
+			_ZipWrite32(strExtra, (uint32_t)source.tModTime);
+		}
+
+		// Sizes of big entries live in a Zip64 extra field, sized before the data is known
+		bool bZip64 = (source.uSize >= ZIP64_LOCAL_THRESHOLD || uCompressedSize >= ZIP64_LOCAL_THRESHOLD);
+		string strLocalExtra;
+		if (bZip64)
+		{
+			uVersion = ZIP_VERSION_ZIP64;
+			_ZipWrite16(strLocalExtra, ZIP_EXTRA_ZIP64);
+			_ZipWrite16(strLocalExtra, 16);
+			_ZipWrite64(strLocalExtra, source.uSize);
+			_ZipWrite64(strLocalExtra, uCompressedSize);
+		}
+		strLocalExtra += strExtra;
+
+		string strHeader;
+		_ZipWrite32(strHeader, ZIP_LOCAL_HEADER_SIGNATURE);
+		_ZipWrite16(strHeader, uVersion);
+		_ZipWrite16(strHeader, uFlags);
+		_ZipWrite16(strHeader, uMethod);
+		_ZipWrite16(strHeader, uTime);
+		_ZipWrite16(strHeader, uDate);
+		_ZipWrite32(strHeader, uCRC32);
+		_ZipWrite32(strHeader, bZip64 ? ZIP64_MARKER_32 : (uint32_t)uCompressedSize);
+		_ZipWrite32(strHeader, bZip64 ? ZIP64_MARKER_32 : (uint32_t)source.uSize);
+		_ZipWrite16(strHeader, (uint16_t)source.strName.size());
+		_ZipWrite16(strHeader, (uint16_t)strLocalExtra.size());
+		strHeader += source.strName;
+		strHeader += strLocalExtra;
+		bRet = output.Write(strHeader);
+
+		if (!S_ISDIR(source.uMode))
+		{
+			// Stream the blocks of this entry in order, combining their CRCs
+			uCRC32 = 0;
+			uCompressedSize = 0;
+			while (bRet)
+			{
+				Block &block = arrBlocks[uBlock++];
+				if (!waitBlock(block))
+				{
+					bRet = false;
+					break;
+				}
+				uCRC32 = (uint32_t)crc32_combine(uCRC32, block.uCRC32, (z_off_t)block.uLength);
+				uCompressedSize += blockSize(block);
+				m_stats.arrEntries[block.nClass] += block.bFirst ? 1 : 0;
+				m_stats.arrInputBytes[block.nClass] += block.uLength;
+				m_stats.arrOutputBytes[block.nClass] += blockSize(block);
+				m_stats.arrCPUTime[block.nClass] += block.uCPUTime;
+				if (NULL != block.pRawData)
+				{
+					bRet = output.Write((const char *)block.pRawData, (size_t)blockSize(block));
+				}
+				else
+				{
+					bRet = output.Write(block.strData);
+				}
+				bool bLast = block.bLast;
+				releaseBlock(block);
+				if (bLast)
+				{
+					break;
+				}
+			}
+
+			if (bRet && bPatch)
+			{
+				string strPatch;
+				_ZipWrite32(strPatch, uCRC32);
+				if (bZip64)
+				{
+					string strSizePatch;
+					_ZipWrite64(strSizePatch, uCompressedSize);
+					bRet = output.Patch(uHeaderOffset + 14, strPatch) &&
+						   output.Patch(uHeaderOffset + ZIP_LOCAL_HEADER_SIZE + source.strName.size() + 12, strSizePatch);
+				}
+				else if (uCompressedSize >= ZIP64_MARKER_32)
+				{
+					m_arrErrors.push_back(source.strName + ": compressed data outgrew its local header");
+					bRet = false;
+					break;
+				}
+				else
+				{
+					_ZipWrite32(strPatch, (uint32_t)uCompressedSize);
+					bRet = output.Patch(uHeaderOffset + 14, strPatch);
+				}
+			}
+		}
+
+		// The central record only carries the Zip64 fields that don't fit in 32 bits
+		bool bOffset64 = (uHeaderOffset >= ZIP64_MARKER_32);
+		string strCentralExtra;
+		if (bZip64 || bOffset64)
+		{
+			uVersion = ZIP_VERSION_ZIP64;
+			_ZipWrite16(strCentralExtra, ZIP_EXTRA_ZIP64);
+			_ZipWrite16(strCentralExtra, (bZip64 ? 16 : 0) + (bOffset64 ? 8 : 0));
+			if (bZip64)
+			{
+				_ZipWrite64(strCentralExtra, source.uSize);
+				_ZipWrite64(strCentralExtra, uCompressedSize);
+			}
+			if (bOffset64)
+			{
+				_ZipWrite64(strCentralExtra, uHeaderOffset);
+			}
+		}
+		strCentralExtra += strExtra;
+
+		_ZipWrite32(strCentralDir, ZIP_CENTRAL_HEADER_SIGNATURE);
+		_ZipWrite16(strCentralDir, ZIP_VERSION_MADE_BY);
+		_ZipWrite16(strCentralDir, uVersion);
+		_ZipWrite16(strCentralDir, uFlags);
+		_ZipWrite16(strCentralDir, uMethod);
+		_ZipWrite16(strCentralDir, uTime);
+		_ZipWrite16(strCentralDir, uDate);
+		_ZipWrite32(strCentralDir, uCRC32);
+		_ZipWrite32(strCentralDir, bZip64 ? ZIP64_MARKER_32 : (uint32_t)uCompressedSize);
+		_ZipWrite32(strCentralDir, bZip64 ? ZIP64_MARKER_32 : (uint32_t)source.uSize);
+		_ZipWrite16(strCentralDir, (uint16_t)source.strName.size());
+		_ZipWrite16(strCentralDir, (uint16_t)strCentralExtra.size());
+		_ZipWrite16(strCentralDir, 0);
+		_ZipWrite16(strCentralDir, 0);
+		_ZipWrite16(strCentralDir, 0);
+		// Permissions of files written during signing depend on the umask
+		uint32_t uMode = source.uMode;
+		if (m_bDeterministic)
+		{
+			uMode = (uMode & S_IFMT) | (S_ISDIR(uMode) ? 0755 : (S_ISLNK(uMode) ? 0777 : ((uMode & 0111) ? 0755 : 0644)));
+		}
+		_ZipWrite32(strCentralDir, (uMode << 16) | (S_ISDIR(uMode) ? ZIP_DOS_ATTR_FOLDER : 0));
+		_ZipWrite32(strCentralDir, bOffset64 ? ZIP64_MARKER_32 : (uint32_t)uHeaderOffset);
+		strCentralDir += source.strName;
+		strCentralDir += strCentralExtra;
+	}
+
+	{
+		lock_guard<mutex> lock(mutexBlocks);
+		bAbort = true;
+		cvWork.notify_all();
+	}
+	for (auto &worker : workers)
+	{
+		worker.join();
+	}
+
+	if (bRet)
+	{
+		uint64_t uEntryCount = m_arrSources.size();
+		uint64_t uDirOffset = output.GetOffset();
+		uint64_t uDirSize = strCentralDir.size();
+		bool bEnd64 = (uEntryCount >= ZIP64_MARKER_16 || uDirOffset >= ZIP64_MARKER_32 || uDirSize >= ZIP64_MARKER_32);
+
+		string strEnd;
+		if (bEnd64)
+		{
+			_ZipWrite32(strEnd, ZIP64_END_OF_CENTRAL_DIR_SIGNATURE);
+			_ZipWrite64(strEnd, ZIP64_END_OF_CENTRAL_DIR_SIZE - 12);
+			_ZipWrite16(strEnd, ZIP_VERSION_MADE_BY);
+			_ZipWrite16(strEnd, ZIP_VERSION_ZIP64);
+			_ZipWrite32(strEnd, 0);
+			_ZipWrite32(strEnd, 0);
+			_ZipWrite64(strEnd, uEntryCount);
+			_ZipWrite64(strEnd, uEntryCount);
+			_ZipWrite64(strEnd, uDirSize);
+			_ZipWrite64(strEnd, uDirOffset);
+
+			_ZipWrite32(strEnd, ZIP64_END_OF_CENTRAL_DIR_LOCATOR_SIGNATURE);
+			_ZipWrite32(strEnd, 0);
+			_ZipWrite64(strEnd, uDirOffset + uDirSize);
+			_ZipWrite32(strEnd, 1);
+		}
+
+		_ZipWrite32(strEnd, ZIP_END_OF_CENTRAL_DIR_SIGNATURE);
+		_ZipWrite16(strEnd, 0);
+		_ZipWrite16(strEnd, 0);
+		_ZipWrite16(strEnd, (uint16_t)min<uint64_t>(uEntryCount, ZIP64_MARKER_16));
+		_ZipWrite16(strEnd, (uint16_t)min<uint64_t>(uEntryCount, ZIP64_MARKER_16));
+		_ZipWrite32(strEnd, (uint32_t)min<uint64_t>(uDirSize, ZIP64_MARKER_32));
+		_ZipWrite32(strEnd, (uint32_t)min<uint64_t>(uDirOffset, ZIP64_MARKER_32));
+		_ZipWrite16(strEnd, 0);
+		bRet = output.Write(strCentralDir) && output.Write(strEnd) && output.Flush();
+	}
+
+	if (0 != close(fd))
+	{
+		bRet = false;
+	}
+	if (bRet && 0 != rename(strTempFile.c_str(), szFile))
+	{
+		bRet = false;
+	}
+
+	if (!bRet && m_arrErrors.empty())
+	{
+		m_arrErrors.push_back(string(szFile) + ": " + strerror(errno));
+	}
+
+	for (const auto &strError : m_arrErrors)
+	{
+		ZLog::ErrorV(">>> Zip Entry Failed! %s\n", strError.c_str());
+	}
+
+	if (!bRet)
+	{
+		RemoveFile(strTempFile.c_str());
+	}
+	return bRet;
+}
@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+"""Builds and checks the synthetic IPA of the Zip64 round-trip test.
+
+  zip64_ipa.py make <executable> <out.ipa>
+  zip64_ipa.py check <in.ipa>
+
+The IPA holds one app with a >4 GiB file of zeros followed by more than 65535
+small files, all stored, so entry sizes, local header offsets, the entry count
+and the central directory offset all need Zip64. Python's zipfile writes it,
+so arksigning's reader is tested against an independent Zip64 writer.
+"""
+
+import sys
+import zipfile
+
+APP = "Payload/Zip64.app/"
+BIG_SIZE = (4 << 30) + (64 << 20)
+SMALL_FOLDERS = 70
+SMALL_FILES = 1000
+CHUNK = 16 << 20
+
+INFO_PLIST = """<?xml version="1.0" encoding="UTF-8"?>
+<!DOCTYPE plist PUBLIC "-//Apple//DTD PLIST 1.0//EN" "http://www.apple.com/DTDs/PropertyList-1.0.dtd">
+<plist version="1.0"><dict>
+<key>CFBundleIdentifier</key><string>com.test.zip64</string>
+<key>CFBundleExecutable</key><string>Zip64</string>
+<key>CFBundleName</key><string>Zip64</string>
+<key>CFBundleVersion</key><string>1.0</string>
+</dict></plist>
+"""
+
+
+def add_file(zf, name, data, mode=0o644):
+    info = zipfile.ZipInfo(name, (2020, 1, 1, 0, 0, 0))
+    info.external_attr = (0o100000 | mode) << 16
+    zf.writestr(info, data)
+
+
+def make(executable, output):
+    with open(executable, "rb") as f:
+        exe = f.read()
+
+    with zipfile.ZipFile(output, "w", zipfile.ZIP_STORED, allowZip64=True) as zf:
+        # Sorts first, so every later entry lives above 4 GiB
+        info = zipfile.ZipInfo(APP + "A_big.bin", (2020, 1, 1, 0, 0, 0))
+        info.external_attr = 0o100644 << 16
+        zero = bytes(CHUNK)
+        with zf.open(info, "w", force_zip64=True) as f:
+            left = BIG_SIZE
+            while left > 0:
+                f.write(zero[:min(left, CHUNK)])
+                left -= CHUNK
+
+        add_file(zf, APP + "Info.plist", INFO_PLIST)
+        add_file(zf, APP + "Zip64", exe, 0o755)
+        for d in range(SMALL_FOLDERS):
+            for i in range(SMALL_FILES):
+                add_file(zf, APP + "files/%02d/%04d.txt" % (d, i), "%d/%d\n" % (d, i))
+
+
+def check(path):
+    with zipfile.ZipFile(path) as zf:
+        infos = zf.infolist()
+        names = set(i.filename for i in infos)
+        big = [i for i in infos if i.filename.endswith("/A_big.bin")]
+        errors = []
+        if len(infos) <= 0xffff:
+            errors.append("only %d entries" % len(infos))
+        if len(big) != 1 or big[0].file_size != BIG_SIZE:
+            errors.append("big entry missing or wrong size")
+        if max(i.header_offset for i in infos) < 0xffffffff:
+            errors.append("no entry above 4 GiB")
+        for d in (0, SMALL_FOLDERS - 1):
+            name = APP + "files/%02d/%04d.txt" % (d, SMALL_FILES - 1)
+            if name not in names or zf.read(name) != b"%d/%d\n" % (d, SMALL_FILES - 1):
+                errors.append("missing or wrong " + name)
+        bad = zf.testzip()
+        if bad is not None:
+            errors.append("bad CRC in " + bad)
+
+    for error in errors:
+        print("%s: %s" % (path, error), file=sys.stderr)
+    if errors:
+        return 1
+    print("%s: %d entries, Zip64 OK" % (path, len(infos)))
+    return 0
+
+
+if __name__ == "__main__":
+    if len(sys.argv) == 4 and sys.argv[1] == "make":
+        make(sys.argv[2], sys.argv[3])
+    elif len(sys.argv) == 3 and sys.argv[1] == "check":
+        sys.exit(check(sys.argv[2]))
+    else:
+        print(__doc__, file=sys.stderr)
+        sys.exit(2)
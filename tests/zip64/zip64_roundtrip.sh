@@ -0,0 +1,70 @@
+#!/bin/bash
+
+# Zip64 round trip: signs a synthetic IPA with a >4 GiB entry and more than
+# 65535 entries, then signs the result again, checking each output with
+# zip64_ipa.py and unzip -t.
+#
+#   zip64_roundtrip.sh <arksigning> [work folder]
+#
+# Needs python3 and openssl, and about 15 GB free in the work folder and in
+# --workdir (default /tmp). Opt-in from CMake with -DARKSIGNING_ZIP64_TEST=ON.
+
+set -e
+
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+ARKSIGNING="$1"
+WORK="${2:-$(mktemp -d)}"
+EXECUTABLE="$SCRIPT_DIR/../../releases/arksigning-v0.6.1-macos-arm64"
+
+if [ ! -x "$ARKSIGNING" ]; then
+    echo "usage: $0 <arksigning> [work folder]" >&2
+    exit 2
+fi
+
+rm -rf "$WORK"
+mkdir -p "$WORK"
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK"
+
+# Throwaway identity, the profile only has to parse
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -keyout key.pem -out cert.pem \
+    -subj "/CN=Zip64 Test/OU=ABCDE12345" 2>/dev/null
+cat > prov.plist <<EOF
+<?xml version="1.0" encoding="UTF-8"?>
+<!DOCTYPE plist PUBLIC "-//Apple//DTD PLIST 1.0//EN" "http://www.apple.com/DTDs/PropertyList-1.0.dtd">
+<plist version="1.0"><dict>
+<key>Name</key><string>Zip64Test</string>
+<key>TeamIdentifier</key><array><string>ABCDE12345</string></array>
+<key>Entitlements</key><dict><key>application-identifier</key><string>ABCDE12345.com.test.zip64</string></dict>
+</dict></plist>
+EOF
+openssl cms -sign -nodetach -outform DER -signer cert.pem -inkey key.pem -in prov.plist -out test.mobileprovision
+
+check() {
+    python3 "$SCRIPT_DIR/zip64_ipa.py" check "$1"
+    if command -v unzip >/dev/null; then
+        unzip -tqq "$1"
+    fi
+}
+
+sign() {
+    "$ARKSIGNING" -q -z 0 --deterministic -k key.pem -c cert.pem -m test.mobileprovision -o "$2" "$1"
+}
+
+echo "Generating input..."
+python3 "$SCRIPT_DIR/zip64_ipa.py" make "$EXECUTABLE" input.ipa
+check input.ipa
+
+# Reads a third-party Zip64 archive, writes our own
+echo "Signing input..."
+sign input.ipa signed.ipa
+rm -f input.ipa
+check signed.ipa
+
+# Reads our own Zip64 output back
+echo "Signing the signed output..."
+sign signed.ipa resigned.ipa
+rm -f signed.ipa
+check resigned.ipa
+
+echo "Zip64 round trip OK"
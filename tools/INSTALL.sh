@@ -64,7 +64,7 @@ install_macos_deps() {
 
     # Install dependencies
     log_info "Installing OpenSSL, CMake, and utilities..."
-    brew install openssl@3 cmake zip unzip || {
+    brew install openssl@3 cmake || {
         log_warning "Some packages might already be installed, continuing..."
     }
 
@@ -94,8 +94,6 @@ install_ubuntu_deps() {
         cmake \
         libssl-dev \
         zlib1g-dev \
-        zip \
-        unzip \
         git \
         pkg-config || {
         log_error "Failed to install dependencies"
@@ -119,8 +117,6 @@ install_centos_deps() {
         openssl-devel \
         zlib-devel \
         cmake \
-        zip \
-        unzip \
         git \
         wget || {
         log_error "Failed to install dependencies"